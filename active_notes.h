@@ -0,0 +1,101 @@
+/**
+ * Fluidsynth for ImpactLX49+
+ * 
+ * Copyright (C) 2021 Thomas Keck
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <array>
+#include <bit>
+#include <cstdint>
+
+#include "midi_event.h"
+#include "midi_enums.h"
+
+/**
+ * Set of the notes that are sounding, 128 bits per midi channel.
+ *
+ * Note on events add their key, note off events (or note on events with
+ * velocity 0) remove it. Releasing all notes only visits the channels and
+ * keys which are set, hence it costs as many note offs as notes are held
+ * instead of a note off for every key or an all-notes-off on every channel.
+ */
+class ActiveNotes {
+
+    public:
+        ActiveNotes() : channels(0) {
+            clear();
+        }
+
+        void update(const MidiEvent &event) {
+            if (event.type != midi_event_type::NOTE_ON && event.type != midi_event_type::NOTE_OFF) {
+                return;
+            }
+            uint64_t &word = keys[event.channel & 0xf][(event.key() >> 6) & 1];
+            uint64_t bit = uint64_t(1) << (event.key() & 0x3f);
+            if (event.type == midi_event_type::NOTE_ON && event.velocity() > 0) {
+                word |= bit;
+                channels |= 1 << (event.channel & 0xf);
+            } else {
+                word &= ~bit;
+            }
+        }
+
+        bool contains(int channel, int key) const {
+            return (keys[channel & 0xf][(key >> 6) & 1] >> (key & 0x3f)) & 1;
+        }
+
+        void clear() {
+            for (auto &channel_keys : keys) {
+                channel_keys.fill(0);
+            }
+            channels = 0;
+        }
+
+        /**
+         * Calls the function with the channel and key of every note in the set.
+         */
+        template<typename Function>
+        void forEach(Function function) const {
+            for (uint16_t remaining = channels; remaining != 0; remaining &= remaining - 1) {
+                int channel = std::countr_zero(remaining);
+                for (int half = 0; half < 2; ++half) {
+                    for (uint64_t word = keys[channel][half]; word != 0; word &= word - 1) {
+                        function(channel, half * 64 + std::countr_zero(word));
+                    }
+                }
+            }
+        }
+
+        /**
+         * Calls the function with every channel on which the key is in the set.
+         */
+        template<typename Function>
+        void forEachChannel(int key, Function function) const {
+            for (uint16_t remaining = channels; remaining != 0; remaining &= remaining - 1) {
+                int channel = std::countr_zero(remaining);
+                if (contains(channel, key)) {
+                    function(channel);
+                }
+            }
+        }
+
+    private:
+        std::array<std::array<uint64_t, 2>, 16> keys;
+        // Bit per channel which may have keys set, a note off does not clear it.
+        uint16_t channels;
+};
@@ -0,0 +1,207 @@
+/**
+ * Fluidsynth for ImpactLX49+
+ * 
+ * Copyright (C) 2021 Thomas Keck
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <cerrno>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <iostream>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "audio_capture.h"
+
+#define WAV_HEADER_SIZE 94
+#define WAV_FORMAT_FLOAT 3
+// The sizes of a RIFF file are 32 bit, larger captures are written as RF64 (EBU Tech 3306).
+#define WAV_MAX_RIFF_SIZE 0xffffffffu
+#define WAV_DS64_SIZE 28
+
+/**
+ * Writes the WAV header for the given number of frames.
+ *
+ * The header reserves a JUNK chunk of the size of a ds64 chunk. If the
+ * capture outgrows the 32 bit sizes of RIFF, the file becomes an RF64 file:
+ * the JUNK chunk turns into the ds64 chunk with the 64 bit sizes, and the
+ * 32 bit sizes are set to -1. Hence a capture of any length is written
+ * without moving its samples.
+ */
+static bool write_wav_header(int fd, int sample_rate, long frames) {
+    uint64_t data_size = static_cast<uint64_t>(frames) * CAPTURE_CHANNELS * sizeof(float);
+    uint64_t riff_size = WAV_HEADER_SIZE - 8 + data_size;
+    bool is_rf64 = riff_size > WAV_MAX_RIFF_SIZE;
+    uint16_t block_align = CAPTURE_CHANNELS * sizeof(float);
+    uint32_t byte_rate = sample_rate * block_align;
+    char header[WAV_HEADER_SIZE];
+    auto put16 = [&](int offset, uint16_t value) { std::memcpy(header + offset, &value, sizeof(value)); };
+    auto put32 = [&](int offset, uint32_t value) { std::memcpy(header + offset, &value, sizeof(value)); };
+    auto put64 = [&](int offset, uint64_t value) { std::memcpy(header + offset, &value, sizeof(value)); };
+    auto put_size32 = [&](int offset, uint64_t value) { put32(offset, is_rf64 ? WAV_MAX_RIFF_SIZE : value); };
+    std::memcpy(header, is_rf64 ? "RF64" : "RIFF", 4);
+    put_size32(4, riff_size);
+    std::memcpy(header + 8, "WAVE", 4);
+    std::memcpy(header + 12, is_rf64 ? "ds64" : "JUNK", 4);
+    put32(16, WAV_DS64_SIZE);
+    put64(20, is_rf64 ? riff_size : 0);
+    put64(28, is_rf64 ? data_size : 0);
+    put64(36, is_rf64 ? frames : 0);
+    // No table of further chunk sizes.
+    put32(44, 0);
+    // Formats other than PCM have the size of the format extension, which is empty for float.
+    std::memcpy(header + 48, "fmt ", 4);
+    put32(52, 18);
+    put16(56, WAV_FORMAT_FLOAT);
+    put16(58, CAPTURE_CHANNELS);
+    put32(60, sample_rate);
+    put32(64, byte_rate);
+    put16(68, block_align);
+    put16(70, 8 * sizeof(float));
+    put16(72, 0);
+    // Formats other than PCM require the fact chunk with the number of frames.
+    std::memcpy(header + 74, "fact", 4);
+    put32(78, 4);
+    put_size32(82, frames);
+    std::memcpy(header + 86, "data", 4);
+    put_size32(90, data_size);
+    return pwrite(fd, header, WAV_HEADER_SIZE, 0) == WAV_HEADER_SIZE;
+}
+
+
+AudioCapture::AudioCapture(double sample_rate) :
+    sample_rate(static_cast<int>(sample_rate)),
+    fd(-1),
+    ring(static_cast<size_t>(sample_rate) * CAPTURE_RING_SECONDS * CAPTURE_CHANNELS),
+    written_frames(0),
+    state(CaptureState::CAPTURE_IDLE),
+    dropped_frames(0),
+    reported_dropped_frames(0) {
+        write_buffer.resize(ring.capacity());
+}
+
+AudioCapture::~AudioCapture() {
+    // Nobody renders audio anymore, hence the writer need not wait for the audio thread.
+    int current = state.load();
+    if (current == CaptureState::CAPTURE_RUNNING || current == CaptureState::CAPTURE_STOPPING) {
+        state = CaptureState::CAPTURE_STOPPED;
+    }
+    if (writer.joinable()) {
+        writer.join();
+    }
+}
+
+bool AudioCapture::start(const std::string &path) {
+    if (state.load() != CaptureState::CAPTURE_IDLE) {
+        std::cerr << "An audio capture is already running" << std::endl;
+        return false;
+    }
+    // The previous writer has finished, since the state is idle again.
+    if (writer.joinable()) {
+        writer.join();
+    }
+    fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0 || not write_wav_header(fd, sample_rate, 0) || lseek(fd, WAV_HEADER_SIZE, SEEK_SET) < 0) {
+        std::cerr << "Failed to open audio capture " << path << ": " << std::strerror(errno) << std::endl;
+        if (fd >= 0) {
+            close(fd);
+        }
+        return false;
+    }
+    // Only the writer pops, hence nothing is left over from the previous capture.
+    written_frames = 0;
+    dropped_frames = 0;
+    reported_dropped_frames = 0;
+    state.store(CaptureState::CAPTURE_RUNNING, std::memory_order_release);
+    writer = std::thread(&AudioCapture::writeInBackground, this, path);
+    return true;
+}
+
+void AudioCapture::stop() {
+    int expected = CaptureState::CAPTURE_RUNNING;
+    if (not state.compare_exchange_strong(expected, CaptureState::CAPTURE_STOPPING)) {
+        std::cerr << "No audio capture is running" << std::endl;
+    }
+}
+
+void AudioCapture::append(int len, const float *left, const float *right) {
+    int current = state.load(std::memory_order_acquire);
+    if (current == CaptureState::CAPTURE_IDLE || current == CaptureState::CAPTURE_STOPPED) {
+        return;
+    }
+    if (current == CaptureState::CAPTURE_STOPPING) {
+        // Everything appended so far is in the ring before the writer sees this.
+        state.store(CaptureState::CAPTURE_STOPPED, std::memory_order_release);
+        return;
+    }
+    float chunk[CAPTURE_CHUNK_FRAMES * CAPTURE_CHANNELS];
+    for (int offset = 0; offset < len; offset += CAPTURE_CHUNK_FRAMES) {
+        int frames = std::min(len - offset, CAPTURE_CHUNK_FRAMES);
+        for (int frame = 0; frame < frames; ++frame) {
+            chunk[2 * frame] = left[offset + frame];
+            chunk[2 * frame + 1] = right[offset + frame];
+        }
+        if (not ring.push(chunk, frames * CAPTURE_CHANNELS)) {
+            dropped_frames.fetch_add(frames, std::memory_order_relaxed);
+        }
+    }
+}
+
+long AudioCapture::getDroppedFrames() const {
+    return dropped_frames.load(std::memory_order_relaxed);
+}
+
+void AudioCapture::writeInBackground(std::string path) {
+    while (state.load(std::memory_order_acquire) != CaptureState::CAPTURE_STOPPED) {
+        flush();
+        std::this_thread::sleep_for(std::chrono::milliseconds(CAPTURE_WRITE_INTERVAL));
+    }
+    flush();
+    if (not write_wav_header(fd, sample_rate, written_frames)) {
+        std::cerr << "Failed to write header of audio capture " << path << std::endl;
+    }
+    close(fd);
+    std::cout << "Captured " << static_cast<double>(written_frames) / sample_rate << " s of audio to " << path;
+    if (getDroppedFrames() > 0) {
+        std::cout << ", dropped " << getDroppedFrames() << " frames";
+    }
+    std::cout << std::endl;
+    state = CaptureState::CAPTURE_IDLE;
+}
+
+void AudioCapture::flush() {
+    size_t samples = ring.pop(write_buffer.data(), write_buffer.size());
+    const char *data = reinterpret_cast<const char*>(write_buffer.data());
+    size_t remaining = samples * sizeof(float);
+    while (remaining > 0) {
+        ssize_t written = write(fd, data, remaining);
+        if (written < 0) {
+            std::cerr << "Failed to write audio capture: " << std::strerror(errno) << std::endl;
+            break;
+        }
+        data += written;
+        remaining -= written;
+    }
+    written_frames += (samples * sizeof(float) - remaining) / (CAPTURE_CHANNELS * sizeof(float));
+
+    long dropped = dropped_frames.load(std::memory_order_relaxed);
+    if (dropped > reported_dropped_frames) {
+        std::cerr << "Audio capture overrun, dropped " << dropped - reported_dropped_frames << " frames" << std::endl;
+        reported_dropped_frames = dropped;
+    }
+}
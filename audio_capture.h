@@ -0,0 +1,88 @@
+/**
+ * Fluidsynth for ImpactLX49+
+ * 
+ * Copyright (C) 2021 Thomas Keck
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <atomic>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "ring_buffer.h"
+
+#define CAPTURE_CHANNELS 2
+// Size of the ring buffer in seconds of audio.
+#define CAPTURE_RING_SECONDS 2
+#define CAPTURE_WRITE_INTERVAL 100
+// Frames interleaved on the stack of the audio thread at once.
+#define CAPTURE_CHUNK_FRAMES 256
+
+/**
+ * Enum defining the states of an audio capture.
+ */
+enum CaptureState {
+    CAPTURE_IDLE = 0,
+    CAPTURE_RUNNING = 1,
+    // Requested by stop, until the audio thread has seen it.
+    CAPTURE_STOPPING = 2,
+    // The audio thread will not append anymore.
+    CAPTURE_STOPPED = 3,
+};
+
+/**
+ * Captures the rendered audio into a WAV file with 32 bit float samples.
+ * A capture longer than the 4 GiB of a WAV file (3.1 h) is written as RF64.
+ *
+ * The audio thread only copies every block into a lock-free ring buffer,
+ * which is allocated once in the constructor, hence it never blocks.
+ * A background thread writes the ring buffer to the file in large chunks.
+ * If the writer falls behind by more than the ring buffer, the blocks which
+ * do not fit are dropped and reported as overrun.
+ */
+class AudioCapture {
+
+    public:
+        AudioCapture(double sample_rate);
+        /**
+         * Must only be called once the audio thread does not call append anymore.
+         */
+        ~AudioCapture();
+        bool start(const std::string &path);
+        void stop();
+        /**
+         * Called by the audio thread after every rendered block.
+         */
+        void append(int len, const float *left, const float *right);
+        long getDroppedFrames() const;
+
+    private:
+        void writeInBackground(std::string path);
+        void flush();
+
+    private:
+        int sample_rate;
+        int fd;
+        RingBuffer<float> ring;
+        std::vector<float> write_buffer;
+        long written_frames;
+        std::atomic<int> state;
+        std::atomic<long> dropped_frames;
+        long reported_dropped_frames;
+        std::thread writer;
+};
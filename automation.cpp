@@ -0,0 +1,182 @@
+/**
+ * Fluidsynth for ImpactLX49+
+ * 
+ * Copyright (C) 2021 Thomas Keck
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+
+#include "automation.h"
+#include "midi_enums.h"
+
+
+AutomationLane::AutomationLane(uint8_t channel, uint8_t control, double tolerance) :
+    channel(channel),
+    control(control),
+    tolerance(tolerance),
+    has_pending_values(false),
+    min_slope(-std::numeric_limits<double>::infinity()),
+    max_slope(std::numeric_limits<double>::infinity()),
+    last_time(0),
+    last_value(0) {
+        breakpoints.reserve(AUTOMATION_LANE_RESERVE);
+}
+
+void AutomationLane::append(int time, int value) {
+    if (breakpoints.empty()) {
+        breakpoints.push_back({time, static_cast<float>(value)});
+        last_time = time;
+        last_value = value;
+        return;
+    }
+    // The knob was not moved during a long pause, so the value jumps at its end.
+    if (time - last_time > AUTOMATION_MAX_GAP) {
+        addPoint(time - 1, last_value);
+    }
+    addPoint(time, value);
+}
+
+void AutomationLane::finish() {
+    if (has_pending_values) {
+        addBreakpoint();
+    }
+}
+
+void AutomationLane::addPoint(int time, double value) {
+    const Breakpoint &start = breakpoints.back();
+    if (time <= start.time) {
+        // Values at the same time, the last one wins.
+        if (std::abs(value - start.value) > tolerance) {
+            breakpoints.push_back({time, static_cast<float>(value)});
+        }
+        last_time = time;
+        last_value = value;
+        return;
+    }
+    double duration = time - start.time;
+    double low = std::max(min_slope, (value - tolerance - start.value) / duration);
+    double high = std::min(max_slope, (value + tolerance - start.value) / duration);
+    if (has_pending_values && low > high) {
+        // The segment cannot be extended to this value, it ends at the previous one.
+        addBreakpoint();
+        addPoint(time, value);
+        return;
+    }
+    has_pending_values = true;
+    min_slope = low;
+    max_slope = high;
+    last_time = time;
+    last_value = value;
+}
+
+void AutomationLane::addBreakpoint() {
+    const Breakpoint start = breakpoints.back();
+    double duration = last_time - start.time;
+    // Any slope between the bounds is within the tolerance, the closest one to the last value is chosen.
+    double slope = std::clamp((last_value - start.value) / duration, min_slope, max_slope);
+    breakpoints.push_back({last_time, static_cast<float>(start.value + slope * duration)});
+    has_pending_values = false;
+    min_slope = -std::numeric_limits<double>::infinity();
+    max_slope = std::numeric_limits<double>::infinity();
+}
+
+bool AutomationLane::read(AutomationCursor &cursor, int interval, int &time, int &value) const {
+    while (cursor.breakpoint < breakpoints.size()) {
+        const Breakpoint &start = breakpoints[cursor.breakpoint];
+        time = std::max(cursor.time, start.time);
+        double current_value = start.value;
+        if (cursor.breakpoint + 1 < breakpoints.size()) {
+            const Breakpoint &end = breakpoints[cursor.breakpoint + 1];
+            if (time >= end.time) {
+                // The end of a segment is played exactly at its time as start of the next one.
+                cursor.breakpoint++;
+                cursor.time = end.time;
+                continue;
+            }
+            current_value += (end.value - start.value) * (time - start.time) / (end.time - start.time);
+            // A flat segment needs no values in between.
+            cursor.time = (start.value == end.value) ? end.time : time + interval;
+        } else {
+            cursor.breakpoint++;
+        }
+        value = std::clamp(static_cast<int>(std::lround(current_value)), 0, 127);
+        if (value != cursor.last_value) {
+            cursor.last_value = value;
+            return true;
+        }
+    }
+    return false;
+}
+
+uint8_t AutomationLane::getChannel() const {
+    return channel;
+}
+
+uint8_t AutomationLane::getControl() const {
+    return control;
+}
+
+size_t AutomationLane::size() const {
+    return breakpoints.size();
+}
+
+
+Automation::Automation(double tolerance) : tolerance(tolerance) {
+    // The lanes are read by the sequencer thread while a take is recorded.
+    lanes.reserve(AUTOMATION_MAX_LANES);
+}
+
+void Automation::append(int time, MidiEvent event) {
+    for (auto &lane : lanes) {
+        if (lane.getChannel() == event.channel && lane.getControl() == event.control()) {
+            lane.append(time, event.value());
+            return;
+        }
+    }
+    lanes.emplace_back(event.channel, event.control(), tolerance);
+    lanes.back().append(time, event.value());
+}
+
+void Automation::finish() {
+    for (auto &lane : lanes) {
+        lane.finish();
+    }
+}
+
+size_t Automation::getNumberOfLanes() const {
+    return lanes.size();
+}
+
+const AutomationLane& Automation::getLane(size_t lane) const {
+    return lanes[lane];
+}
+
+
+bool is_automation_controller(int control) {
+    switch (control) {
+        case midi_cc::IIR_FILTER_CUTOFF:
+        case midi_cc::IRR_FILTER_Q:
+        case midi_cc::EFFECT_PARAM1:
+        case midi_cc::EFFECT_PARAM2:
+        case midi_cc::EFFECT_PARAM3:
+        case midi_cc::EFFECT_PARAM4:
+            return true;
+        default:
+            return false;
+    }
+}
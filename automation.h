@@ -0,0 +1,126 @@
+/**
+ * Fluidsynth for ImpactLX49+
+ * 
+ * Copyright (C) 2021 Thomas Keck
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include "midi_event.h"
+#include "record_journal.h"
+
+// Largest difference in controller steps between a recorded value and the fitted curve.
+#define AUTOMATION_TOLERANCE 1.0
+// Samples between two values regenerated on a ramp.
+#define AUTOMATION_INTERVAL (TRACK_SAMPLE_RATE / 100)
+// Longer pauses between two values are held instead of interpolated.
+#define AUTOMATION_MAX_GAP (TRACK_SAMPLE_RATE / 20)
+#define AUTOMATION_CONTROLLERS 6
+#define AUTOMATION_MAX_LANES (16 * AUTOMATION_CONTROLLERS)
+// Memory reserved for a new lane, so recording rarely reallocates.
+#define AUTOMATION_LANE_RESERVE 256
+
+/**
+ * Settings of the automation of the tracks.
+ */
+struct AutomationConfig {
+    double tolerance = AUTOMATION_TOLERANCE;
+    int interval = AUTOMATION_INTERVAL;
+};
+
+/**
+ * Point of a piecewise-linear controller curve, the time is in samples.
+ */
+struct Breakpoint {
+    int time;
+    float value;
+};
+
+/**
+ * Position of a reader in an automation lane.
+ */
+struct AutomationCursor {
+    size_t breakpoint = 0;
+    int time = 0;
+    int last_value = -1;
+};
+
+/**
+ * Piecewise-linear curve of one controller of one channel.
+ *
+ * Knob sweeps send hundreds of nearly collinear values per second. Instead of
+ * storing each of them, the values are fitted while they are recorded: a
+ * segment is extended as long as a line from its start stays within the
+ * tolerance of every value since, and only the breakpoints are stored.
+ * The values are regenerated from the segments when they are played,
+ * at most one per interval and only if the value changes.
+ *
+ * Values must be appended in chronological order.
+ */
+class AutomationLane {
+
+    public:
+        AutomationLane(uint8_t channel, uint8_t control, double tolerance);
+        void append(int time, int value);
+        void finish();
+        bool read(AutomationCursor &cursor, int interval, int &time, int &value) const;
+        uint8_t getChannel() const;
+        uint8_t getControl() const;
+        size_t size() const;
+
+    private:
+        void addPoint(int time, double value);
+        void addBreakpoint();
+
+    private:
+        uint8_t channel;
+        uint8_t control;
+        double tolerance;
+        std::vector<Breakpoint> breakpoints;
+        // The values since the last breakpoint, which are not fitted yet,
+        // allow the slopes between these bounds.
+        bool has_pending_values;
+        double min_slope;
+        double max_slope;
+        int last_time;
+        double last_value;
+};
+
+/**
+ * The automation lanes of a take.
+ */
+class Automation {
+
+    public:
+        Automation(double tolerance);
+        void append(int time, MidiEvent event);
+        void finish();
+        size_t getNumberOfLanes() const;
+        const AutomationLane& getLane(size_t lane) const;
+
+    private:
+        double tolerance;
+        std::vector<AutomationLane> lanes;
+};
+
+/**
+ * Returns true for the controllers of the effects and the filter, whose knobs are recorded as automation.
+ */
+bool is_automation_controller(int control);
@@ -0,0 +1,227 @@
+/**
+ * Fluidsynth for ImpactLX49+
+ * 
+ * Copyright (C) 2021 Thomas Keck
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <cerrno>
+#include <csignal>
+#include <cstdint>
+#include <cstring>
+#include <iostream>
+#include <stdexcept>
+
+#include <pthread.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/signalfd.h>
+#include <sys/timerfd.h>
+#include <unistd.h>
+
+#include "format_workaround.h"
+
+#include "control_thread.h"
+
+#define CONTROL_READ_SIZE 4096
+
+
+ControlThread::ControlThread(bool handles_signals) :
+    tasks(CONTROL_QUEUE_SIZE),
+    is_woken(false),
+    is_running(false),
+    is_interrupted(false),
+    dropped_tasks(0),
+    reads_stdin_at_once(false) {
+        // Blocked before any other thread is started, since the threads inherit
+        // the mask, so the signals are only received through the signalfd.
+        sigset_t signals;
+        sigemptyset(&signals);
+        if (handles_signals) {
+            sigaddset(&signals, SIGINT);
+            sigaddset(&signals, SIGTERM);
+            pthread_sigmask(SIG_BLOCK, &signals, nullptr);
+        }
+
+        epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+        event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        signal_fd = signalfd(-1, &signals, SFD_NONBLOCK | SFD_CLOEXEC);
+        timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+        if (epoll_fd < 0 || event_fd < 0 || signal_fd < 0 || timer_fd < 0) {
+            throw std::runtime_error(std::format("Failed to create control thread: {}", std::strerror(errno)));
+        }
+        for (int fd : {event_fd, signal_fd, timer_fd}) {
+            epoll_event event = {};
+            event.events = EPOLLIN;
+            event.data.fd = fd;
+            epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &event);
+        }
+}
+
+ControlThread::~ControlThread() {
+    stop();
+    close(timer_fd);
+    close(signal_fd);
+    close(event_fd);
+    close(epoll_fd);
+}
+
+void ControlThread::addPeriodicTask(std::function<void()> task) {
+    periodic_tasks.push_back(task);
+}
+
+void ControlThread::start(std::function<void(const std::string&)> handle_command) {
+    this->handle_command = handle_command;
+    if (handle_command) {
+        epoll_event event = {};
+        event.events = EPOLLIN;
+        event.data.fd = STDIN_FILENO;
+        // Regular files cannot be polled, they are read at once when the thread starts.
+        if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, STDIN_FILENO, &event) != 0) {
+            reads_stdin_at_once = (errno == EPERM);
+            if (not reads_stdin_at_once) {
+                std::cerr << "Failed to watch stdin: " << std::strerror(errno) << std::endl;
+            }
+        }
+    }
+    itimerspec interval = {};
+    interval.it_interval.tv_sec = CONTROL_TIMER_INTERVAL / 1000;
+    interval.it_interval.tv_nsec = (CONTROL_TIMER_INTERVAL % 1000) * 1000000;
+    interval.it_value = interval.it_interval;
+    timerfd_settime(timer_fd, 0, &interval, nullptr);
+    is_running = true;
+    thread = std::thread(&ControlThread::runInBackground, this);
+}
+
+void ControlThread::stop() {
+    if (not thread.joinable()) {
+        return;
+    }
+    is_running = false;
+    uint64_t one = 1;
+    if (write(event_fd, &one, sizeof(one)) != sizeof(one)) {
+        std::cerr << "Failed to wake control thread" << std::endl;
+    }
+    thread.join();
+}
+
+bool ControlThread::defer(void (*run)(void *object), void *object) {
+    ControlTask task = {};
+    task.run = run;
+    task.object = object;
+    return enqueue(task);
+}
+
+void ControlThread::reportError(const char *message, double value) {
+    ControlTask task = {};
+    task.message = message;
+    task.value = value;
+    enqueue(task);
+}
+
+bool ControlThread::isInterrupted() const {
+    return is_interrupted;
+}
+
+void ControlThread::waitForInterrupt() {
+    is_interrupted.wait(false);
+}
+
+bool ControlThread::enqueue(const ControlTask &task) {
+    if (not tasks.push(task)) {
+        dropped_tasks.fetch_add(1, std::memory_order_relaxed);
+        return false;
+    }
+    // The write is a non-blocking syscall, which is only done once per burst.
+    if (not is_woken.exchange(true, std::memory_order_acq_rel)) {
+        uint64_t one = 1;
+        if (write(event_fd, &one, sizeof(one)) != sizeof(one)) {
+            is_woken = false;
+        }
+    }
+    return true;
+}
+
+void ControlThread::runInBackground() {
+    while (reads_stdin_at_once && readCommands()) {}
+
+    epoll_event events[4];
+    while (is_running) {
+        int number_of_events = epoll_wait(epoll_fd, events, 4, -1);
+        for (int i = 0; i < number_of_events; ++i) {
+            int fd = events[i].data.fd;
+            if (fd == event_fd) {
+                uint64_t count;
+                if (read(event_fd, &count, sizeof(count)) < 0 && errno != EAGAIN) {
+                    std::cerr << "Failed to read control eventfd: " << std::strerror(errno) << std::endl;
+                }
+                runTasks();
+            } else if (fd == signal_fd) {
+                signalfd_siginfo info;
+                while (read(signal_fd, &info, sizeof(info)) == sizeof(info)) {
+                    std::cout << "Received " << strsignal(info.ssi_signo) << ", shutting down" << std::endl;
+                }
+                is_interrupted = true;
+                is_interrupted.notify_all();
+            } else if (fd == timer_fd) {
+                uint64_t expirations;
+                if (read(timer_fd, &expirations, sizeof(expirations)) > 0) {
+                    for (auto &task : periodic_tasks) {
+                        task();
+                    }
+                }
+            } else if (fd == STDIN_FILENO && not readCommands()) {
+                // Keeps on playing if stdin is closed, e.g. if started in the background.
+                epoll_ctl(epoll_fd, EPOLL_CTL_DEL, STDIN_FILENO, nullptr);
+            }
+        }
+    }
+}
+
+void ControlThread::runTasks() {
+    // Cleared before the queue is drained, so a task pushed meanwhile wakes the thread again.
+    is_woken.store(false, std::memory_order_release);
+    ControlTask task;
+    while (tasks.pop(task)) {
+        if (task.run != nullptr) {
+            task.run(task.object);
+        } else {
+            std::cerr << std::format("{} with value {}", task.message, task.value) << std::endl;
+        }
+    }
+    long dropped = dropped_tasks.exchange(0, std::memory_order_relaxed);
+    if (dropped > 0) {
+        std::cerr << "Control queue overrun, dropped " << dropped << " tasks" << std::endl;
+    }
+}
+
+bool ControlThread::readCommands() {
+    char buffer[CONTROL_READ_SIZE];
+    ssize_t size = read(STDIN_FILENO, buffer, sizeof(buffer));
+    if (size <= 0) {
+        if (not command_buffer.empty()) {
+            handle_command(command_buffer);
+            command_buffer.clear();
+        }
+        return false;
+    }
+    command_buffer.append(buffer, size);
+    size_t end;
+    while ((end = command_buffer.find('\n')) != std::string::npos) {
+        handle_command(command_buffer.substr(0, end));
+        command_buffer.erase(0, end + 1);
+    }
+    return true;
+}
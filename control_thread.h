@@ -0,0 +1,96 @@
+/**
+ * Fluidsynth for ImpactLX49+
+ * 
+ * Copyright (C) 2021 Thomas Keck
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <atomic>
+#include <functional>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "mpsc_queue.h"
+
+#define CONTROL_QUEUE_SIZE 1024
+// In milliseconds.
+#define CONTROL_TIMER_INTERVAL 1000
+
+/**
+ * Work deferred to the control thread.
+ *
+ * A plain function pointer and its argument, so deferring never allocates.
+ * Error reports have no function, their message must be a string literal,
+ * it is only formatted together with the value on the control thread.
+ */
+struct ControlTask {
+    void (*run)(void *object);
+    void *object;
+    const char *message;
+    double value;
+};
+
+/**
+ * Thread for the work that must not be done by the real-time threads.
+ *
+ * The midi dispatch, track scheduling and audio threads only push tasks
+ * into a lock-free queue and wake the control thread with an eventfd.
+ * The control thread waits with epoll for these tasks, for SIGINT and SIGTERM
+ * (signalfd), for a periodic timer (timerfd) and for commands on stdin.
+ * Hence, allocations, error formatting and file I/O are done here, and
+ * a signal ends the program through the destructors instead of killing it.
+ * The signals must be handled by a control thread that is created before
+ * any other thread, since the threads inherit the blocked signals.
+ */
+class ControlThread {
+
+    public:
+        ControlThread(bool handles_signals);
+        ~ControlThread();
+        void addPeriodicTask(std::function<void()> task);
+        void start(std::function<void(const std::string&)> handle_command);
+        void stop();
+        bool defer(void (*run)(void *object), void *object);
+        void reportError(const char *message, double value);
+        bool isInterrupted() const;
+        void waitForInterrupt();
+
+    private:
+        bool enqueue(const ControlTask &task);
+        void runInBackground();
+        void runTasks();
+        bool readCommands();
+
+    private:
+        int epoll_fd;
+        int event_fd;
+        int signal_fd;
+        int timer_fd;
+        MpscQueue<ControlTask> tasks;
+        // Set while the eventfd has been written but the tasks not run yet,
+        // so a burst of tasks costs a single write.
+        std::atomic<bool> is_woken;
+        std::atomic<bool> is_running;
+        std::atomic<bool> is_interrupted;
+        std::atomic<long> dropped_tasks;
+        std::vector<std::function<void()>> periodic_tasks;
+        std::function<void(const std::string&)> handle_command;
+        std::string command_buffer;
+        bool reads_stdin_at_once;
+        std::thread thread;
+};
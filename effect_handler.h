@@ -21,6 +21,7 @@
 
 #include <fluidsynth.h>
 
+#include "control_thread.h"
 #include "handler.h"
 
 /**
@@ -39,23 +40,29 @@ enum EffectControlMode {
  * All control events are assigned to the currently selected effect.
  * In order to select another effect, the corresponding effect button must be
  * pressed.
+ * Failures are reported by the control thread, since the events are handled
+ * on the real-time dispatch thread.
  */
 class EffectHandler : public Handler {
 
     public:
-        EffectHandler(fluid_synth_t *synth);
-        void handleEvent(fluid_midi_event_t *event) override;
+        EffectHandler(fluid_synth_t *synth, ControlThread &control);
+        MidiEvent handleEvent(MidiEvent event) override;
+        const char* getName() const override { return "EffectHandler"; }
+        EffectControlMode getMode() const;
+        void setMode(EffectControlMode mode);
 
     private:
-        void handleReverbButtonEvent(fluid_midi_event_t *event);
-        void handleChorusButtonEvent(fluid_midi_event_t *event);
-        void handleEffectParam1Event(fluid_midi_event_t *event);
-        void handleEffectParam2Event(fluid_midi_event_t *event);
-        void handleEffectParam3Event(fluid_midi_event_t *event);
-        void handleEffectParam4Event(fluid_midi_event_t *event);
+        void handleReverbButtonEvent(MidiEvent event);
+        void handleChorusButtonEvent(MidiEvent event);
+        void handleEffectParam1Event(MidiEvent event);
+        void handleEffectParam2Event(MidiEvent event);
+        void handleEffectParam3Event(MidiEvent event);
+        void handleEffectParam4Event(MidiEvent event);
 
     private:
         fluid_synth_t *synth;
+        ControlThread &control;
         EffectControlMode mode;
 
 };
\ No newline at end of file
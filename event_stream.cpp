@@ -0,0 +1,137 @@
+/**
+ * Fluidsynth for ImpactLX49+
+ * 
+ * Copyright (C) 2021 Thomas Keck
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "event_stream.h"
+#include "midi_enums.h"
+
+
+int midi_data_length(int type) {
+    switch(type) {
+        case midi_event_type::NOTE_OFF:
+        case midi_event_type::NOTE_ON:
+        case midi_event_type::KEY_PRESSURE:
+        case midi_event_type::CONTROL_CHANGE:
+        case midi_event_type::PITCH_BEND:
+            return 2;
+        case midi_event_type::PROGRAM_CHANGE:
+        case midi_event_type::CHANNEL_PRESSURE:
+            return 1;
+    }
+    return -1;
+}
+
+
+EventStream::EventStream() : last_time(0), last_status(0) {
+}
+
+bool EventStream::append(int time, MidiEvent event) {
+    int length = midi_data_length(event.type);
+    if (length < 0 || time < last_time) {
+        return false;
+    }
+    appendVariableLength(time - last_time);
+    last_time = time;
+
+    uint8_t status = event.type | (event.channel & 0x0f);
+    if (status != last_status) {
+        bytes.push_back(status);
+        last_status = status;
+    }
+    if (event.type == midi_event_type::PITCH_BEND) {
+        // The 14 bit pitch bend value is split into two 7 bit data bytes.
+        bytes.push_back(event.pitch() & 0x7f);
+        bytes.push_back((event.pitch() >> 7) & 0x7f);
+    } else {
+        bytes.push_back(event.param1 & 0x7f);
+        if (length == 2) {
+            bytes.push_back(event.param2 & 0x7f);
+        }
+    }
+    return true;
+}
+
+bool EventStream::read(EventCursor &cursor, int &time, MidiEvent &event) const {
+    if (cursor.position >= bytes.size()) {
+        return false;
+    }
+    uint32_t delta = 0;
+    uint8_t byte;
+    do {
+        byte = bytes[cursor.position++];
+        delta = (delta << 7) | (byte & 0x7f);
+    } while (byte & 0x80);
+    cursor.time += delta;
+
+    if (bytes[cursor.position] & 0x80) {
+        cursor.status = bytes[cursor.position++];
+    }
+    event.type = cursor.status & 0xf0;
+    event.channel = cursor.status & 0x0f;
+    event.param1 = bytes[cursor.position++];
+    event.param2 = 0;
+    if (event.type == midi_event_type::PITCH_BEND) {
+        event.param1 |= bytes[cursor.position++] << 7;
+    } else if (midi_data_length(event.type) == 2) {
+        event.param2 = bytes[cursor.position++];
+    }
+    time = cursor.time;
+    return true;
+}
+
+size_t EventStream::size() const {
+    return bytes.size();
+}
+
+void EventStream::reserve(size_t size) {
+    bytes.reserve(size);
+}
+
+void EventStream::clear() {
+    // Keeps the capacity, so a cleared stream can be appended to without allocating.
+    bytes.clear();
+    last_time = 0;
+    last_status = 0;
+}
+
+const uint8_t* EventStream::data() const {
+    return bytes.data();
+}
+
+/**
+ * Replaces the events by the encoded events of another stream, which can only be read.
+ */
+void EventStream::assign(const uint8_t *data, size_t size) {
+    bytes.assign(data, data + size);
+    last_time = 0;
+    last_status = 0;
+}
+
+void EventStream::appendVariableLength(uint32_t value) {
+    // Most significant group first, every byte but the last has the high bit set.
+    uint8_t buffer[5];
+    int length = 0;
+    do {
+        buffer[length++] = value & 0x7f;
+        value >>= 7;
+    } while (value > 0);
+    while (length > 1) {
+        bytes.push_back(buffer[--length] | 0x80);
+    }
+    bytes.push_back(buffer[0]);
+}
@@ -0,0 +1,72 @@
+/**
+ * Fluidsynth for ImpactLX49+
+ * 
+ * Copyright (C) 2021 Thomas Keck
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include "midi_event.h"
+
+/**
+ * Position of a reader in an event stream.
+ */
+struct EventCursor {
+    size_t position = 0;
+    int time = 0;
+    uint8_t status = 0;
+};
+
+/**
+ * Compact encoding of recorded midi channel messages.
+ * 
+ * The events are stored like in a standard midi file: a variable-length
+ * delta time followed by the status byte and one or two data bytes.
+ * The status byte is omitted if it is the same as the one of the previous
+ * event (running status). With times in samples, a typical note event takes 4 or 5 bytes.
+ * 
+ * Events must be appended in chronological order.
+ */
+class EventStream {
+
+    public:
+        EventStream();
+        bool append(int time, MidiEvent event);
+        bool read(EventCursor &cursor, int &time, MidiEvent &event) const;
+        size_t size() const;
+        void reserve(size_t size);
+        void clear();
+        const uint8_t* data() const;
+        void assign(const uint8_t *data, size_t size);
+
+    private:
+        void appendVariableLength(uint32_t value);
+
+    private:
+        std::vector<uint8_t> bytes;
+        int last_time;
+        uint8_t last_status;
+};
+
+/**
+ * Returns the number of data bytes of a midi channel message,
+ * or -1 if the type is not a channel message.
+ */
+int midi_data_length(int type);
@@ -20,10 +20,20 @@
 #pragma once
 
 
-#include <fluidsynth.h>
+#include <memory>
+#include <vector>
+
+#include "midi_event.h"
 
 class Handler {
     public:
-        virtual void handleEvent(fluid_midi_event_t *event) = 0;
+        /**
+         * Returns the event that is passed on to the next handler,
+         * which is the given event unless the handler changed or dropped it.
+         */
+        virtual MidiEvent handleEvent(MidiEvent event) = 0;
+        virtual const char* getName() const = 0;
+
+};
 
-};
\ No newline at end of file
+typedef std::vector<std::unique_ptr<Handler>> HandlerChain;
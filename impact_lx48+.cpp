@@ -20,41 +20,172 @@
 #include <cstdlib>
 #include <string>
 #include <iostream>
+#include <sstream>
 #include <vector>
 #include <utility>
+#include <algorithm>
+#include <memory>
+#include <stdexcept>
+#include <chrono>
+#include <filesystem>
+#include <thread>
+#include <array>
+#include <random>
+#include <map>
+#include <set>
+#include <iomanip>
 
 #include <unistd.h>
 
 #include <fluidsynth.h>
 
-#include "split_handler.h"
+#include "active_notes.h"
+#include "audio_capture.h"
+#include "control_thread.h"
 #include "modulator_handler.h"
 #include "effect_handler.h"
 #include "record_handler.h"
+#include "snapshot_handler.h"
+#include "smf_player.h"
+#include "soundfont_loader.h"
+#include "soundfont_swapper.h"
+#include "preset_index.h"
+#include "preset_router.h"
+#include "midi_ingress.h"
+#include "trace.h"
 #include "midi_enums.h"
+#include "record_journal.h"
+#include "render_calibration.h"
+#include "realtime.h"
+#include "sample_cache.h"
+#include "shared_soundfont_loader.h"
+#include "simulation.h"
 #include "io.h"
 
+#define REPLAY_BLOCK_SIZE 64
+#define SOAK_RECORD_SECONDS 1
+#define SOAK_WARM_UP_SECONDS 3
+#define SWAP_TEST_SWAPS 4
+#define DEFAULT_SOUNDFONT "fluidr3.sf2"
+#define PRESET_INDEX_FILE "preset_index.cache"
+#define SIMULATION_LOOP_LENGTH 1000
+#define SIMULATION_NOTES 8
+#define SIMULATION_OVERDUB_LENGTH 1200
+#define SESSION_TRACKS 4
+#define SESSION_BEATS 32
+#define INGRESS_TEST_EVENTS 10000
+// Microseconds between the events of a simulated device in the ingress test.
+#define INGRESS_TEST_MIN_STEP 100
+#define INGRESS_TEST_MAX_STEP 300
+// Time the last live events get to be delivered before the latency test summarizes them.
+#define LATENCY_TEST_DRAIN_MS 100
+// Live events traced on their way through the sequencer at the same time, see traceSequencerDelivery.
+#define DELIVERY_TRACE_SLOTS 1024
 
-int handle_midi_event(void* data, fluid_midi_event_t* fluid_event);
+
+int render_audio(void* data, int len, int nfx, float* fx[], int nout, float* out[]);
+void delivery_trace_callback(unsigned int time, fluid_event_t* event, fluid_sequencer_t* seq, void* data);
+
+
+fluid_settings_t* new_keyboard_settings() {
+  fluid_settings_t *settings = new_fluid_settings();
+  fluid_settings_setnum(settings, "synth.gain", 2.0);
+  fluid_settings_setnum(settings, "synth.sample-rate", 48000.0);
+  return settings;
+}
+
+
+/**
+ * Options given on the command line.
+ */
+struct KeyboardOptions {
+    std::string journal_path;
+    std::string replay_path;
+    // Directory of soundfonts whose presets are chosen by program changes.
+    std::string library_path;
+    std::vector<MidiDeviceConfig> devices;
+    // Number of cores used to render, chosen by a calibration render if 0.
+    int cpu_cores = 0;
+    // Without audio and midi driver the sequencer is driven by the rendered audio.
+    bool headless = false;
+    // Shares the soundfonts with the other keyboards of a host, see run_host.
+    SharedSoundfontLoader *shared_loader = nullptr;
+    // Sends the live events through the sequencer like the tracks, to compare the latency of both paths.
+    bool live_via_sequencer = false;
+    AutomationConfig automation;
+};
 
 
 class MidiKeyboard {
 
     public:
-        MidiKeyboard() {
-            settings = new_fluid_settings();
-            fluid_settings_setnum(settings, "synth.gain", 2.0);
-            fluid_settings_setnum(settings, "synth.sample-rate", 48000.0);
-            synth = new_fluid_synth(settings);
-            sequencer =  new_fluid_sequencer2(1);
-            int seq_synth_id = fluid_sequencer_register_fluidsynth(sequencer, synth);
-            sfont = loadSfont("fluidr3.sf2");
-            adriver = new_fluid_audio_driver(settings, synth);
-            mdriver = new_fluid_midi_driver(settings, handle_midi_event, this);
-            handlers.push_back(std::make_unique<SplitHandler>(4));
-            handlers.push_back(std::make_unique<EffectHandler>(synth));
-            handlers.push_back(std::make_unique<ModulatorHandler>(synth));
-            handlers.push_back(std::make_unique<RecordHandler>(sequencer, seq_synth_id));
+        MidiKeyboard(const KeyboardOptions &options, ControlThread &control) :
+            control(control), adriver(nullptr), live_via_sequencer(options.live_via_sequencer), delivery_trace_id(-1) {
+            settings = new_keyboard_settings();
+            int cpu_cores = options.cpu_cores > 0 ? options.cpu_cores : calibrate_cpu_cores(settings);
+            fluid_settings_setint(settings, "synth.cpu-cores", cpu_cores);
+            synth = new_pinned_fluid_synth(settings);
+            // Must be added before the first soundfont is loaded, the synth deletes it.
+            if (options.shared_loader != nullptr) {
+                fluid_synth_add_sfloader(synth, options.shared_loader->newSfloader());
+            } else {
+                fluid_synth_add_sfloader(synth, new_sample_cache_sfloader(settings));
+            }
+            sfont_loader = std::make_unique<SoundfontLoader>(synth, options.shared_loader);
+            sequencer =  new_fluid_sequencer2(options.headless ? 0 : 1);
+            seq_synth_id = fluid_sequencer_register_fluidsynth(sequencer, synth);
+            fluid_sfont_t *sfont = loadSfont(DEFAULT_SOUNDFONT);
+            swapper = std::make_unique<SoundfontSwapper>(synth, *sfont_loader, fluid_sfont_get_id(sfont));
+            forward_event = new_fluid_event();
+            fluid_event_set_source(forward_event, -1);
+            fluid_event_set_dest(forward_event, seq_synth_id);
+            double sample_rate;
+            fluid_settings_getnum(settings, "synth.sample-rate", &sample_rate);
+            capture = std::make_unique<AudioCapture>(sample_rate);
+            // Registered for either path, since the latency test switches between them.
+            delivery_trace_event = new_fluid_event();
+            delivery_trace_id = fluid_sequencer_register_client(sequencer, "delivery_trace", delivery_trace_callback, this);
+            fluid_event_set_source(delivery_trace_event, -1);
+            fluid_event_set_dest(delivery_trace_event, delivery_trace_id);
+            // The split handlers are part of the handler chain of each device.
+            auto effect_handler = std::make_unique<EffectHandler>(synth, control);
+            auto modulator_handler = std::make_unique<ModulatorHandler>(synth);
+            auto snapshot = std::make_unique<SnapshotHandler>(synth, *effect_handler, *modulator_handler, control);
+            snapshot_handler = snapshot.get();
+            handlers.push_back(std::move(effect_handler));
+            handlers.push_back(std::move(modulator_handler));
+            handlers.push_back(std::move(snapshot));
+            // The tracks replay their program changes through the router, if there is one.
+            std::unique_ptr<PresetRouter> router;
+            int seq_preset_id = seq_synth_id;
+            if (not options.library_path.empty()) {
+              loadLibrary(options.library_path);
+              router = std::make_unique<PresetRouter>(synth, sequencer, *sfont_loader, *preset_index, control);
+              seq_preset_id = router->getSequencerClientId();
+            }
+            handlers.push_back(std::make_unique<RecordHandler>(sequencer, seq_synth_id, seq_preset_id,
+                                                              options.journal_path, control, options.automation));
+            // Comes after the record handler, since it drops the program changes it routes.
+            if (router) {
+              handlers.push_back(std::move(router));
+            }
+            if (not options.headless) {
+                adriver = new_fluid_audio_driver2(settings, render_audio, this);
+            }
+            ingress = std::make_unique<MidiIngress>(settings, options.devices, options.headless,
+                [this](IngressEvent &event, HandlerChain &device_handlers) {
+                    handleMidiEvent(event.event, device_handlers);
+                });
+            for (uint16_t device = 0; device < ingress->getNumberOfDevices(); ++device) {
+                for (auto &handler : ingress->getDeviceHandlers(device)) {
+                    if (auto *split_handler = dynamic_cast<SplitHandler*>(handler.get())) {
+                        snapshot_handler->addSplitHandler(*split_handler);
+                    }
+                }
+            }
+            control.addPeriodicTask([this]() { ingress->reportDroppedEvents(); });
+            // The midi devices are opened last, since events may arrive immediately.
+            ingress->start();
         }
 
         fluid_sfont_t* loadSfont(const std::string &path) {
@@ -62,21 +193,156 @@ class MidiKeyboard {
             return fluid_synth_get_sfont_by_id(synth, sfont_id);
         }
 
-        void handleMidiEvent(fluid_midi_event_t* event) {
-            for(auto &handler : handlers) {
-              handler->handleEvent(event);
+        void loadLibrary(const std::string &directory) {
+            std::vector<std::string> paths;
+            for (auto &entry : std::filesystem::directory_iterator(directory)) {
+              std::string extension = entry.path().extension().string();
+              if (entry.is_regular_file() && (extension == ".sf2" || extension == ".sf3")) {
+                paths.push_back(entry.path().string());
+              }
+            }
+            std::sort(paths.begin(), paths.end());
+            preset_index = std::make_unique<PresetIndex>(directory + "/" + PRESET_INDEX_FILE);
+            preset_index->refresh(paths);
+        }
+
+        void handleMidiEvent(MidiEvent event, HandlerChain &device_handlers) {
+            if (not trace_is_enabled()) {
+              for(auto &handler : device_handlers) {
+                event = handler->handleEvent(event);
+              }
+              for(auto &handler : handlers) {
+                event = handler->handleEvent(event);
+              }
+              forwardMidiEvent(event, live_via_sequencer.load(std::memory_order_relaxed));
+              return;
+            }
+
+            uint32_t event_id = trace_next_event_id();
+            uint64_t stage_start = trace_now();
+            trace_span("ingress queue", event.time, stage_start, event_id);
+            for(auto *chain : {&device_handlers, &handlers}) {
+              for(auto &handler : *chain) {
+                event = handler->handleEvent(event);
+                uint64_t stage_end = trace_now();
+                trace_span(handler->getName(), stage_start, stage_end, event_id);
+                stage_start = stage_end;
+              }
+            }
+            bool via_sequencer = live_via_sequencer.load(std::memory_order_relaxed);
+            forwardMidiEvent(event, via_sequencer);
+            uint64_t forwarded = trace_now();
+            if (not via_sequencer) {
+              trace_span("synth", stage_start, forwarded, event_id);
+              return;
+            }
+            trace_span("sequencer enqueue", stage_start, forwarded, event_id);
+            // Costs a sequencer event per live event, hence only while tracing.
+            if (not event.isDropped() && trace_is_enabled()) {
+              traceSequencerDelivery(event_id, stage_start);
+            }
+        }
+
+        void forwardMidiEvent(MidiEvent event, bool via_sequencer) {
+            if (event.isDropped()) {
+              return;
             }
-            fluid_sequencer_add_midi_event_to_buffer(sequencer, event);
+            bool is_note_off = event.type == midi_event_type::NOTE_OFF ||
+                               (event.type == midi_event_type::NOTE_ON && event.velocity() == 0);
+            if (is_note_off && not live_notes.contains(event.channel, event.key())) {
+              // A split or snapshot changed the channel while the key was held,
+              // hence the note off goes to the channel of the note on instead.
+              live_notes.forEachChannel(event.key(), [&](int channel) {
+                MidiEvent note_off = event;
+                note_off.channel = channel;
+                sendMidiEvent(note_off, via_sequencer);
+              });
+              return;
+            }
+            sendMidiEvent(event, via_sequencer);
+        }
+
+        void sendMidiEvent(MidiEvent event, bool via_sequencer) {
+            live_notes.update(event);
+            // The sequencer would only deliver the event at its next tick,
+            // it is kept for the scheduled playback of the tracks.
+            if (not via_sequencer) {
+              play_midi_event(synth, event);
+              return;
+            }
+            encode_sequencer_event(event, forward_event);
+            fluid_sequencer_send_at(sequencer, forward_event, 0, 0);
+        }
+
+        /**
+         * Sends a timer event right behind the forwarded event, whose callback
+         * traces the time from forwarding the event until the sequencer
+         * delivered it, like the span "synth" of the direct path.
+         */
+        void traceSequencerDelivery(uint32_t event_id, uint64_t forwarded) {
+            delivery_enqueue_times[event_id % DELIVERY_TRACE_SLOTS].store(forwarded, std::memory_order_relaxed);
+            fluid_event_timer(delivery_trace_event, reinterpret_cast<void*>(static_cast<uintptr_t>(event_id)));
+            fluid_sequencer_send_at(sequencer, delivery_trace_event, 0, 0);
+        }
+
+        void traceDelivery(uint32_t event_id) {
+            uint64_t forwarded = delivery_enqueue_times[event_id % DELIVERY_TRACE_SLOTS].load(std::memory_order_relaxed);
+            trace_span("sequencer delivery", forwarded, trace_now(), event_id);
+        }
+
+        int renderAudio(int len, int nfx, float* fx[], int nout, float* out[]) {
+            auto start = std::chrono::steady_clock::now();
+            // The hooks at the block boundaries run on the audio thread once per
+            // block, hence each one returns after a single atomic load unless it
+            // has work to do, and none of them may wait. The beginning of a block
+            // is the only point where the preset of every channel can be switched
+            // without any note in between.
+            swapper->applyPendingSwap();
+            int result = fluid_synth_process(synth, len, nfx, fx, nout, out);
+            // The drivers render without effect buffers, hence the effects are mixed into out.
+            if (nout >= 2) {
+                capture->append(len, out[0], out[1]);
+            }
+            auto duration = std::chrono::steady_clock::now() - start;
+            swapper->reportBlockRenderTime(std::chrono::duration_cast<std::chrono::nanoseconds>(duration).count());
+            return result;
+        }
+
+        void swapSfont(const std::string &path) {
+            swapper->requestSwap(path);
+        }
+
+        void playSmf(const std::string &path) {
+            smf_player.reset();
+            try {
+                smf_player = std::make_unique<SmfPlayer>(sequencer, seq_synth_id, path);
+            } catch (const std::runtime_error &error) {
+                // A wrong path must not stop the keyboard.
+                std::cerr << error.what() << std::endl;
+                return;
+            }
+            smf_player->playStart();
         }
       
 
         ~MidiKeyboard() {
+            // No deferred task may run while the handlers are destroyed.
+            control.stop();
+            // Close the midi devices first, so no more events are dispatched.
+            ingress.reset();
+            // The audio thread uses the swapper and the capture.
+            delete_fluid_audio_driver(adriver);
+            capture.reset();
             // Remove all handlers first, because they contain pointers to
             // fluid synth objects that we delete here.
             handlers.clear();
-            delete_fluid_midi_driver(mdriver);
+            smf_player.reset();
+            delete_fluid_event(forward_event);
+            delete_fluid_event(delivery_trace_event);
+            fluid_sequencer_unregister_client(sequencer, delivery_trace_id);
             delete_fluid_sequencer(sequencer);
-            delete_fluid_audio_driver(adriver);
+            swapper.reset();
+            sfont_loader.reset();
             delete_fluid_synth(synth);
             delete_fluid_settings(settings);
         }
@@ -84,28 +350,950 @@ class MidiKeyboard {
 
 
   public:
+    ControlThread &control;
     fluid_settings_t *settings;
     fluid_synth_t *synth;
     fluid_sequencer_t *sequencer;
+    int seq_synth_id;
     fluid_audio_driver_t *adriver;
-    fluid_midi_driver_t *mdriver;
-    fluid_sfont_t *sfont;
-    std::vector<std::unique_ptr<Handler>> handlers;
+    // Only used by the dispatch thread to forward the handled events to the sequencer.
+    fluid_event_t *forward_event;
+    // Notes played live whose note off has not been forwarded yet.
+    ActiveNotes live_notes;
+    // Switched by the latency test while the dispatch thread reads it.
+    std::atomic<bool> live_via_sequencer;
+    int delivery_trace_id;
+    fluid_event_t *delivery_trace_event;
+    // Written by the dispatch thread before the timer event is sent and read by its callback on the sequencer thread.
+    std::array<std::atomic<uint64_t>, DELIVERY_TRACE_SLOTS> delivery_enqueue_times;
+    std::unique_ptr<SoundfontLoader> sfont_loader;
+    std::unique_ptr<SoundfontSwapper> swapper;
+    std::unique_ptr<AudioCapture> capture;
+    // Owned by the handler chain.
+    SnapshotHandler *snapshot_handler;
+    std::unique_ptr<PresetIndex> preset_index;
+    std::unique_ptr<SmfPlayer> smf_player;
+    std::unique_ptr<MidiIngress> ingress;
+    HandlerChain handlers;
 
 };
 
 
-int handle_midi_event(void* data, fluid_midi_event_t* event) {
+int render_audio(void* data, int len, int nfx, float* fx[], int nout, float* out[]) {
+  MidiKeyboard *keyboard = reinterpret_cast<MidiKeyboard*>(data);
+  return keyboard->renderAudio(len, nfx, fx, nout, out);
+}
+
 
+void delivery_trace_callback(unsigned int time, fluid_event_t* event, fluid_sequencer_t* seq, void* data) {
+  // The sequencer calls back on the thread that schedules the tracks.
+  realtime_enter_thread("track scheduling");
   MidiKeyboard *keyboard = reinterpret_cast<MidiKeyboard*>(data);
-  std::cout << event << std::endl;
-  keyboard->handleMidiEvent(event);
+  keyboard->traceDelivery(static_cast<uint32_t>(reinterpret_cast<uintptr_t>(fluid_event_get_data(event))));
+}
+
+
+/**
+ * Handles a command typed on stdin while the keyboard is running.
+ * 
+ * Supported commands:
+ *   sfont <path>       loads the soundfont and swaps it in without stopping the audio.
+ *   smf <path>         plays the standard midi file as a backing track.
+ *   smf stop           stops the backing track.
+ *   trace start        starts tracing the stages of every midi event.
+ *   trace stop <path>  stops tracing and writes the trace as Chrome trace-event JSON.
+ *   trace summary      stops tracing and prints the latency and jitter of every stage.
+ *   faults             prints the page faults of the real-time threads since the last call.
+ *   presets [text]     lists the presets of the library whose name contains the text.
+ *   snapshot store <n> stores the state of the keyboard in the snapshot slot.
+ *   snapshot recall <n> recalls the snapshot slot.
+ *   capture start <path> captures the rendered audio into a WAV file.
+ *   capture stop       stops the audio capture.
+ */
+void handle_command(MidiKeyboard &keyboard, const std::string &line) {
+  std::istringstream stream(line);
+  std::string command;
+  stream >> command;
+  if (command == "sfont") {
+    std::string path;
+    stream >> std::ws;
+    std::getline(stream, path);
+    keyboard.swapSfont(path);
+  } else if (command == "smf") {
+    std::string path;
+    stream >> std::ws;
+    std::getline(stream, path);
+    if (path == "stop") {
+      keyboard.smf_player.reset();
+    } else {
+      keyboard.playSmf(path);
+    }
+  } else if (command == "trace") {
+    std::string action, path;
+    stream >> action >> path;
+    if (action == "start") {
+      trace_start();
+    } else if (action == "summary") {
+      trace_print_summary(std::cout);
+    } else if (action == "stop" && not trace_stop(path)) {
+      std::cerr << "Failed to write trace to " << path << std::endl;
+    }
+  } else if (command == "presets" && keyboard.preset_index) {
+    std::string text;
+    stream >> std::ws;
+    std::getline(stream, text);
+    for (size_t file = 0; file < keyboard.preset_index->getNumberOfFiles(); ++file) {
+      size_t number_of_presets;
+      const PresetInfo *presets = keyboard.preset_index->getPresets(file, number_of_presets);
+      for (size_t preset = 0; preset < number_of_presets; ++preset) {
+        if (std::string(presets[preset].name).find(text) != std::string::npos) {
+          std::cout << presets[preset].bank << ":" << presets[preset].program << " "
+                    << presets[preset].name << " (" << presets[preset].sample_bytes / 1024 << " KiB) "
+                    << keyboard.preset_index->getFilePath(file) << std::endl;
+        }
+      }
+    }
+  } else if (command == "snapshot") {
+    // Sent as controller events, so the snapshot is taken on the dispatch thread.
+    std::string action;
+    int slot = -1;
+    stream >> action >> slot;
+    uint16_t button = (action == "store") ? midi_cc::SNAPSHOT_STORE : midi_cc::SNAPSHOT_RECALL;
+    if ((action != "store" && action != "recall") || slot < 0 || slot >= SNAPSHOT_SLOTS) {
+      std::cerr << "Usage: snapshot store|recall <0-" << SNAPSHOT_SLOTS - 1 << ">" << std::endl;
+      return;
+    }
+    uint8_t slot_value = slot * 128 / SNAPSHOT_SLOTS;
+    keyboard.ingress->receive(0, {midi_event_type::CONTROL_CHANGE, 0, midi_cc::SNAPSHOT_SLOT, slot_value, trace_now()});
+    keyboard.ingress->receive(0, {midi_event_type::CONTROL_CHANGE, 0, button, 127, trace_now()});
+  } else if (command == "capture") {
+    std::string action, path;
+    stream >> action >> std::ws;
+    std::getline(stream, path);
+    if (action == "start" && not path.empty()) {
+      keyboard.capture->start(path);
+    } else if (action == "stop") {
+      keyboard.capture->stop();
+    } else {
+      std::cerr << "Usage: capture start <path> | capture stop" << std::endl;
+    }
+  } else if (command == "faults") {
+    realtime_report_page_faults();
+    realtime_mark_warmed_up();
+  } else if (not command.empty()) {
+    std::cerr << "Unknown command " << command << std::endl;
+  }
+}
+
+
+/**
+ * Replays the tracks of a record journal through the handler chain and
+ * renders the audio as fast as possible.
+ * 
+ * This is used to collect profiles for the PGO build and to compare the
+ * performance of different builds, see makefile.
+ */
+int replay_session(MidiKeyboard &keyboard, const std::string &path) {
+  std::vector<RecoveredTrack> tracks;
+  if (readJournal(path, tracks) <= 0) {
+    std::cerr << "Failed to read record journal " << path << std::endl;
+    return 1;
+  }
+
+  double sample_rate;
+  fluid_settings_getnum(keyboard.settings, "synth.sample-rate", &sample_rate);
+  std::vector<float> left(REPLAY_BLOCK_SIZE), right(REPLAY_BLOCK_SIZE);
+  float *out[2] = {left.data(), right.data()};
+  long rendered_samples = 0;
+  long replayed_events = 0;
+  auto render_until = [&](long sample) {
+    while (rendered_samples < sample) {
+      std::fill(left.begin(), left.end(), 0.0f);
+      std::fill(right.begin(), right.end(), 0.0f);
+      keyboard.renderAudio(REPLAY_BLOCK_SIZE, 0, nullptr, 2, out);
+      rendered_samples += REPLAY_BLOCK_SIZE;
+    }
+  };
+
+  auto start = std::chrono::steady_clock::now();
+  auto &device_handlers = keyboard.ingress->getDeviceHandlers(0);
+  // The tracks are replayed one after another. The signals are blocked
+  // in every thread, the control thread only flags them.
+  long track_offset = 0;
+  bool is_interrupted = false;
+  for (auto &track : tracks) {
+    for (auto &take : track.takes) {
+      for (auto &record : take) {
+        if ((is_interrupted = keyboard.control.isInterrupted())) {
+          break;
+        }
+        render_until(track_offset + static_cast<long>(record.time * sample_rate / TRACK_SAMPLE_RATE));
+        MidiEvent midi_event = {record.type, record.channel, record.param1, record.param2};
+        keyboard.handleMidiEvent(midi_event, device_handlers);
+        replayed_events++;
+      }
+      if (is_interrupted) {
+        break;
+      }
+      track_offset += static_cast<long>(track.duration * sample_rate / TRACK_SAMPLE_RATE);
+      render_until(track_offset);
+    }
+    if (is_interrupted) {
+      break;
+    }
+  }
+  std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+
+  double audio_seconds = rendered_samples / sample_rate;
+  if (is_interrupted) {
+    std::cout << "Replay interrupted" << std::endl;
+  }
+  std::cout << "Replayed " << replayed_events << " events, "
+            << audio_seconds << " s of audio in " << elapsed.count() << " s ("
+            << audio_seconds / elapsed.count() << "x realtime)" << std::endl;
+  return is_interrupted ? 1 : 0;
+}
+
+
+/**
+ * Thread that takes the role of the audio driver of a headless keyboard,
+ * it renders one block after the other at the pace they would be played.
+ */
+class HeadlessRenderer {
+
+    public:
+        HeadlessRenderer(MidiKeyboard &keyboard) : is_rendering(true) {
+            double sample_rate;
+            fluid_settings_getnum(keyboard.settings, "synth.sample-rate", &sample_rate);
+            block_duration = std::chrono::duration<double>(REPLAY_BLOCK_SIZE / sample_rate);
+            renderer = std::thread([this, &keyboard]() {
+              realtime_enter_thread("audio");
+              std::vector<float> left(REPLAY_BLOCK_SIZE), right(REPLAY_BLOCK_SIZE);
+              float *out[2] = {left.data(), right.data()};
+              auto deadline = std::chrono::steady_clock::now();
+              while (is_rendering) {
+                std::fill(left.begin(), left.end(), 0.0f);
+                std::fill(right.begin(), right.end(), 0.0f);
+                keyboard.renderAudio(REPLAY_BLOCK_SIZE, 0, nullptr, 2, out);
+                deadline += std::chrono::duration_cast<std::chrono::steady_clock::duration>(block_duration);
+                std::this_thread::sleep_until(deadline);
+              }
+            });
+        }
+
+        ~HeadlessRenderer() {
+            stop();
+        }
+
+        void stop() {
+            is_rendering = false;
+            if (renderer.joinable()) {
+                renderer.join();
+            }
+        }
+
+        std::chrono::duration<double> getBlockDuration() const {
+            return block_duration;
+        }
+
+    private:
+        std::atomic<bool> is_rendering;
+        std::chrono::duration<double> block_duration;
+        std::thread renderer;
+};
+
+
+/**
+ * Plays the keyboard headless in real time and fails if the real-time threads
+ * page fault once they are warmed up.
+ * 
+ * A track is recorded from generated notes and controller sweeps and looped,
+ * while more notes keep on coming in. The audio is rendered on a thread that
+ * takes the role of the audio driver, which also runs the track callbacks.
+ */
+int soak_test(MidiKeyboard &keyboard, double seconds) {
+  HeadlessRenderer renderer(keyboard);
+
+  auto send = [&](uint8_t type, uint16_t param1, uint8_t param2) {
+    keyboard.ingress->receive(0, {type, 0, param1, param2, trace_now()});
+  };
+  auto start = std::chrono::steady_clock::now();
+  auto elapsed = [&]() {
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+  };
+  send(midi_event_type::CONTROL_CHANGE, midi_cc::RECORD, 127);
+  bool is_recording = true;
+  bool is_warmed_up = false;
+  for (int step = 0; elapsed() < seconds && not keyboard.control.isInterrupted(); ++step) {
+    if (is_recording && elapsed() > SOAK_RECORD_SECONDS) {
+      send(midi_event_type::CONTROL_CHANGE, midi_cc::STOP, 127);
+      send(midi_event_type::CONTROL_CHANGE, midi_cc::PLAY, 127);
+      is_recording = false;
+    }
+    if (not is_warmed_up && elapsed() > SOAK_WARM_UP_SECONDS) {
+      realtime_mark_warmed_up();
+      is_warmed_up = true;
+    }
+    uint16_t key = 48 + step % 24;
+    send(midi_event_type::NOTE_ON, key, 100);
+    send(midi_event_type::CONTROL_CHANGE, midi_cc::IIR_FILTER_CUTOFF, step % 128);
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    send(midi_event_type::NOTE_OFF, key, 0);
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+  }
+  // The page faults of a thread can only be read while it is running.
+  bool is_fault_free = is_warmed_up && realtime_report_page_faults();
+  renderer.stop();
+
+  if (not is_warmed_up) {
+    std::cerr << "The soak test must run longer than the warm-up of "
+              << SOAK_WARM_UP_SECONDS << " s" << std::endl;
+    return 1;
+  }
+  if (not is_fault_free) {
+    std::cerr << "Page faults after warm-up" << std::endl;
+    return 1;
+  }
   return 0;
 }
 
 
+/**
+ * Plays notes and controllers through the keyboard in real time with tracing
+ * on, first for half of the given time straight to the synth and then for
+ * the other half through the sequencer. Prints the latency and jitter of
+ * every stage of both paths side by side.
+ * 
+ * The audio driver and the sequencer run as they do live. The direct path
+ * shows up as the span "synth", the sequencer path as "sequencer delivery",
+ * both from the end of the handler chain until the synth got the event.
+ * Fails unless the direct path has the lower 99th percentile.
+ */
+int latency_test(MidiKeyboard &keyboard, double seconds) {
+  auto send = [&](uint8_t type, uint16_t param1, uint8_t param2) {
+    keyboard.ingress->receive(0, {type, 0, param1, param2, trace_now()});
+  };
+  long dropped_spans = 0;
+  std::array<std::map<std::string, TraceStageSummary>, 2> summaries;
+  for (int path = 0; path < 2; ++path) {
+    keyboard.live_via_sequencer = path == 1;
+    trace_start();
+    auto start = std::chrono::steady_clock::now();
+    for (int step = 0; std::chrono::steady_clock::now() - start < std::chrono::duration<double>(seconds / 2) &&
+                       not keyboard.control.isInterrupted(); ++step) {
+      uint16_t key = 48 + step % 24;
+      send(midi_event_type::NOTE_ON, key, 100);
+      send(midi_event_type::CONTROL_CHANGE, midi_cc::IIR_FILTER_CUTOFF, step % 128);
+      std::this_thread::sleep_for(std::chrono::milliseconds(10));
+      send(midi_event_type::NOTE_OFF, key, 0);
+      std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds(LATENCY_TEST_DRAIN_MS));
+    summaries[path] = trace_summarize(dropped_spans);
+  }
+
+  std::set<std::string> stages;
+  for (auto &summary : summaries) {
+    for (auto &[name, stage] : summary) {
+      stages.insert(name);
+    }
+  }
+  std::cout << std::fixed << std::setprecision(1) << std::left << std::setw(20) << "stage"
+            << std::setw(40) << "direct: spans, median, p99, jitter us"
+            << "sequencer: spans, median, p99, jitter us" << std::endl;
+  for (auto &name : stages) {
+    std::cout << std::setw(20) << name;
+    for (auto &summary : summaries) {
+      std::ostringstream column;
+      column << std::fixed << std::setprecision(1);
+      auto stage = summary.find(name);
+      if (stage != summary.end()) {
+        column << stage->second.spans << ", " << stage->second.median << ", "
+               << stage->second.p99 << ", " << stage->second.jitter;
+      } else {
+        column << "-";
+      }
+      std::cout << std::setw(40) << column.str();
+    }
+    std::cout << std::endl;
+  }
+  if (dropped_spans > 0) {
+    std::cout << "dropped spans: " << dropped_spans << std::endl;
+  }
+  auto direct = summaries[0].find("synth");
+  auto sequencer = summaries[1].find("sequencer delivery");
+  if (direct == summaries[0].end() || sequencer == summaries[1].end()) {
+    std::cerr << "No live event reached the synth on both paths" << std::endl;
+    return 1;
+  }
+  std::cout << "Delivery p99 " << direct->second.p99 << " us direct, "
+            << sequencer->second.p99 << " us through the sequencer" << std::endl;
+  return direct->second.p99 <= sequencer->second.p99 ? 0 : 1;
+}
+
+
+/**
+ * Swaps back and forth between the startup soundfont and the given one while
+ * notes are played headless in real time. Fails if an audio block took longer
+ * to render than it plays during a swap, since the driver would have glitched.
+ * Also fails if a swapped out soundfont is still referenced by either synth,
+ * since fluidsynth only frees a soundfont once no synth references it.
+ */
+int swap_test(MidiKeyboard &keyboard, const std::string &path) {
+  HeadlessRenderer renderer(keyboard);
+  long budget = std::chrono::duration_cast<std::chrono::nanoseconds>(renderer.getBlockDuration()).count();
+  long longest = 0;
+  int number_of_sfonts = fluid_synth_sfcount(keyboard.synth);
+  int leaked_sfonts = 0;
+  for (int swap = 0; swap < SWAP_TEST_SWAPS && not keyboard.control.isInterrupted(); ++swap) {
+    if (not keyboard.swapper->requestSwap(swap % 2 == 0 ? path : DEFAULT_SOUNDFONT)) {
+      return 1;
+    }
+    // The notes keep the synth and the dispatch thread busy during the whole swap.
+    for (int step = 0; keyboard.swapper->isSwapping(); ++step) {
+      uint16_t key = 48 + step % 24;
+      keyboard.ingress->receive(0, {midi_event_type::NOTE_ON, 0, key, 100, trace_now()});
+      std::this_thread::sleep_for(std::chrono::milliseconds(10));
+      keyboard.ingress->receive(0, {midi_event_type::NOTE_OFF, 0, key, 0, trace_now()});
+    }
+    longest = std::max(longest, keyboard.swapper->getLongestBlockTime());
+    leaked_sfonts = std::max(leaked_sfonts, fluid_synth_sfcount(keyboard.synth) - number_of_sfonts +
+                                            keyboard.sfont_loader->getNumberOfHeldSoundfonts());
+  }
+  renderer.stop();
+
+  std::cout << "Longest audio block during " << SWAP_TEST_SWAPS << " swaps took " << longest / 1000
+            << " us, a block plays " << budget / 1000 << " us, " << leaked_sfonts
+            << " swapped out soundfonts not freed" << std::endl;
+  return longest <= budget && leaked_sfonts == 0 ? 0 : 1;
+}
+
+/**
+ * Records a pattern on the virtual clock of a simulation, loops it for the
+ * given number of hours and checks that every event of every loop is played
+ * at exactly the tick at which it was recorded.
+ */
+int simulate_loops(double hours) {
+  auto start = std::chrono::steady_clock::now();
+  Simulation simulation;
+  simulation.advance(1000);
+  simulation.send({midi_event_type::CONTROL_CHANGE, 0, midi_cc::RECORD, 127});
+  unsigned int record_start = simulation.getTick();
+  // The first note comes shortly after the record button, as it would when played.
+  std::vector<CapturedEvent> pattern;
+  for (int note = 0; note < SIMULATION_NOTES; ++note) {
+    unsigned int offset = 10 + note * SIMULATION_LOOP_LENGTH / SIMULATION_NOTES;
+    uint16_t key = 60 + note;
+    MidiEvent note_on = {midi_event_type::NOTE_ON, 0, key, 100};
+    MidiEvent note_off = {midi_event_type::NOTE_OFF, 0, key, 0};
+    simulation.advance(record_start + offset - simulation.getTick());
+    simulation.send(note_on);
+    simulation.advance(SIMULATION_LOOP_LENGTH / SIMULATION_NOTES / 2);
+    simulation.send(note_off);
+    pattern.push_back({offset, note_on});
+    pattern.push_back({offset + SIMULATION_LOOP_LENGTH / SIMULATION_NOTES / 2, note_off});
+  }
+  simulation.advance(record_start + SIMULATION_LOOP_LENGTH - simulation.getTick());
+  simulation.send({midi_event_type::CONTROL_CHANGE, 0, midi_cc::STOP, 127});
+  simulation.advance(500);
+  simulation.send({midi_event_type::CONTROL_CHANGE, 0, midi_cc::PLAY, 127});
+  unsigned int play_start = simulation.getTick();
+  simulation.advance(static_cast<unsigned int>(hours * 3600 * 1000));
+
+  const auto &captured = simulation.getCapturedEvents();
+  size_t played = 0, mismatches = 0;
+  for (unsigned int loop_start = play_start; loop_start + pattern.back().tick <= simulation.getTick();
+       loop_start += SIMULATION_LOOP_LENGTH) {
+    for (auto &expected : pattern) {
+      if (played >= captured.size() || captured[played].tick != loop_start + expected.tick ||
+          not (captured[played].event == expected.event)) {
+        mismatches++;
+      }
+      played++;
+    }
+  }
+  if (captured.size() > played) {
+    mismatches += captured.size() - played;
+  }
+  std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+  std::cout << "Simulated " << hours << " h of loop playback in " << elapsed.count() << " s, "
+            << captured.size() << " events played, " << mismatches << " mismatches" << std::endl;
+  return mismatches == 0 ? 0 : 1;
+}
+
+/**
+ * Returns the ticks at which the simulation played the given key from the given tick on.
+ */
+static std::vector<unsigned int> played_ticks(const Simulation &simulation, uint16_t key, unsigned int from) {
+  std::vector<unsigned int> ticks;
+  for (auto &captured : simulation.getCapturedEvents()) {
+    if (captured.tick >= from && captured.event.type == midi_event_type::NOTE_ON && captured.event.key() == key) {
+      ticks.push_back(captured.tick);
+    }
+  }
+  return ticks;
+}
+
+/**
+ * Overdubs a playing loop across two loop restarts. Checks that the loop keeps
+ * on playing during the overdub, and that it lasts as long as its longest take
+ * once the overdub is played along.
+ */
+int simulate_overdub() {
+  Simulation simulation;
+  simulation.advance(1000);
+  simulation.send({midi_event_type::CONTROL_CHANGE, 0, midi_cc::RECORD, 127});
+  unsigned int record_start = simulation.getTick();
+  simulation.advance(10);
+  simulation.send({midi_event_type::NOTE_ON, 0, 60, 100});
+  simulation.advance(100);
+  simulation.send({midi_event_type::NOTE_OFF, 0, 60, 0});
+  simulation.advance(record_start + SIMULATION_LOOP_LENGTH - simulation.getTick());
+  simulation.send({midi_event_type::CONTROL_CHANGE, 0, midi_cc::STOP, 127});
+  simulation.advance(100);
+  simulation.send({midi_event_type::CONTROL_CHANGE, 0, midi_cc::PLAY, 127});
+  unsigned int play_start = simulation.getTick();
+
+  // Starts shortly before the end of the first loop and ends after the start of the third one.
+  simulation.advance(SIMULATION_LOOP_LENGTH - 100);
+  simulation.send({midi_event_type::CONTROL_CHANGE, 0, midi_cc::RECORD, 127});
+  simulation.advance(200);
+  simulation.send({midi_event_type::NOTE_ON, 0, 62, 100});
+  simulation.advance(100);
+  simulation.send({midi_event_type::NOTE_OFF, 0, 62, 0});
+  simulation.advance(SIMULATION_OVERDUB_LENGTH - 300);
+  simulation.send({midi_event_type::CONTROL_CHANGE, 0, midi_cc::STOP, 127});
+  std::vector<unsigned int> expected = {play_start + 10, play_start + SIMULATION_LOOP_LENGTH + 10,
+                                        play_start + 2 * SIMULATION_LOOP_LENGTH + 10};
+  bool is_looping = played_ticks(simulation, 60, play_start) == expected;
+
+  simulation.advance(100);
+  simulation.send({midi_event_type::CONTROL_CHANGE, 0, midi_cc::PLAY, 127});
+  play_start = simulation.getTick();
+  simulation.advance(2 * SIMULATION_OVERDUB_LENGTH - 1);
+  expected = {play_start + 10, play_start + SIMULATION_OVERDUB_LENGTH + 10};
+  std::vector<unsigned int> expected_overdub = {play_start + 200, play_start + SIMULATION_OVERDUB_LENGTH + 200};
+  bool has_overdub_length = played_ticks(simulation, 60, play_start) == expected &&
+                            played_ticks(simulation, 62, play_start) == expected_overdub;
+
+  std::cout << "Overdub across two loop restarts: loop " << (is_looping ? "kept playing" : "stopped")
+            << ", loop length " << (has_overdub_length ? "is" : "is not") << " the longest take" << std::endl;
+  return is_looping && has_overdub_length ? 0 : 1;
+}
+
+/**
+ * Records a representative session on the virtual clock of a simulation into
+ * a new record journal, which trains the PGO build (see makefile). Every track
+ * plays chords over a bass line with pitch bends, aftertouch and sweeps of the
+ * volume, filter and effect knobs, each on its own channel.
+ */
+int generate_session(const std::string &path) {
+  std::filesystem::remove(path);
+  {
+    Simulation simulation(path);
+    simulation.advance(1000);
+    for (uint8_t track = 0; track < SESSION_TRACKS; ++track) {
+      uint8_t channel = track;
+      auto send = [&](uint8_t type, uint16_t param1, uint8_t param2) {
+        simulation.send({type, channel, param1, param2});
+      };
+      send(midi_event_type::CONTROL_CHANGE, midi_cc::RECORD, 127);
+      send(midi_event_type::PROGRAM_CHANGE, track * 8, 0);
+      for (int beat = 0; beat < SESSION_BEATS; ++beat) {
+        uint16_t root = 48 + (beat / 4 % 4) * 5 % 12;
+        send(midi_event_type::NOTE_ON, root - 12, 90);
+        for (uint16_t interval : {0, 4, 7}) {
+          send(midi_event_type::NOTE_ON, root + interval + track, 70 + beat % 32);
+        }
+        for (int step = 0; step < 10; ++step) {
+          simulation.advance(20);
+          send(midi_event_type::PITCH_BEND, 8192 + (step < 5 ? step : 10 - step) * 400, 0);
+          send(midi_event_type::CHANNEL_PRESSURE, 40 + step * 4, 0);
+          send(midi_event_type::CONTROL_CHANGE, midi_cc::IIR_FILTER_CUTOFF, (beat * 10 + step) % 128);
+          send(midi_event_type::CONTROL_CHANGE, midi_cc::EFFECT_PARAM1 + beat % 4, (beat * 3 + step) % 128);
+          send(midi_event_type::CONTROL_CHANGE, midi_cc::ATTENUATION, 90 + step);
+        }
+        for (uint16_t interval : {0, 4, 7}) {
+          send(midi_event_type::NOTE_OFF, root + interval + track, 0);
+        }
+        send(midi_event_type::NOTE_OFF, root - 12, 0);
+        simulation.advance(50);
+      }
+      send(midi_event_type::CONTROL_CHANGE, midi_cc::STOP, 127);
+      send(midi_event_type::CONTROL_CHANGE, midi_cc::FORWARD, 127);
+    }
+  }
+  std::vector<RecoveredTrack> tracks;
+  if (readJournal(path, tracks) <= 0) {
+    std::cerr << "Failed to write record journal " << path << std::endl;
+    return 1;
+  }
+  std::cout << "Wrote a session of " << tracks.size() << " tracks to " << path << std::endl;
+  return 0;
+}
+
+/**
+ * Replays many simulated midi devices into one midi ingress at once and
+ * checks that the dispatch thread sees every event, in the order of the
+ * timestamps and in the order in which each device sent them.
+ * 
+ * Every device is a thread which stamps and pushes its events like the
+ * driver callback, INGRESS_TEST_MIN_STEP to INGRESS_TEST_MAX_STEP apart.
+ * The order only depends on the scheduling through this bound: as long as
+ * no push takes longer than half the reorder window, every event stamped
+ * before a due event has been pushed and held before the dispatch thread
+ * reads the time it dispatches that event at. Pushes which take longer,
+ * e.g. because the thread was preempted, are counted as stalled, and only
+ * then events may be dispatched out of order.
+ */
+int ingress_test(int number_of_devices) {
+  // Every device has at most three events within the reorder window held at once.
+  if (number_of_devices * 3 > INGRESS_REORDER_CAPACITY) {
+    std::cerr << "At most " << INGRESS_REORDER_CAPACITY / 3 << " devices can be tested at once" << std::endl;
+    return 1;
+  }
+  std::vector<MidiDeviceConfig> configs(number_of_devices);
+  std::atomic<long> dispatched_events = 0, stalled_pushes = 0;
+  long unordered_events = 0, lost_events = 0;
+  uint64_t last_time = 0;
+  std::vector<int> next_events(number_of_devices, 0);
+  MidiIngress ingress(nullptr, configs, true, [&](IngressEvent &event, HandlerChain&) {
+      if (event.event.time < last_time) {
+        unordered_events++;
+      }
+      last_time = std::max(last_time, event.event.time);
+      int &next_event = next_events[event.device];
+      if (event.event.param1 != next_event) {
+        lost_events++;
+      }
+      next_event = event.event.param1 + 1;
+      dispatched_events.fetch_add(1, std::memory_order_release);
+  });
+  ingress.start();
+
+  auto start = std::chrono::steady_clock::now();
+  std::vector<std::thread> devices;
+  for (int device = 0; device < number_of_devices; ++device) {
+    devices.emplace_back([&ingress, &stalled_pushes, device]() {
+      std::minstd_rand random(device);
+      uint64_t time = trace_now();
+      for (uint16_t sequence = 0; sequence < INGRESS_TEST_EVENTS; ++sequence) {
+        time += (INGRESS_TEST_MIN_STEP + random() % (INGRESS_TEST_MAX_STEP - INGRESS_TEST_MIN_STEP)) * 1000;
+        timespec wake_up = {static_cast<time_t>(time / 1000000000), static_cast<long>(time % 1000000000)};
+        while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &wake_up, nullptr) != 0) {
+        }
+        uint64_t stamped = trace_now();
+        ingress.receive(device, {midi_event_type::NOTE_ON, 0, sequence, 100, stamped});
+        if (trace_now() - stamped > INGRESS_REORDER_WINDOW / 2) {
+          stalled_pushes.fetch_add(1, std::memory_order_relaxed);
+        }
+      }
+    });
+  }
+  for (auto &device : devices) {
+    device.join();
+  }
+  long sent_events = static_cast<long>(number_of_devices) * INGRESS_TEST_EVENTS;
+  // The last events are held back for the reorder window.
+  for (int wait = 0; wait < 100 && dispatched_events.load(std::memory_order_acquire) < sent_events; ++wait) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+  }
+  std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+  ingress.reportDroppedEvents();
+  long dispatched = dispatched_events.load(std::memory_order_acquire);
+  long stalled = stalled_pushes.load(std::memory_order_relaxed);
+  std::cout << "Dispatched " << dispatched << " of " << sent_events << " events from "
+            << number_of_devices << " devices in " << elapsed.count() << " s, "
+            << unordered_events << " out of timestamp order, " << lost_events << " out of device order, "
+            << stalled << " stalled pushes" << std::endl;
+  if (dispatched != sent_events) {
+    return 1;
+  }
+  if (unordered_events == 0 and lost_events == 0) {
+    return 0;
+  }
+  if (stalled > 0) {
+    std::cout << "The order is not checked, since pushes stalled longer than half the reorder window" << std::endl;
+    return 0;
+  }
+  return 1;
+}
+
+
+/**
+ * Drives a fixed sequence of notes and controllers through the handler chain
+ * of the keyboard, once reading every event with the fluidsynth accessors in
+ * each handler, as before the events were decoded, and once decoding it into
+ * a MidiEvent whose fields the handlers read inline. Prints the accessor calls
+ * counted during one pass over the sequence and the time per event of both.
+ */
+int decode_benchmark(MidiKeyboard &keyboard, long events) {
+  const std::vector<MidiEvent> sequence = {
+    {midi_event_type::NOTE_ON, 0, 60, 100},
+    {midi_event_type::CONTROL_CHANGE, 0, midi_cc::IIR_FILTER_CUTOFF, 64},
+    {midi_event_type::CHANNEL_PRESSURE, 0, 80, 0},
+    {midi_event_type::PITCH_BEND, 0, 9000, 0},
+    {midi_event_type::NOTE_OFF, 0, 60, 0},
+  };
+  std::vector<Handler*> chain;
+  for (auto *handlers : {&keyboard.ingress->getDeviceHandlers(0), &keyboard.handlers}) {
+    for (auto &handler : *handlers) {
+      chain.push_back(handler.get());
+    }
+  }
+  // Filled like the driver fills the event it hands to the callback.
+  fluid_midi_event_t *midi_event = new_fluid_midi_event();
+  auto receive = [midi_event](const MidiEvent &event) {
+    fluid_midi_event_set_type(midi_event, event.type);
+    fluid_midi_event_set_channel(midi_event, event.channel);
+    fluid_midi_event_set_key(midi_event, event.param1);
+    fluid_midi_event_set_value(midi_event, event.param2);
+  };
+  long calls = 0;
+  auto count = [&calls](auto accessor, auto *midi_event, auto... value) {
+    calls++;
+    return accessor(midi_event, value...);
+  };
+  auto call = [](auto accessor, auto *midi_event, auto... value) {
+    return accessor(midi_event, value...);
+  };
+  auto measure = [&](auto handle) {
+    calls = 0;
+    for (const MidiEvent &event : sequence) {
+      receive(event);
+      handle(count);
+    }
+    double calls_per_event = static_cast<double>(calls) / sequence.size();
+    auto start = std::chrono::steady_clock::now();
+    for (long event = 0; event < events; ++event) {
+      receive(sequence[event % sequence.size()]);
+      handle(call);
+    }
+    double time = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count() / events;
+    return std::make_pair(calls_per_event, time);
+  };
+  // Every handler read the fields of the event and wrote back the ones it changed.
+  auto [accessor_calls, accessor_time] = measure([&](auto read) {
+    for (Handler *handler : chain) {
+      MidiEvent event = decode_midi_event(midi_event, read);
+      MidiEvent handled = handler->handleEvent(event);
+      if (handled.isDropped()) {
+        break;
+      }
+      if (handled.channel != event.channel) {
+        read(fluid_midi_event_set_channel, midi_event, handled.channel);
+      }
+      if (handled.param1 != event.param1) {
+        read(fluid_midi_event_set_key, midi_event, handled.param1);
+      }
+      if (handled.param2 != event.param2) {
+        read(fluid_midi_event_set_value, midi_event, handled.param2);
+      }
+    }
+  });
+  auto [decode_calls, decode_time] = measure([&](auto read) {
+    MidiEvent event = decode_midi_event(midi_event, read);
+    for (Handler *handler : chain) {
+      event = handler->handleEvent(event);
+      if (event.isDropped()) {
+        break;
+      }
+    }
+  });
+  delete_fluid_midi_event(midi_event);
+  std::cout << "Through " << chain.size() << " handlers, accessors in every handler: " << accessor_calls
+            << " calls, " << accessor_time << " ns per event" << std::endl
+            << "Decoded once: " << decode_calls << " calls, " << decode_time << " ns per event" << std::endl;
+  return 0;
+}
+
+
+/**
+ * Runs several keyboards in one process, which share the samples of their soundfonts.
+ *
+ * Every keyboard has its own synth, sequencer, handler chain and tracks and
+ * renders on its own audio thread, so the keyboards render in parallel.
+ * A replay renders the journal with all keyboards at once, each on its own thread.
+ * The command "instance <n>" chooses the keyboard which gets the following commands.
+ */
+int run_host(const KeyboardOptions &options, int instances, ControlThread &control) {
+  // Destroyed after the keyboards, whose synths play its soundfonts.
+  SharedSoundfontLoader shared_loader;
+  std::vector<std::unique_ptr<MidiKeyboard>> keyboards;
+  for (int instance = 0; instance < instances; ++instance) {
+    KeyboardOptions instance_options = options;
+    instance_options.shared_loader = &shared_loader;
+    // The keyboards already render in parallel, a calibration per keyboard would only compete.
+    if (options.cpu_cores == 0) {
+      instance_options.cpu_cores = 1;
+    }
+    if (not options.journal_path.empty()) {
+      instance_options.journal_path = options.journal_path + "." + std::to_string(instance);
+    }
+    keyboards.push_back(std::make_unique<MidiKeyboard>(instance_options, control));
+  }
+
+  if (not options.replay_path.empty()) {
+    control.start(nullptr);
+    std::vector<int> results(instances);
+    std::vector<std::thread> replays;
+    for (int instance = 0; instance < instances; ++instance) {
+      replays.emplace_back([&, instance]() {
+        results[instance] = replay_session(*keyboards[instance], options.replay_path);
+      });
+    }
+    for (auto &replay : replays) {
+      replay.join();
+    }
+    return *std::max_element(results.begin(), results.end());
+  }
+  size_t current = 0;
+  control.start([&](const std::string &line) {
+    std::istringstream stream(line);
+    std::string command;
+    stream >> command;
+    if (command != "instance") {
+      handle_command(*keyboards[current], line);
+      return;
+    }
+    size_t instance = keyboards.size();
+    stream >> instance;
+    if (instance >= keyboards.size()) {
+      std::cerr << "Usage: instance <0-" << keyboards.size() - 1 << ">" << std::endl;
+      return;
+    }
+    current = instance;
+  });
+  control.waitForInterrupt();
+  return 0;
+}
+
+
+/**
+ * Parses a list of cpus like 2,3
+ */
+std::vector<int> parse_cpus(const std::string &list) {
+  std::vector<int> cpus;
+  std::istringstream stream(list);
+  std::string cpu;
+  while (std::getline(stream, cpu, ',')) {
+    cpus.push_back(std::atoi(cpu.c_str()));
+  }
+  return cpus;
+}
+
+
 int main(int argc, char **argv) {
-  MidiKeyboard keyboard;
-  while(true) sleep(1);
+  KeyboardOptions options;
+  RealtimeConfig realtime_config;
+  double soak_seconds = 0;
+  double latency_seconds = 0;
+  long decode_events = 0;
+  std::string swap_test_path;
+  int instances = 1;
+  for (int i = 1; i < argc; ++i) {
+    std::string argument = argv[i];
+    if (argument == "--journal" && i + 1 < argc) {
+      options.journal_path = argv[++i];
+    } else if (argument == "--replay" && i + 1 < argc) {
+      options.replay_path = argv[++i];
+      options.headless = true;
+    } else if (argument == "--cpu-cores" && i + 1 < argc) {
+      options.cpu_cores = std::atoi(argv[++i]);
+    } else if (argument == "--core-scaling") {
+      fluid_settings_t *settings = new_keyboard_settings();
+      print_core_scaling(settings);
+      delete_fluid_settings(settings);
+      return 0;
+    } else if (argument == "--simulate" && i + 1 < argc) {
+      int result = simulate_loops(std::atof(argv[++i]));
+      return simulate_overdub() == 0 ? result : 1;
+    } else if (argument == "--generate-session" && i + 1 < argc) {
+      return generate_session(argv[++i]);
+    } else if (argument == "--decode-benchmark" && i + 1 < argc) {
+      decode_events = std::max(1L, std::atol(argv[++i]));
+      options.headless = true;
+    } else if (argument == "--ingress-test" && i + 1 < argc) {
+      return ingress_test(std::max(1, std::atoi(argv[++i])));
+    } else if (argument == "--library" && i + 1 < argc) {
+      options.library_path = argv[++i];
+    } else if (argument == "--realtime") {
+      realtime_config.enabled = true;
+    } else if (argument == "--realtime-priority" && i + 1 < argc) {
+      realtime_config.priority = std::atoi(argv[++i]);
+    } else if (argument == "--realtime-cpus" && i + 1 < argc) {
+      realtime_config.cpus = parse_cpus(argv[++i]);
+    } else if (argument == "--soak" && i + 1 < argc) {
+      soak_seconds = std::atof(argv[++i]);
+      realtime_config.enabled = true;
+      options.headless = true;
+    } else if (argument == "--latency-test" && i + 1 < argc) {
+      latency_seconds = std::atof(argv[++i]);
+    } else if (argument == "--swap-test" && i + 1 < argc) {
+      swap_test_path = argv[++i];
+      options.headless = true;
+    } else if (argument == "--midi-device" && i + 1 < argc) {
+      // A device given as <portname>:split gets its own split handler.
+      std::string portname = argv[++i];
+      bool has_split_handler = portname.ends_with(":split");
+      if (has_split_handler) {
+        portname.resize(portname.size() - std::string(":split").size());
+      }
+      options.devices.push_back({portname, has_split_handler});
+    } else if (argument == "--live-via-sequencer") {
+      options.live_via_sequencer = true;
+    } else if (argument == "--automation-tolerance" && i + 1 < argc) {
+      options.automation.tolerance = std::atof(argv[++i]);
+    } else if (argument == "--automation-interval" && i + 1 < argc) {
+      // Given in milliseconds.
+      options.automation.interval = std::max(1, std::atoi(argv[++i])) * SAMPLES_PER_TICK;
+    } else if (argument == "--instances" && i + 1 < argc) {
+      instances = std::max(1, std::atoi(argv[++i]));
+    } else {
+      std::cerr << "Usage: " << argv[0] << " [--journal <path>] [--replay <journal>]"
+                << " [--cpu-cores <n>] [--core-scaling] [--library <directory>] [--simulate <hours>]"
+                << " [--realtime] [--realtime-priority <n>] [--realtime-cpus <cpu,...>] [--soak <seconds>]"
+                << " [--swap-test <soundfont>] [--ingress-test <devices>] [--latency-test <seconds>]"
+                << " [--decode-benchmark <events>] [--generate-session <path>]"
+                << " [--midi-device <portname>[:split]]... [--instances <n>]"
+                << " [--live-via-sequencer] [--automation-tolerance <steps>] [--automation-interval <ms>]" << std::endl;
+      return 1;
+    }
+  }
+  if (options.devices.empty()) {
+    options.devices.push_back({"", true});
+  }
+
+  // Before the keyboard starts any thread.
+  ControlThread control(true);
+  realtime_setup(realtime_config);
+  // The soak, swap and latency tests and the decode benchmark check a single keyboard.
+  if (instances > 1 && soak_seconds == 0 && swap_test_path.empty() && latency_seconds == 0 && decode_events == 0) {
+    return run_host(options, instances, control);
+  }
+  MidiKeyboard keyboard(options, control);
+  if (not options.replay_path.empty()) {
+    control.start(nullptr);
+    return replay_session(keyboard, options.replay_path);
+  }
+  if (soak_seconds > 0) {
+    control.start(nullptr);
+    return soak_test(keyboard, soak_seconds);
+  }
+  if (not swap_test_path.empty()) {
+    control.start(nullptr);
+    return swap_test(keyboard, swap_test_path);
+  }
+  if (latency_seconds > 0) {
+    control.start(nullptr);
+    return latency_test(keyboard, latency_seconds);
+  }
+  if (decode_events > 0) {
+    control.start(nullptr);
+    return decode_benchmark(keyboard, decode_events);
+  }
+  control.start([&keyboard](const std::string &line) { handle_command(keyboard, line); });
+  // Returning runs the destructors, which close the devices and flush the journal.
+  control.waitForInterrupt();
   return 0;
 }
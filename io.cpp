@@ -17,13 +17,40 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
 #include "io.h"
 
-std::ostream& operator<<(std::ostream& stream, fluid_midi_event_t* event) {
-  stream << "Type: " << fluid_midi_event_get_type(event) 
-         << " Channel " << fluid_midi_event_get_channel(event) 
-         << " Value " << fluid_midi_event_get_value(event) 
-         << " Velocity " << fluid_midi_event_get_velocity(event) 
-         << " Control " << fluid_midi_event_get_control(event);
+std::ostream& operator<<(std::ostream& stream, const MidiEvent &event) {
+  stream << "Type: " << static_cast<int>(event.type) 
+         << " Channel " << static_cast<int>(event.channel) 
+         << " Value " << event.value() 
+         << " Velocity " << event.velocity() 
+         << " Control " << event.control();
   return stream;
 }
+
+const char* map_file(const std::string &path, size_t &size, size_t min_size) {
+  int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    return nullptr;
+  }
+  struct stat status;
+  void *mapped = MAP_FAILED;
+  if (fstat(fd, &status) == 0 && status.st_size > 0 && static_cast<size_t>(status.st_size) >= min_size) {
+    mapped = mmap(nullptr, status.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  }
+  close(fd);
+  if (mapped == MAP_FAILED) {
+    return nullptr;
+  }
+  size = status.st_size;
+  return static_cast<const char*>(mapped);
+}
+
+void unmap_file(const char *data, size_t size) {
+  munmap(const_cast<char*>(data), size);
+}
@@ -18,12 +18,27 @@
  */
 
 
+#include <cstddef>
 #include <iostream>
-#include <fluidsynth.h>
+#include <string>
+
+#include "midi_event.h"
 
 /**
  * Prints a midi event on a output stream.
  * 
  * This is mostyle usedul for debugging.
  */
-std::ostream& operator<<(std::ostream& stream, fluid_midi_event_t* event);
+std::ostream& operator<<(std::ostream& stream, const MidiEvent &event);
+
+/**
+ * Maps a whole file read-only into memory, the mapping stays valid after the
+ * file is closed. Returns nullptr if the file can't be opened or mapped, or
+ * is smaller than the given minimum size.
+ */
+const char* map_file(const std::string &path, size_t &size, size_t min_size = 1);
+
+/**
+ * Unmaps a file mapped by map_file.
+ */
+void unmap_file(const char *data, size_t size);
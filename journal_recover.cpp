@@ -0,0 +1,69 @@
+/**
+ * Fluidsynth for ImpactLX49+
+ * 
+ * Copyright (C) 2021 Thomas Keck
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <filesystem>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "record_journal.h"
+
+/**
+ * Inspects and repairs a record journal, e.g. after a crash.
+ * 
+ * Prints the tracks that can be rebuilt from the journal.
+ * With --repair the incomplete record at the end of the journal is cut off.
+ * The tracks are restored by starting impact_lx48+ with --journal <path>.
+ */
+int main(int argc, char **argv) {
+  if (argc < 2) {
+    std::cerr << "Usage: " << argv[0] << " <journal> [--repair]" << std::endl;
+    return 1;
+  }
+  std::string path = argv[1];
+  bool repair = argc > 2 && std::string(argv[2]) == "--repair";
+
+  std::vector<RecoveredTrack> tracks;
+  long valid_bytes = readJournal(path, tracks);
+  if (valid_bytes < 0) {
+    std::cerr << path << " is not a record journal" << std::endl;
+    return 1;
+  }
+
+  for (unsigned int track = 0; track < tracks.size(); ++track) {
+    size_t events = 0;
+    for (auto &take : tracks[track].takes) {
+      events += take.size();
+    }
+    std::cout << "Track " << track
+              << " Duration " << tracks[track].duration * 1000L / TRACK_SAMPLE_RATE << " ms"
+              << " Takes " << tracks[track].takes.size()
+              << " Events " << events << std::endl;
+  }
+
+  long size = std::filesystem::exists(path) ? std::filesystem::file_size(path) : 0;
+  if (size > valid_bytes) {
+    std::cout << "Journal is truncated, " << size - valid_bytes << " bytes at the end are invalid" << std::endl;
+    if (repair) {
+      std::filesystem::resize_file(path, valid_bytes);
+      std::cout << "Repaired " << path << std::endl;
+    }
+  }
+  return 0;
+}
@@ -17,8 +17,17 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#pragma once
 
 #define MIDI_BUTTON_THRESHOLD 64
+#define MIDI_BANK_SELECT 0
+#define MIDI_BANK_SELECT_LSB 32
+#define MIDI_DATA_ENTRY 6
+#define MIDI_DATA_ENTRY_LSB 38
+#define MIDI_NRPN_LSB 98
+#define MIDI_NRPN_MSB 99
+#define MIDI_RPN_LSB 100
+#define MIDI_RPN_MSB 101
 
 /**
  * Enum containing the midi event types.
@@ -74,6 +83,14 @@ enum midi_cc {
     VOLENVDECAY = 43,
     VOLENVSUSTAIN = 44,
     VOLENVRELEASE = 45,
+    // Snapshot controller, the slot knob selects the slot
+    // which is stored or recalled by the buttons.
+    SNAPSHOT_SLOT = 46,
+    SNAPSHOT_STORE = 47,
+    SNAPSHOT_RECALL = 48,
+    // Tempo of all tracks and of the current track, 64 is the recorded tempo.
+    TEMPO = 49,
+    TRACK_TEMPO = 50,
     // Volume controller.
     // Note: controller 7 is automatically recognized by fluidsynth as
     // the controller that modifies the volume. 
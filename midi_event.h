@@ -0,0 +1,162 @@
+/**
+ * Fluidsynth for ImpactLX49+
+ * 
+ * Copyright (C) 2021 Thomas Keck
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <cstdint>
+
+#include <fluidsynth.h>
+
+#include "midi_enums.h"
+
+/**
+ * Compact copy of a midi channel message.
+ * 
+ * The fluidsynth accessors are opaque library calls, which cannot be inlined.
+ * Therefore every received event is decoded once into this struct, which
+ * is handed through the handler chain. It is played with the synth function
+ * of its type, and is only encoded again if it is forwarded to the sequencer.
+ * 
+ * The fields follow the layout of fluid_midi_event_t: param1 holds the key,
+ * control, program, channel pressure or 14 bit pitch bend value, param2
+ * holds the velocity or control value.
+ * 
+ * The time is the CLOCK_MONOTONIC time in nanoseconds at which the event
+ * was received from the midi driver, 0 if it is unknown (e.g. during a replay).
+ * It makes the struct 16 instead of 6 bytes. That is still passed to and
+ * returned from a handler in two registers on x86-64 and AArch64, so the
+ * record handler gets the time without a second parameter for every handler.
+ * 
+ * A handler can drop an event, so it is not forwarded to fluidsynth.
+ */
+struct MidiEvent {
+    uint8_t type;
+    uint8_t channel;
+    uint16_t param1;
+    uint8_t param2;
+    uint64_t time = 0;
+
+    int key() const { return param1; }
+    int control() const { return param1; }
+    int program() const { return param1; }
+    int pitch() const { return param1; }
+    int velocity() const { return param2; }
+    int value() const { return param2; }
+
+    bool selectsPreset() const {
+        return type == midi_event_type::PROGRAM_CHANGE ||
+               (type == midi_event_type::CONTROL_CHANGE && param1 == MIDI_BANK_SELECT);
+    }
+
+    void drop() { type = 0; }
+    bool isDropped() const { return type == 0; }
+
+    bool operator==(const MidiEvent &other) const = default;
+};
+
+static_assert(sizeof(MidiEvent) <= 16, "A MidiEvent must fit into two registers");
+
+/**
+ * Decodes the event, calling every fluidsynth accessor as read(accessor, event),
+ * which lets the decode benchmark count the calls.
+ */
+template<typename Read>
+inline MidiEvent decode_midi_event(const fluid_midi_event_t *event, Read read) {
+    MidiEvent midi_event;
+    midi_event.type = read(fluid_midi_event_get_type, event);
+    midi_event.channel = read(fluid_midi_event_get_channel, event);
+    midi_event.param1 = read(fluid_midi_event_get_key, event);
+    midi_event.param2 = read(fluid_midi_event_get_value, event);
+    return midi_event;
+}
+
+inline MidiEvent decode_midi_event(const fluid_midi_event_t *event) {
+    return decode_midi_event(event, [](auto accessor, const fluid_midi_event_t *event) {
+        return accessor(event);
+    });
+}
+
+/**
+ * Plays the midi event with the synth function of its type, which is what
+ * fluid_synth_handle_midi_event does, without encoding the event first.
+ */
+inline void play_midi_event(fluid_synth_t *synth, const MidiEvent &midi_event) {
+    int channel = midi_event.channel;
+    switch(midi_event.type) {
+    case midi_event_type::NOTE_OFF:
+        fluid_synth_noteoff(synth, channel, midi_event.key());
+        break;
+    case midi_event_type::NOTE_ON:
+        // A velocity of 0 is a note off for fluidsynth as well.
+        fluid_synth_noteon(synth, channel, midi_event.key(), midi_event.velocity());
+        break;
+    case midi_event_type::KEY_PRESSURE:
+        fluid_synth_key_pressure(synth, channel, midi_event.key(), midi_event.value());
+        break;
+    case midi_event_type::CONTROL_CHANGE:
+        fluid_synth_cc(synth, channel, midi_event.control(), midi_event.value());
+        break;
+    case midi_event_type::PROGRAM_CHANGE:
+        fluid_synth_program_change(synth, channel, midi_event.program());
+        break;
+    case midi_event_type::CHANNEL_PRESSURE:
+        fluid_synth_channel_pressure(synth, channel, midi_event.param1);
+        break;
+    case midi_event_type::PITCH_BEND:
+        fluid_synth_pitch_bend(synth, channel, midi_event.pitch());
+        break;
+    }
+}
+
+/**
+ * Converts the midi event into an event of the fluidsynth sequencer.
+ */
+inline void encode_sequencer_event(const MidiEvent &midi_event, fluid_event_t *event) {
+    // See https://github.com/FluidSynth/fluidsynth/blob/
+    // 883ea24960f7af117747eb99c257022b1e3de750/src/midi/fluid_seqbind.c#L371
+    int type = midi_event.type;
+    int channel = midi_event.channel;
+    int key = midi_event.key();
+    int control = midi_event.control();
+    int value = midi_event.value();
+    int velocity = midi_event.velocity();
+    switch(type) {
+    case midi_event_type::NOTE_OFF:
+        fluid_event_noteoff(event, channel, key);
+        break;
+    case midi_event_type::NOTE_ON:
+        fluid_event_noteon(event, channel, key, velocity);
+        break;
+    case midi_event_type::KEY_PRESSURE:
+        fluid_event_key_pressure(event, channel, key, value);
+        break;
+    case midi_event_type::CONTROL_CHANGE:
+        fluid_event_control_change(event, channel, control, value);
+        break;
+    case midi_event_type::PROGRAM_CHANGE:
+        fluid_event_program_change(event, channel, midi_event.program());
+        break;
+    case midi_event_type::CHANNEL_PRESSURE:
+        fluid_event_channel_pressure(event, channel, midi_event.param1);
+        break;
+    case midi_event_type::PITCH_BEND:
+        fluid_event_pitch_bend(event, channel, midi_event.pitch());
+        break;
+    }
+}
@@ -0,0 +1,176 @@
+/**
+ * Fluidsynth for ImpactLX49+
+ * 
+ * Copyright (C) 2021 Thomas Keck
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <algorithm>
+#include <iostream>
+#include <stdexcept>
+
+#include <time.h>
+
+#include "format_workaround.h"
+
+#include "midi_ingress.h"
+#include "realtime.h"
+#include "split_handler.h"
+#include "trace.h"
+
+
+int ingress_midi_event(void* data, fluid_midi_event_t* event) {
+  // Stamped first, so the time does not include any delay of the handlers.
+  uint64_t received_time = trace_now();
+  MidiIngress::Device *device = reinterpret_cast<MidiIngress::Device*>(data);
+  MidiEvent midi_event = decode_midi_event(event);
+  midi_event.time = received_time;
+  device->ingress->receive(device->id, midi_event);
+  return 0;
+}
+
+
+MidiIngress::MidiIngress(fluid_settings_t *settings, const std::vector<MidiDeviceConfig> &configs,
+                         bool headless, std::function<void(IngressEvent&, HandlerChain&)> dispatch) :
+    settings(settings),
+    configs(configs),
+    headless(headless),
+    dispatch(dispatch),
+    queue(INGRESS_QUEUE_SIZE),
+    reorder_window(configs.size() > 1 ? INGRESS_REORDER_WINDOW : 0),
+    pending_events(0),
+    is_waiting(false),
+    dropped_events(0),
+    is_running(true) {
+        for (auto &config : configs) {
+            auto device = std::make_unique<Device>();
+            device->ingress = this;
+            device->id = devices.size();
+            device->driver = nullptr;
+            if (config.has_split_handler) {
+                device->handlers.push_back(std::make_unique<SplitHandler>(4));
+            }
+            devices.push_back(std::move(device));
+        }
+        held_events.reserve(INGRESS_REORDER_CAPACITY);
+}
+
+MidiIngress::~MidiIngress() {
+    for (auto &device : devices) {
+        delete_fluid_midi_driver(device->driver);
+    }
+    if (dispatcher.joinable()) {
+        is_running = false;
+        pending_events.fetch_add(1, std::memory_order_release);
+        pending_events.notify_one();
+        dispatcher.join();
+    }
+}
+
+void MidiIngress::start() {
+    dispatcher = std::thread(&MidiIngress::dispatchInBackground, this);
+    if (headless) {
+        return;
+    }
+    char *default_portname = nullptr;
+    fluid_settings_getstr_default(settings, "midi.portname", &default_portname);
+    for (unsigned int device = 0; device < devices.size(); ++device) {
+        // The settings are read when the driver is created, hence they can be
+        // reused for the next device, which must not inherit the portname.
+        const std::string &portname = configs[device].portname;
+        fluid_settings_setstr(settings, "midi.portname", not portname.empty() ? portname.c_str() :
+                              default_portname != nullptr ? default_portname : "");
+        devices[device]->driver = new_fluid_midi_driver(settings, ingress_midi_event, devices[device].get());
+        if (devices[device]->driver == nullptr) {
+            throw std::runtime_error(std::format("Failed to open midi device {}", configs[device].portname));
+        }
+    }
+}
+
+size_t MidiIngress::getNumberOfDevices() const {
+    return devices.size();
+}
+
+void MidiIngress::receive(uint16_t device, MidiEvent event) {
+    if (not queue.push({event, device})) {
+        dropped_events.fetch_add(1, std::memory_order_relaxed);
+        return;
+    }
+    // Pairs with the fence of the dispatch thread: either it pops the event,
+    // or the flag it set before is seen here. A notify costs a system call,
+    // which is saved while the dispatch thread is busy anyway.
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (is_waiting.load(std::memory_order_relaxed)) {
+        pending_events.fetch_add(1, std::memory_order_release);
+        pending_events.notify_one();
+    }
+}
+
+void MidiIngress::reportDroppedEvents() {
+    // Called periodically by the control thread, so the dispatch thread does not print.
+    long dropped = dropped_events.exchange(0, std::memory_order_relaxed);
+    if (dropped > 0) {
+        std::cerr << "Midi ingress queue overrun, dropped " << dropped << " events" << std::endl;
+    }
+}
+
+HandlerChain& MidiIngress::getDeviceHandlers(uint16_t device) {
+    return devices[device]->handlers;
+}
+
+void MidiIngress::hold(const IngressEvent &event) {
+    // Events with the same time stay in the order they were pushed.
+    auto position = std::upper_bound(held_events.begin(), held_events.end(), event,
+        [](const IngressEvent &a, const IngressEvent &b) { return a.event.time < b.event.time; });
+    held_events.insert(position, event);
+}
+
+void MidiIngress::dispatchInBackground() {
+    realtime_enter_thread("midi dispatch");
+    IngressEvent event;
+    while (is_running) {
+        // Read before the queue is drained, so every event pushed before an
+        // event becomes due is held by then and dispatched before it.
+        uint64_t now = trace_now();
+        while (held_events.size() < INGRESS_REORDER_CAPACITY && queue.pop(event)) {
+            hold(event);
+        }
+        size_t due = 0;
+        while (due < held_events.size() && (held_events[due].event.time + reorder_window <= now ||
+                                            held_events.size() - due == INGRESS_REORDER_CAPACITY)) {
+            dispatch(held_events[due], devices[held_events[due].device]->handlers);
+            due++;
+        }
+        held_events.erase(held_events.begin(), held_events.begin() + due);
+        if (not held_events.empty()) {
+            // The window is shorter than an audio block, the next event is awaited by sleeping.
+            uint64_t wake_up = held_events.front().event.time + reorder_window;
+            timespec time = {static_cast<time_t>(wake_up / 1000000000u), static_cast<long>(wake_up % 1000000000u)};
+            clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &time, nullptr);
+            continue;
+        }
+        uint32_t seen_events = pending_events.load(std::memory_order_acquire);
+        is_waiting.store(true, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (queue.pop(event)) {
+            is_waiting.store(false, std::memory_order_relaxed);
+            hold(event);
+            continue;
+        }
+        // Returns immediately if an event was pushed since the load above.
+        pending_events.wait(seen_events, std::memory_order_acquire);
+        is_waiting.store(false, std::memory_order_relaxed);
+    }
+}
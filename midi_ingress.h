@@ -0,0 +1,122 @@
+/**
+ * Fluidsynth for ImpactLX49+
+ * 
+ * Copyright (C) 2021 Thomas Keck
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <fluidsynth.h>
+
+#include "handler.h"
+#include "midi_event.h"
+#include "mpsc_queue.h"
+
+#define INGRESS_QUEUE_SIZE 4096
+// Time in nanoseconds an event of one device waits for earlier events of the other devices.
+#define INGRESS_REORDER_WINDOW 250000
+// Events held back at most, further events push out the oldest one.
+#define INGRESS_REORDER_CAPACITY 256
+
+/**
+ * Midi event together with the device it was received from.
+ */
+struct IngressEvent {
+    MidiEvent event;
+    uint16_t device;
+};
+
+/**
+ * Configuration of a midi input device.
+ */
+struct MidiDeviceConfig {
+    // Name of the midi port, an empty name uses the fluidsynth default.
+    std::string portname;
+    // Every device can have its own split handler,
+    // so that the splits of two keyboards don't interfere.
+    bool has_split_handler = false;
+};
+
+/**
+ * Receives the events of several midi devices.
+ * 
+ * Every device has its own fluidsynth midi driver and thread.
+ * The devices are only opened by start(), so the handler chains of the
+ * devices can be wired up before the first event arrives.
+ * The driver callbacks only push the decoded event into a lock-free queue,
+ * which is consumed by a single dispatch thread. Hence, adding a device does
+ * not add lock contention, and the handlers always see one event after
+ * another in the order in which they were received.
+ * 
+ * The queue is ordered by the claimed positions, a driver can be preempted
+ * between stamping and pushing an event though. With several devices, every
+ * event is therefore held back for a short reorder window and the held
+ * events are dispatched by their timestamp. A single device is already in
+ * order, so its events are dispatched without delay.
+ */
+class MidiIngress {
+
+    public:
+        MidiIngress(fluid_settings_t *settings, const std::vector<MidiDeviceConfig> &configs,
+                    bool headless, std::function<void(IngressEvent&, HandlerChain&)> dispatch);
+        ~MidiIngress();
+        void start();
+        void receive(uint16_t device, MidiEvent event);
+        size_t getNumberOfDevices() const;
+        void reportDroppedEvents();
+        HandlerChain& getDeviceHandlers(uint16_t device);
+
+    private:
+        void dispatchInBackground();
+        void hold(const IngressEvent &event);
+
+    private:
+        /**
+         * Struct used internally to store the state of each device.
+         */
+        struct Device {
+            MidiIngress *ingress;
+            uint16_t id;
+            fluid_midi_driver_t *driver;
+            HandlerChain handlers;
+        };
+
+        fluid_settings_t *settings;
+        std::vector<MidiDeviceConfig> configs;
+        bool headless;
+        std::vector<std::unique_ptr<Device>> devices;
+        std::function<void(IngressEvent&, HandlerChain&)> dispatch;
+        MpscQueue<IngressEvent> queue;
+        uint64_t reorder_window;
+        // Only used by the dispatch thread, ordered by time.
+        std::vector<IngressEvent> held_events;
+        std::atomic<uint32_t> pending_events;
+        // Set while the dispatch thread sleeps, so the drivers only notify it then.
+        std::atomic<bool> is_waiting;
+        std::atomic<long> dropped_events;
+        std::atomic<bool> is_running;
+        std::thread dispatcher;
+
+        friend int ingress_midi_event(void* data, fluid_midi_event_t* event);
+};
@@ -19,6 +19,7 @@
 
 
 #include <stdexcept>
+#include <vector>
 
 #include "format_workaround.h"
 #include "modulator_handler.h"
@@ -39,7 +40,7 @@ void set_custom_filter(fluid_synth_t *synth, int type) {
     }
 }
 
-ModulatorHandler::ModulatorHandler(fluid_synth_t *synth) : synth(synth) {
+ModulatorHandler::ModulatorHandler(fluid_synth_t *synth) : synth(synth), filter_type(FLUID_IIR_LOWPASS) {
 
     // Defines all the default modulators with suitable flags and amounts.
     std::vector<_ModSetting> default_modulator_settings = {
@@ -77,22 +78,34 @@ ModulatorHandler::ModulatorHandler(fluid_synth_t *synth) : synth(synth) {
     }
 
     // the filter modulator only take effect once we also set up a filter.
-    set_custom_filter(synth, FLUID_IIR_LOWPASS);
+    set_custom_filter(synth, filter_type);
 }
 
-void ModulatorHandler::handleFilterModulatorEvent(fluid_midi_event_t *event) {
-    if (fluid_midi_event_get_value(event) > MIDI_BUTTON_THRESHOLD) {
-        set_custom_filter(synth, FLUID_IIR_HIGHPASS);
+int ModulatorHandler::getFilterType() const {
+    return filter_type;
+}
+
+void ModulatorHandler::setFilterType(int type) {
+    // The synth is updated by the caller, e.g. at the next audio block.
+    filter_type = type;
+}
+
+void ModulatorHandler::handleFilterModulatorEvent(MidiEvent event) {
+    if (event.value() > MIDI_BUTTON_THRESHOLD) {
+        filter_type = FLUID_IIR_HIGHPASS;
     } else {
-        set_custom_filter(synth, FLUID_IIR_LOWPASS);
+        filter_type = FLUID_IIR_LOWPASS;
     }
+    set_custom_filter(synth, filter_type);
 }
 
-void ModulatorHandler::handleEvent(fluid_midi_event_t *event) {
-    if (fluid_midi_event_get_type(event) == midi_event_type::CONTROL_CHANGE) {
-        switch(fluid_midi_event_get_control(event)) {
+MidiEvent ModulatorHandler::handleEvent(MidiEvent event) {
+    if (event.type == midi_event_type::CONTROL_CHANGE) {
+        switch(event.control()) {
             case midi_cc::IIR_FILTER_BUTTON: 
-                return handleFilterModulatorEvent(event);
+                handleFilterModulatorEvent(event);
+                break;
         }
     }
+    return event;
 }
\ No newline at end of file
@@ -40,12 +40,16 @@ class ModulatorHandler : public Handler {
 
     public:
         ModulatorHandler(fluid_synth_t *synth);
-        void handleEvent(fluid_midi_event_t *event) override;
+        MidiEvent handleEvent(MidiEvent event) override;
+        const char* getName() const override { return "ModulatorHandler"; }
+        int getFilterType() const;
+        void setFilterType(int type);
 
     private:
-        void handleFilterModulatorEvent(fluid_midi_event_t *event);
+        void handleFilterModulatorEvent(MidiEvent event);
 
     private:
         fluid_synth_t *synth;
+        int filter_type;
 
 };
@@ -0,0 +1,101 @@
+/**
+ * Fluidsynth for ImpactLX49+
+ * 
+ * Copyright (C) 2021 Thomas Keck
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <memory>
+
+/**
+ * Bounded lock-free queue with many producers and a single consumer.
+ *
+ * Based on the bounded queue by Dmitry Vyukov: every cell carries a sequence
+ * number which tells producers and the consumer whether the cell is free or
+ * filled. Producers only compete for the enqueue position with a single
+ * compare-and-swap, the items leave the queue in the order in which
+ * the producers claimed their positions.
+ */
+template<typename T>
+class MpscQueue {
+
+    public:
+        MpscQueue(size_t capacity) : enqueue_position(0), dequeue_position(0) {
+            size_t size = 1;
+            while (size < capacity) {
+                size *= 2;
+            }
+            cells = std::make_unique<Cell[]>(size);
+            for (size_t i = 0; i < size; ++i) {
+                cells[i].sequence.store(i, std::memory_order_relaxed);
+            }
+            mask = size - 1;
+        }
+
+        /**
+         * Appends an item, returns false if the queue is full.
+         * May be called by any number of producers concurrently.
+         */
+        bool push(const T &item) {
+            size_t position = enqueue_position.load(std::memory_order_relaxed);
+            Cell *cell;
+            while (true) {
+                cell = &cells[position & mask];
+                size_t sequence = cell->sequence.load(std::memory_order_acquire);
+                if (sequence == position) {
+                    if (enqueue_position.compare_exchange_weak(position, position + 1, std::memory_order_relaxed)) {
+                        break;
+                    }
+                } else if (sequence < position) {
+                    return false;
+                } else {
+                    position = enqueue_position.load(std::memory_order_relaxed);
+                }
+            }
+            cell->item = item;
+            cell->sequence.store(position + 1, std::memory_order_release);
+            return true;
+        }
+
+        /**
+         * Removes the oldest item, returns false if the queue is empty.
+         * Must only be called by the consumer.
+         */
+        bool pop(T &item) {
+            Cell *cell = &cells[dequeue_position & mask];
+            if (cell->sequence.load(std::memory_order_acquire) != dequeue_position + 1) {
+                return false;
+            }
+            item = cell->item;
+            cell->sequence.store(dequeue_position + mask + 1, std::memory_order_release);
+            dequeue_position++;
+            return true;
+        }
+
+    private:
+        struct Cell {
+            std::atomic<size_t> sequence;
+            T item;
+        };
+
+        std::unique_ptr<Cell[]> cells;
+        size_t mask;
+        alignas(64) std::atomic<size_t> enqueue_position;
+        alignas(64) size_t dequeue_position;
+};
@@ -0,0 +1,388 @@
+/**
+ * Fluidsynth for ImpactLX49+
+ * 
+ * Copyright (C) 2021 Thomas Keck
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+
+#include <sys/stat.h>
+
+#include "io.h"
+#include "preset_index.h"
+
+#define INDEX_MAGIC "LX49IDX1"
+#define INDEX_MAGIC_SIZE 8
+
+// Sizes of the records in the preset data (pdta) chunk of a soundfont.
+#define SF_PHDR_SIZE 38
+#define SF_BAG_SIZE 4
+#define SF_GEN_SIZE 4
+#define SF_INST_SIZE 22
+#define SF_SHDR_SIZE 46
+#define SF_NAME_SIZE 20
+#define SF_GEN_INSTRUMENT 41
+#define SF_GEN_SAMPLE_ID 53
+#define SF_SAMPLE_COMPRESSED 0x10
+
+static_assert(sizeof(PresetInfo) == 32, "Presets are stored as is in the index cache");
+
+/**
+ * Struct used internally as header of the index cache.
+ *
+ * It is followed by the files, the presets of all files and the paths.
+ */
+struct _IndexHeader {
+    char magic[INDEX_MAGIC_SIZE];
+    uint32_t number_of_files;
+    uint32_t number_of_presets;
+};
+
+/**
+ * Struct used internally to store a soundfont in the index cache.
+ */
+struct _IndexFile {
+    int64_t size;
+    int64_t mtime;
+    uint32_t path_offset;
+    uint32_t path_length;
+    uint32_t first_preset;
+    uint32_t number_of_presets;
+};
+
+static const _IndexHeader* index_header(const char *data) {
+    return reinterpret_cast<const _IndexHeader*>(data);
+}
+
+static const _IndexFile* index_files(const char *data) {
+    return reinterpret_cast<const _IndexFile*>(data + sizeof(_IndexHeader));
+}
+
+static const PresetInfo* index_presets(const char *data) {
+    return reinterpret_cast<const PresetInfo*>(index_files(data) + index_header(data)->number_of_files);
+}
+
+static const char* index_paths(const char *data) {
+    return reinterpret_cast<const char*>(index_presets(data) + index_header(data)->number_of_presets);
+}
+
+static int64_t modification_time(const struct stat &status) {
+    return status.st_mtim.tv_sec * 1000000000L + status.st_mtim.tv_nsec;
+}
+
+template<typename T>
+static T read_little_endian(const std::vector<char> &chunk, size_t offset) {
+    T value;
+    std::memcpy(&value, chunk.data() + offset, sizeof(value));
+    return value;
+}
+
+
+bool readSoundfontPresets(const std::string &path, std::vector<PresetInfo> &presets) {
+    std::ifstream file(path, std::ios::binary);
+    char header[12];
+    if (not file.read(header, sizeof(header)) ||
+        std::memcmp(header, "RIFF", 4) != 0 || std::memcmp(header + 8, "sfbk", 4) != 0) {
+        return false;
+    }
+
+    // Only the chunk headers of the sample data are read, the samples are skipped.
+    std::unordered_map<std::string, std::vector<char>> pdta;
+    bool has_24_bit_samples = false;
+    char chunk[8];
+    while (file.read(chunk, sizeof(chunk))) {
+        uint32_t chunk_size;
+        std::memcpy(&chunk_size, chunk + 4, sizeof(chunk_size));
+        std::streamoff chunk_end = static_cast<std::streamoff>(file.tellg()) + chunk_size + (chunk_size & 1);
+        char list_type[4];
+        if (std::memcmp(chunk, "LIST", 4) == 0 && file.read(list_type, sizeof(list_type))) {
+            bool is_pdta = std::memcmp(list_type, "pdta", 4) == 0;
+            bool is_sdta = std::memcmp(list_type, "sdta", 4) == 0;
+            while ((is_pdta || is_sdta) && file.tellg() < chunk_end && file.read(chunk, sizeof(chunk))) {
+                uint32_t sub_chunk_size;
+                std::memcpy(&sub_chunk_size, chunk + 4, sizeof(sub_chunk_size));
+                std::string id(chunk, 4);
+                if (is_pdta) {
+                    auto &bytes = pdta[id];
+                    bytes.resize(sub_chunk_size);
+                    file.read(bytes.data(), sub_chunk_size);
+                    file.seekg(sub_chunk_size & 1, std::ios::cur);
+                } else {
+                    has_24_bit_samples |= id == "sm24";
+                    file.seekg(sub_chunk_size + (sub_chunk_size & 1), std::ios::cur);
+                }
+            }
+        }
+        file.clear();
+        file.seekg(chunk_end);
+    }
+
+    for (const char *id : {"phdr", "pbag", "pgen", "inst", "ibag", "igen", "shdr"}) {
+        if (pdta.count(id) == 0) {
+            return false;
+        }
+    }
+    const auto &phdr = pdta["phdr"], &pbag = pdta["pbag"], &pgen = pdta["pgen"];
+    const auto &inst = pdta["inst"], &ibag = pdta["ibag"], &igen = pdta["igen"], &shdr = pdta["shdr"];
+    // Every list ends with a terminal record, which marks the end of the zones of the last entry.
+    auto count = [](const std::vector<char> &records, size_t record_size) {
+        return records.size() / record_size;
+    };
+    size_t number_of_samples = count(shdr, SF_SHDR_SIZE);
+
+    std::vector<bool> is_counted(number_of_samples);
+    std::vector<uint16_t> counted_samples;
+    auto count_sample_bytes = [&](uint16_t sample) -> uint32_t {
+        if (sample + 1 >= number_of_samples || is_counted[sample]) {
+            return 0;
+        }
+        is_counted[sample] = true;
+        counted_samples.push_back(sample);
+        size_t record = sample * SF_SHDR_SIZE;
+        uint32_t start = read_little_endian<uint32_t>(shdr, record + 20);
+        uint32_t end = read_little_endian<uint32_t>(shdr, record + 24);
+        uint16_t type = read_little_endian<uint16_t>(shdr, record + 44);
+        if (end <= start) {
+            return 0;
+        }
+        // Compressed samples are given in bytes, others in 16 bit frames.
+        if (type & SF_SAMPLE_COMPRESSED) {
+            return end - start;
+        }
+        return (end - start) * (has_24_bit_samples ? 3 : 2);
+    };
+    // Calls the function for every generator of the zones [first_bag, last_bag).
+    auto for_each_generator = [&](const std::vector<char> &bags, const std::vector<char> &generators,
+                                  size_t first_bag, size_t last_bag, auto function) {
+        if (count(bags, SF_BAG_SIZE) == 0) {
+            return;
+        }
+        last_bag = std::min(last_bag, count(bags, SF_BAG_SIZE) - 1);
+        for (size_t bag = first_bag; bag < last_bag; ++bag) {
+            size_t first_generator = read_little_endian<uint16_t>(bags, bag * SF_BAG_SIZE);
+            size_t last_generator = std::min<size_t>(read_little_endian<uint16_t>(bags, (bag + 1) * SF_BAG_SIZE),
+                                                     count(generators, SF_GEN_SIZE));
+            for (size_t generator = first_generator; generator < last_generator; ++generator) {
+                function(read_little_endian<uint16_t>(generators, generator * SF_GEN_SIZE),
+                         read_little_endian<uint16_t>(generators, generator * SF_GEN_SIZE + 2));
+            }
+        }
+    };
+
+    size_t number_of_instruments = count(inst, SF_INST_SIZE);
+    for (size_t preset = 0; preset + 1 < count(phdr, SF_PHDR_SIZE); ++preset) {
+        size_t record = preset * SF_PHDR_SIZE;
+        PresetInfo info = {};
+        std::memcpy(info.name, phdr.data() + record, SF_NAME_SIZE);
+        info.program = read_little_endian<uint16_t>(phdr, record + 20);
+        info.bank = read_little_endian<uint16_t>(phdr, record + 22);
+        size_t first_bag = read_little_endian<uint16_t>(phdr, record + 24);
+        size_t last_bag = read_little_endian<uint16_t>(phdr, record + SF_PHDR_SIZE + 24);
+
+        for_each_generator(pbag, pgen, first_bag, last_bag, [&](uint16_t preset_operator, uint16_t instrument) {
+            if (preset_operator != SF_GEN_INSTRUMENT || instrument + 1 >= number_of_instruments) {
+                return;
+            }
+            size_t first_instrument_bag = read_little_endian<uint16_t>(inst, instrument * SF_INST_SIZE + SF_NAME_SIZE);
+            size_t last_instrument_bag = read_little_endian<uint16_t>(inst, (instrument + 1) * SF_INST_SIZE + SF_NAME_SIZE);
+            for_each_generator(ibag, igen, first_instrument_bag, last_instrument_bag,
+                [&](uint16_t instrument_operator, uint16_t sample) {
+                    if (instrument_operator == SF_GEN_SAMPLE_ID) {
+                        info.sample_bytes += count_sample_bytes(sample);
+                    }
+                });
+        });
+        // Samples shared by several presets are counted for each of them.
+        for (uint16_t sample : counted_samples) {
+            is_counted[sample] = false;
+        }
+        counted_samples.clear();
+        presets.push_back(info);
+    }
+    return true;
+}
+
+
+PresetIndex::PresetIndex(const std::string &cache_path) :
+    cache_path(cache_path),
+    data(nullptr),
+    size(0) {
+        if (map()) {
+            buildLookup();
+        }
+}
+
+PresetIndex::~PresetIndex() {
+    unmap();
+}
+
+void PresetIndex::refresh(const std::vector<std::string> &paths) {
+    std::unordered_map<std::string, int> cached_files;
+    for (size_t file = 0; file < getNumberOfFiles(); ++file) {
+        cached_files[getFilePath(file)] = file;
+    }
+
+    std::vector<IndexedFile> files;
+    bool is_changed = paths.size() != getNumberOfFiles();
+    int number_of_read_files = 0;
+    for (auto &path : paths) {
+        struct stat status;
+        if (stat(path.c_str(), &status) != 0) {
+            std::cerr << "Failed to index soundfont " << path << std::endl;
+            is_changed = true;
+            continue;
+        }
+        IndexedFile indexed = {path, status.st_size, modification_time(status), {}};
+        auto cached = cached_files.find(path);
+        // A soundfont that moved within the library changes which one wins.
+        if (cached != cached_files.end() && cached->second == static_cast<int>(files.size()) &&
+            index_files(data)[cached->second].size == indexed.size &&
+            index_files(data)[cached->second].mtime == indexed.mtime) {
+            size_t number_of_presets;
+            const PresetInfo *presets = getPresets(cached->second, number_of_presets);
+            indexed.presets.assign(presets, presets + number_of_presets);
+        } else {
+            is_changed = true;
+            number_of_read_files++;
+            if (not readSoundfontPresets(path, indexed.presets)) {
+                std::cerr << path << " is not a soundfont" << std::endl;
+                continue;
+            }
+        }
+        files.push_back(std::move(indexed));
+    }
+
+    if (is_changed) {
+        if (not write(files)) {
+            std::cerr << "Failed to write preset index " << cache_path << std::endl;
+        }
+        buildLookup();
+    }
+    std::cout << "Indexed " << lookup.size() << " distinct presets of " << files.size()
+              << " soundfonts, read " << number_of_read_files << " soundfonts" << std::endl;
+}
+
+int PresetIndex::findPreset(int bank, int program) const {
+    auto preset = lookup.find((bank << 16) | program);
+    return preset == lookup.end() ? -1 : preset->second;
+}
+
+size_t PresetIndex::getNumberOfFiles() const {
+    return data == nullptr ? 0 : index_header(data)->number_of_files;
+}
+
+std::string PresetIndex::getFilePath(int file) const {
+    const _IndexFile &indexed = index_files(data)[file];
+    return std::string(index_paths(data) + indexed.path_offset, indexed.path_length);
+}
+
+const PresetInfo* PresetIndex::getPresets(int file, size_t &number_of_presets) const {
+    const _IndexFile &indexed = index_files(data)[file];
+    number_of_presets = indexed.number_of_presets;
+    return index_presets(data) + indexed.first_preset;
+}
+
+bool PresetIndex::map() {
+    data = map_file(cache_path, size, sizeof(_IndexHeader));
+    if (data == nullptr) {
+        size = 0;
+        return false;
+    }
+
+    // A cache that does not fit together is ignored and rebuilt.
+    const _IndexHeader *header = index_header(data);
+    size_t paths_offset = sizeof(_IndexHeader) + header->number_of_files * sizeof(_IndexFile) +
+                          header->number_of_presets * sizeof(PresetInfo);
+    bool is_valid = std::memcmp(header->magic, INDEX_MAGIC, INDEX_MAGIC_SIZE) == 0 && paths_offset <= size;
+    for (size_t file = 0; is_valid && file < header->number_of_files; ++file) {
+        const _IndexFile &indexed = index_files(data)[file];
+        is_valid = indexed.path_offset + static_cast<size_t>(indexed.path_length) <= size - paths_offset &&
+                   indexed.first_preset + static_cast<size_t>(indexed.number_of_presets) <= header->number_of_presets;
+    }
+    if (not is_valid) {
+        std::cerr << cache_path << " is not a valid preset index, rebuilding it" << std::endl;
+        unmap();
+    }
+    return is_valid;
+}
+
+void PresetIndex::unmap() {
+    if (data != nullptr && fallback.empty()) {
+        unmap_file(data, size);
+    }
+    data = nullptr;
+    size = 0;
+    fallback.clear();
+}
+
+bool PresetIndex::write(const std::vector<IndexedFile> &files) {
+    _IndexHeader header = {};
+    std::memcpy(header.magic, INDEX_MAGIC, INDEX_MAGIC_SIZE);
+    header.number_of_files = files.size();
+    std::vector<_IndexFile> indexed_files;
+    std::vector<PresetInfo> presets;
+    std::string paths;
+    for (auto &file : files) {
+        indexed_files.push_back({file.size, file.mtime, static_cast<uint32_t>(paths.size()),
+                                 static_cast<uint32_t>(file.path.size()),
+                                 static_cast<uint32_t>(presets.size()),
+                                 static_cast<uint32_t>(file.presets.size())});
+        presets.insert(presets.end(), file.presets.begin(), file.presets.end());
+        paths += file.path;
+    }
+    header.number_of_presets = presets.size();
+
+    std::vector<char> image(sizeof(header) + indexed_files.size() * sizeof(_IndexFile) +
+                            presets.size() * sizeof(PresetInfo) + paths.size());
+    char *position = image.data();
+    auto append = [&](const void *bytes, size_t length) {
+        std::memcpy(position, bytes, length);
+        position += length;
+    };
+    append(&header, sizeof(header));
+    append(indexed_files.data(), indexed_files.size() * sizeof(_IndexFile));
+    append(presets.data(), presets.size() * sizeof(PresetInfo));
+    append(paths.data(), paths.size());
+
+    // The new cache replaces the old one at once, so a crash never leaves a partial cache behind.
+    unmap();
+    std::string temporary_path = cache_path + ".tmp";
+    std::ofstream file(temporary_path, std::ios::binary | std::ios::trunc);
+    file.write(image.data(), image.size());
+    file.close();
+    if (not file.fail() && std::rename(temporary_path.c_str(), cache_path.c_str()) == 0 && map()) {
+        return true;
+    }
+    fallback = std::move(image);
+    data = fallback.data();
+    size = fallback.size();
+    return false;
+}
+
+void PresetIndex::buildLookup() {
+    lookup.clear();
+    for (size_t file = 0; file < getNumberOfFiles(); ++file) {
+        size_t number_of_presets;
+        const PresetInfo *presets = getPresets(file, number_of_presets);
+        for (size_t preset = 0; preset < number_of_presets; ++preset) {
+            lookup.emplace((presets[preset].bank << 16) | presets[preset].program, file);
+        }
+    }
+}
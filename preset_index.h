@@ -0,0 +1,98 @@
+/**
+ * Fluidsynth for ImpactLX49+
+ * 
+ * Copyright (C) 2021 Thomas Keck
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#define PRESET_NAME_SIZE 24
+
+/**
+ * Fixed size description of a preset as it is stored in the index cache.
+ *
+ * The sample bytes are the size of the sample data of all samples used
+ * by the preset in the soundfont file, for SF3 files this is the size of
+ * the compressed samples.
+ */
+struct PresetInfo {
+    uint16_t bank;
+    uint16_t program;
+    uint32_t sample_bytes;
+    char name[PRESET_NAME_SIZE];
+};
+
+/**
+ * Index of the presets of a library of soundfonts.
+ *
+ * Listing the presets with fluidsynth requires loading the whole soundfont
+ * including the samples. Instead, the preset headers of every soundfont are
+ * read once and stored in a cache file, keyed by path, size and modification
+ * time of the soundfont. At startup the cache is memory-mapped and only the
+ * soundfonts which changed since are read again.
+ *
+ * If several soundfonts provide the same bank and program,
+ * the first one in the library wins.
+ */
+class PresetIndex {
+
+    public:
+        PresetIndex(const std::string &cache_path);
+        ~PresetIndex();
+        void refresh(const std::vector<std::string> &paths);
+        int findPreset(int bank, int program) const;
+        size_t getNumberOfFiles() const;
+        std::string getFilePath(int file) const;
+        const PresetInfo* getPresets(int file, size_t &number_of_presets) const;
+
+    private:
+        /**
+         * Struct used internally to store a soundfont while the index is refreshed.
+         */
+        struct IndexedFile {
+            std::string path;
+            int64_t size;
+            int64_t mtime;
+            std::vector<PresetInfo> presets;
+        };
+
+        bool map();
+        void unmap();
+        bool write(const std::vector<IndexedFile> &files);
+        void buildLookup();
+
+    private:
+        std::string cache_path;
+        const char *data;
+        size_t size;
+        // Holds the index if the cache file cannot be written.
+        std::vector<char> fallback;
+        // Maps bank and program to the file providing them.
+        std::unordered_map<uint32_t, int> lookup;
+};
+
+/**
+ * Reads the presets from the preset headers of an SF2 or SF3 file
+ * without loading the samples.
+ * Returns false if the file is not a soundfont.
+ */
+bool readSoundfontPresets(const std::string &path, std::vector<PresetInfo> &presets);
@@ -0,0 +1,205 @@
+/**
+ * Fluidsynth for ImpactLX49+
+ * 
+ * Copyright (C) 2021 Thomas Keck
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <iostream>
+
+#include "preset_router.h"
+#include "midi_enums.h"
+#include "realtime.h"
+
+#define DRUM_CHANNEL 9
+#define DRUM_BANK 128
+
+
+void preset_router_callback(unsigned int time, fluid_event_t* event, fluid_sequencer_t* seq, void* data) {
+  realtime_enter_thread("track scheduling");
+  PresetRouter *router = reinterpret_cast<PresetRouter*>(data);
+  router->handleSequencerEvent(event);
+}
+
+
+PresetRouter::PresetRouter(fluid_synth_t *synth, fluid_sequencer_t *sequencer, SoundfontLoader &sfont_loader,
+                           const PresetIndex &index, ControlThread &control) :
+    synth(synth),
+    sequencer(sequencer),
+    sfont_loader(sfont_loader),
+    index(index),
+    control(control),
+    sfont_ids(index.getNumberOfFiles()),
+    load_requests(PRESET_LOAD_QUEUE_SIZE),
+    pending_requests(0),
+    is_running(true) {
+        for (auto &bank : banks) {
+            bank = 0;
+        }
+        banks[DRUM_CHANNEL] = DRUM_BANK;
+        for (auto &request : channel_requests) {
+            request = 0;
+        }
+        for (auto &file : channel_files) {
+            file = -1;
+        }
+        for (auto &sfont_id : sfont_ids) {
+            sfont_id = FLUID_FAILED;
+        }
+        seq_client_id = fluid_sequencer_register_client(sequencer, "preset_router", preset_router_callback, this);
+        loader = std::thread(&PresetRouter::loadInBackground, this);
+}
+
+PresetRouter::~PresetRouter() {
+    fluid_sequencer_unregister_client(sequencer, seq_client_id);
+    is_running = false;
+    wakeLoader();
+    loader.join();
+}
+
+MidiEvent PresetRouter::handleEvent(MidiEvent event) {
+    if (event.channel >= MIDI_CHANNELS) {
+        return event;
+    }
+    switch(event.type) {
+        case midi_event_type::CONTROL_CHANGE:
+            // The bank select is still forwarded, so fluidsynth
+            // knows the bank of presets outside of the library.
+            if (event.control() == MIDI_BANK_SELECT) {
+                banks[event.channel].store(event.value(), std::memory_order_relaxed);
+            }
+            return event;
+        case midi_event_type::PROGRAM_CHANGE:
+            // Otherwise fluidsynth would pick the preset from whichever soundfont it finds first.
+            if (routeProgramChange(event.channel, event.program())) {
+                event.drop();
+            }
+            return event;
+    }
+    return event;
+}
+
+void PresetRouter::handleSequencerEvent(fluid_event_t *event) {
+    int channel = fluid_event_get_channel(event);
+    switch(fluid_event_get_type(event)) {
+        case FLUID_SEQ_CONTROLCHANGE:
+            if (channel < MIDI_CHANNELS && fluid_event_get_control(event) == MIDI_BANK_SELECT) {
+                banks[channel].store(fluid_event_get_value(event), std::memory_order_relaxed);
+            }
+            fluid_synth_cc(synth, channel, fluid_event_get_control(event), fluid_event_get_value(event));
+            break;
+        case FLUID_SEQ_PROGRAMCHANGE:
+            if (channel >= MIDI_CHANNELS || not routeProgramChange(channel, fluid_event_get_program(event))) {
+                fluid_synth_program_change(synth, channel, fluid_event_get_program(event));
+            }
+            break;
+    }
+}
+
+bool PresetRouter::routeProgramChange(int channel, int program) {
+    int bank = banks[channel].load(std::memory_order_relaxed);
+    int file = index.findPreset(bank, program);
+    // Published before the soundfont id is read, see unloadUnroutedSoundfonts.
+    int previous_file = channel_files[channel].exchange(file);
+    if (previous_file >= 0 && previous_file != file) {
+        // The loader may unload the soundfont the channel leaves.
+        wakeLoader();
+    }
+    if (file < 0) {
+        return false;
+    }
+    uint32_t request = channel_requests[channel].fetch_add(1) + 1;
+    int sfont_id = sfont_ids[file].load();
+    if (sfont_id != FLUID_FAILED) {
+        fluid_synth_program_select(synth, channel, sfont_id, bank, program);
+    } else if (load_requests.push({file, channel, bank, program, request})) {
+        wakeLoader();
+    } else {
+        control.reportError("Too many soundfonts are loading, dropped program change of channel", channel);
+    }
+    return true;
+}
+
+void PresetRouter::wakeLoader() {
+    pending_requests.fetch_add(1, std::memory_order_release);
+    pending_requests.notify_one();
+}
+
+void PresetRouter::loadInBackground() {
+    LoadRequest request;
+    while (is_running) {
+        uint32_t seen_requests = pending_requests.load(std::memory_order_acquire);
+        while (load_requests.pop(request)) {
+            int sfont_id = sfont_ids[request.file].load(std::memory_order_relaxed);
+            if (sfont_id == FLUID_FAILED) {
+                std::string path = index.getFilePath(request.file);
+                // Only locks the synth to add the loaded soundfont, so the other channels keep on playing.
+                sfont_id = sfont_loader.load(path);
+                if (sfont_id == FLUID_FAILED) {
+                    std::cerr << "Failed to load soundfont " << path << std::endl;
+                    continue;
+                }
+                sfont_ids[request.file].store(sfont_id, std::memory_order_release);
+            }
+            if (channel_requests[request.channel].load() == request.request) {
+                fluid_synth_program_select(synth, request.channel, sfont_id, request.bank, request.program);
+            }
+        }
+        unloadUnroutedSoundfonts();
+        pending_requests.wait(seen_requests, std::memory_order_acquire);
+    }
+}
+
+void PresetRouter::unloadUnroutedSoundfonts() {
+    for (size_t file = 0; file < sfont_ids.size(); ++file) {
+        if (sfont_ids[file].load() == FLUID_FAILED || isRouted(file)) {
+            continue;
+        }
+        // Withdrawn before the channels are checked again, while a program change publishes
+        // its file before it reads the id. Hence either the program change loads the soundfont
+        // again, or the soundfont is kept.
+        int sfont_id = sfont_ids[file].exchange(FLUID_FAILED);
+        if (isRouted(file) || isSelected(sfont_id)) {
+            sfont_ids[file].store(sfont_id);
+            continue;
+        }
+        // Fluidsynth frees the samples once the last voice using them has been released.
+        if (fluid_synth_sfunload(synth, sfont_id, 0) == FLUID_FAILED) {
+            std::cerr << "Failed to unload soundfont " << index.getFilePath(file) << std::endl;
+        }
+    }
+}
+
+bool PresetRouter::isRouted(int file) const {
+    for (auto &channel_file : channel_files) {
+        if (channel_file.load() == file) {
+            return true;
+        }
+    }
+    return false;
+}
+
+bool PresetRouter::isSelected(int sfont_id) const {
+    // A channel can also use a preset of the soundfont fluidsynth picked itself.
+    int number_of_channels = fluid_synth_count_midi_channels(synth);
+    for (int channel = 0; channel < number_of_channels; ++channel) {
+        int channel_sfont_id, bank, program;
+        if (fluid_synth_get_program(synth, channel, &channel_sfont_id, &bank, &program) == FLUID_OK &&
+            channel_sfont_id == sfont_id) {
+            return true;
+        }
+    }
+    return false;
+}
@@ -0,0 +1,105 @@
+/**
+ * Fluidsynth for ImpactLX49+
+ * 
+ * Copyright (C) 2021 Thomas Keck
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <thread>
+#include <vector>
+
+#include <fluidsynth.h>
+
+#include "control_thread.h"
+#include "handler.h"
+#include "mpsc_queue.h"
+#include "preset_index.h"
+#include "soundfont_loader.h"
+
+#define PRESET_LOAD_QUEUE_SIZE 64
+#define MIDI_CHANNELS 16
+
+/**
+ * Routes program changes to the soundfont of the library providing the preset.
+ *
+ * The preset is looked up in the preset index, and its soundfont is only
+ * loaded once a preset of it is chosen for the first time. Loading takes
+ * seconds, hence it is done on a background thread, which selects the preset
+ * afterwards unless the channel has changed its program again in the meantime.
+ * Program changes of presets that are not in the library are left to fluidsynth.
+ * Once no channel is routed to a soundfont anymore, the loader unloads it again.
+ *
+ * The tracks send the program changes and bank selects they replay to the
+ * sequencer client of the router instead of the synth, so a replayed program
+ * change picks the same preset as the live one it was recorded from.
+ * The live and the replayed events share the bank of each channel, as they
+ * would in the synth.
+ */
+class PresetRouter : public Handler {
+
+    public:
+        PresetRouter(fluid_synth_t *synth, fluid_sequencer_t *sequencer, SoundfontLoader &sfont_loader,
+                     const PresetIndex &index, ControlThread &control);
+        ~PresetRouter();
+        MidiEvent handleEvent(MidiEvent event) override;
+        const char* getName() const override { return "PresetRouter"; }
+        void handleSequencerEvent(fluid_event_t *event);
+        int getSequencerClientId() const { return seq_client_id; }
+
+    private:
+        /**
+         * Struct used internally to hand a program change to the loader.
+         */
+        struct LoadRequest {
+            int file;
+            int channel;
+            int bank;
+            int program;
+            uint32_t request;
+        };
+
+        bool routeProgramChange(int channel, int program);
+        void wakeLoader();
+        void loadInBackground();
+        void unloadUnroutedSoundfonts();
+        bool isRouted(int file) const;
+        bool isSelected(int sfont_id) const;
+
+    private:
+        fluid_synth_t *synth;
+        fluid_sequencer_t *sequencer;
+        int seq_client_id;
+        SoundfontLoader &sfont_loader;
+        const PresetIndex &index;
+        ControlThread &control;
+        // Written by the dispatch thread and the sequencer thread.
+        std::array<std::atomic<int>, MIDI_CHANNELS> banks;
+        // Counts the program changes of each channel, so the loader can
+        // tell whether its program change is still the latest one.
+        std::array<std::atomic<uint32_t>, MIDI_CHANNELS> channel_requests;
+        // File of the library each channel is routed to, -1 if fluidsynth picks the preset.
+        std::array<std::atomic<int>, MIDI_CHANNELS> channel_files;
+        // Soundfont id of every file of the library, FLUID_FAILED if not loaded.
+        std::vector<std::atomic<int>> sfont_ids;
+        MpscQueue<LoadRequest> load_requests;
+        std::atomic<uint32_t> pending_requests;
+        std::atomic<bool> is_running;
+        std::thread loader;
+};
@@ -0,0 +1,175 @@
+/**
+ * Fluidsynth for ImpactLX49+
+ * 
+ * Copyright (C) 2021 Thomas Keck
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <atomic>
+#include <cerrno>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <mutex>
+#include <sstream>
+#include <string>
+
+#include <malloc.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "realtime.h"
+#include "trace.h"
+
+/**
+ * Struct used internally to store the state of a real-time thread.
+ */
+struct _RealtimeThread {
+    const char *name;
+    long thread_id;
+    long minor_faults;
+    long major_faults;
+};
+
+RealtimeConfig realtime_config;
+std::atomic<bool> realtime_enabled(false);
+
+// The registry is only locked when a thread enters real-time mode
+// and when the page faults are read.
+std::mutex realtime_registry_mutex;
+std::vector<_RealtimeThread> realtime_registry;
+thread_local bool realtime_thread_entered = false;
+
+/**
+ * Reads the page faults of a thread of this process from /proc,
+ * so the real-time threads don't have to count them themselves.
+ */
+static bool read_page_faults(long thread_id, long &minor_faults, long &major_faults) {
+    std::ifstream file("/proc/self/task/" + std::to_string(thread_id) + "/stat");
+    std::string stat;
+    if (not std::getline(file, stat)) {
+        return false;
+    }
+    // The thread name may contain spaces, hence the fields are counted after it.
+    std::istringstream fields(stat.substr(stat.rfind(')') + 2));
+    std::string field;
+    for (int index = 0; fields >> field; ++index) {
+        if (index == 7) {
+            minor_faults = std::stol(field);
+        } else if (index == 9) {
+            major_faults = std::stol(field);
+            return true;
+        }
+    }
+    return false;
+}
+
+/**
+ * Touches the given amount of stack, so it is mapped before it is needed.
+ */
+static void prefault_stack() {
+    volatile char stack[REALTIME_STACK_PREFAULT];
+    for (size_t i = 0; i < sizeof(stack); i += sysconf(_SC_PAGESIZE)) {
+        stack[i] = 0;
+    }
+}
+
+void realtime_setup(const RealtimeConfig &config) {
+    realtime_config = config;
+    if (not config.enabled) {
+        return;
+    }
+    if (mlockall(MCL_CURRENT | MCL_FUTURE) != 0) {
+        std::cerr << "Failed to lock memory, raise the memlock limit: " << std::strerror(errno) << std::endl;
+    }
+    // All threads allocate from the main heap, which is never given back
+    // to the kernel, hence prefaulting it once suffices.
+    mallopt(M_ARENA_MAX, 1);
+    mallopt(M_TRIM_THRESHOLD, -1);
+    mallopt(M_MMAP_MAX, 0);
+    char *heap = static_cast<char*>(malloc(REALTIME_HEAP_PREFAULT));
+    for (size_t i = 0; i < REALTIME_HEAP_PREFAULT; i += sysconf(_SC_PAGESIZE)) {
+        heap[i] = 0;
+    }
+    free(heap);
+    realtime_enabled = true;
+}
+
+void realtime_enter_thread(const char *name) {
+    if (realtime_thread_entered) {
+        return;
+    }
+    realtime_thread_entered = true;
+    // Registered even without the hardening mode, so tracing the thread
+    // never allocates its ring buffer in the middle of a callback.
+    trace_register_thread();
+    if (not realtime_enabled.load(std::memory_order_relaxed)) {
+        return;
+    }
+
+    sched_param parameters = {};
+    parameters.sched_priority = realtime_config.priority;
+    int error = pthread_setschedparam(pthread_self(), SCHED_FIFO, &parameters);
+    if (error != 0) {
+        std::cerr << "Failed to switch " << name << " thread to SCHED_FIFO, raise the rtprio limit: "
+                  << std::strerror(error) << std::endl;
+    }
+    if (not realtime_config.cpus.empty()) {
+        cpu_set_t cpus;
+        CPU_ZERO(&cpus);
+        for (int cpu : realtime_config.cpus) {
+            CPU_SET(cpu, &cpus);
+        }
+        if (pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus) != 0) {
+            std::cerr << "Failed to pin " << name << " thread to the configured cpus" << std::endl;
+        }
+    }
+    prefault_stack();
+
+    std::lock_guard<std::mutex> lock(realtime_registry_mutex);
+    realtime_registry.push_back({name, syscall(SYS_gettid), 0, 0});
+}
+
+void realtime_mark_warmed_up() {
+    std::lock_guard<std::mutex> lock(realtime_registry_mutex);
+    for (auto &thread : realtime_registry) {
+        read_page_faults(thread.thread_id, thread.minor_faults, thread.major_faults);
+    }
+}
+
+bool realtime_report_page_faults() {
+    std::lock_guard<std::mutex> lock(realtime_registry_mutex);
+    bool is_fault_free = true;
+    for (auto &thread : realtime_registry) {
+        long minor_faults = 0, major_faults = 0;
+        if (not read_page_faults(thread.thread_id, minor_faults, major_faults)) {
+            // A thread that ended can't be shown to be fault free.
+            std::cout << thread.name << " thread: page faults unreadable" << std::endl;
+            is_fault_free = false;
+            continue;
+        }
+        minor_faults -= thread.minor_faults;
+        major_faults -= thread.major_faults;
+        std::cout << thread.name << " thread: " << minor_faults << " minor, "
+                  << major_faults << " major page faults" << std::endl;
+        if (minor_faults > 0 || major_faults > 0) {
+            is_fault_free = false;
+        }
+    }
+    return is_fault_free;
+}
@@ -0,0 +1,68 @@
+/**
+ * Fluidsynth for ImpactLX49+
+ * 
+ * Copyright (C) 2021 Thomas Keck
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <vector>
+
+#define REALTIME_PRIORITY 70
+#define REALTIME_STACK_PREFAULT (256 * 1024)
+#define REALTIME_HEAP_PREFAULT (64 * 1024 * 1024)
+
+/**
+ * Configuration of the real-time hardening mode.
+ */
+struct RealtimeConfig {
+    bool enabled = false;
+    // SCHED_FIFO priority of the midi dispatch and track scheduling threads.
+    int priority = REALTIME_PRIORITY;
+    // Cpus these threads are pinned to, all cpus if empty.
+    std::vector<int> cpus;
+};
+
+/**
+ * Locks all current and future memory of the process and prefaults
+ * the heap, so neither the handlers nor the tracks page fault
+ * when they allocate.
+ *
+ * Must be called before any thread is started. Does nothing if the
+ * hardening mode is not enabled.
+ */
+void realtime_setup(const RealtimeConfig &config);
+
+/**
+ * Switches the calling thread to SCHED_FIFO, pins it to the configured
+ * cpus and prefaults its stack. Registers the thread for tracing, also
+ * if the hardening mode is not enabled. Only the first call of a thread
+ * does anything, hence it can be called at the beginning of every callback.
+ */
+void realtime_enter_thread(const char *name);
+
+/**
+ * Remembers the page faults of the real-time threads so far,
+ * e.g. once the program is warmed up.
+ */
+void realtime_mark_warmed_up();
+
+/**
+ * Prints the page faults of every real-time thread since the warm-up.
+ * Returns false if any thread page faulted, or if the page faults of a
+ * thread can't be read, hence it must be called while the threads run.
+ */
+bool realtime_report_page_faults();
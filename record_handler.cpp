@@ -17,52 +17,117 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#include <cmath>
+#include <filesystem>
+
 #include "record_handler.h"
 #include "midi_enums.h"
+#include "trace.h"
+
 
+RecordHandler::RecordHandler(fluid_sequencer_t *sequencer, int seq_synth_id, int seq_preset_id,
+                             const std::string &journal_path, ControlThread &control,
+                             AutomationConfig automation_config) :
+    sequencer(sequencer),
+    seq_synth_id(seq_synth_id),
+    seq_preset_id(seq_preset_id),
+    current_track(-1),
+    control(control),
+    spare_track(nullptr),
+    master_rate(1.0),
+    automation_config(automation_config) {
+        // The pages of long takes are kept next to the journal.
+        std::filesystem::path page_directory = journal_path.empty() ?
+            std::filesystem::temp_directory_path() : std::filesystem::absolute(journal_path).parent_path();
+        pager = std::make_unique<TakePager>(page_directory.string());
+        if (not journal_path.empty()) {
+            journal = std::make_unique<RecordJournal>(journal_path);
+            // Rebuilds the tracks of a previous session, e.g. after a crash.
+            for (auto &recovered : journal->getRecoveredTracks()) {
+                addNewTrack();
+                tracks[current_track]->restoreRecording(recovered);
+            }
+        }
+        prepareSpareTrack();
+}
 
+RecordHandler::~RecordHandler() {
+    delete spare_track.load();
+}
 
-void RecordHandler::handleEvent(fluid_midi_event_t *event) {
-    if (fluid_midi_event_get_type(event) == midi_event_type::CONTROL_CHANGE) {
-        switch(fluid_midi_event_get_control(event)) {
+MidiEvent RecordHandler::handleEvent(MidiEvent event) {
+    // Replayed events were not received from a midi driver.
+    if (event.time == 0) {
+        event.time = trace_now();
+    }
+    if (event.type == midi_event_type::CONTROL_CHANGE) {
+        switch(event.control()) {
             case midi_cc::RECORD:
-                recordStart();
-                return;
+                recordStart(event.time);
+                return event;
             case midi_cc::PLAY:
                 playStart();
-                return;
+                return event;
             case midi_cc::STOP:
-                recordStop();
+                recordStop(event.time);
                 playStop();
-                return;
+                return event;
             case midi_cc::FORWARD:
-                loadNextTrack();
-                return;
+                loadNextTrack(event.time);
+                return event;
             case midi_cc::BACKWARD:
-                loadPreviousTrack();
-                return;
+                loadPreviousTrack(event.time);
+                return event;
+            case midi_cc::TEMPO:
+                setMasterRate(event);
+                return event;
+            case midi_cc::TRACK_TEMPO:
+                setTrackRate(event);
+                return event;
         }
     }
     maybeRecordEvent(event);
+    return event;
 }
 
 
 void RecordHandler::addNewTrack() {
     current_track = tracks.size();
-    tracks.push_back(std::make_unique<Track>(sequencer, seq_synth_id));
+    std::unique_ptr<Track> track(spare_track.exchange(nullptr));
+    // Only if the control thread has not caught up yet.
+    if (not track) {
+        track = std::make_unique<Track>(sequencer, seq_synth_id, seq_preset_id, journal.get(), pager.get(), current_track,
+                                        master_rate, automation_config);
+    }
+    track->setTrackIndex(current_track);
+    tracks.push_back(std::move(track));
+    control.defer([](void *handler) { static_cast<RecordHandler*>(handler)->prepareSpareTrack(); }, this);
+}
+
+void RecordHandler::prepareSpareTrack() {
+    if (spare_track.load() != nullptr) {
+        return;
+    }
+    // The index is set once the track is used.
+    Track *track = new Track(sequencer, seq_synth_id, seq_preset_id, journal.get(), pager.get(), -1, master_rate,
+                             automation_config);
+    Track *expected = nullptr;
+    if (not spare_track.compare_exchange_strong(expected, track)) {
+        delete track;
+    }
 }
 
-void RecordHandler::recordStart() {
+void RecordHandler::recordStart(uint64_t time) {
     // Add new track if necessary
     if (current_track == -1) {
         addNewTrack();
     }
-    tracks[current_track]->recordStart();
+    tracks[current_track]->recordStart(time);
 }
 
-void RecordHandler::recordStop() {
+void RecordHandler::recordStop(uint64_t time) {
     if (current_track >= 0) {
-        tracks[current_track]->recordStop();
+        tracks[current_track]->recordStop(time);
     }
 }
 
@@ -78,16 +143,16 @@ void RecordHandler::playStop() {
     }
 }
 
-void RecordHandler::loadPreviousTrack() {
+void RecordHandler::loadPreviousTrack(uint64_t time) {
     if (current_track > 0) {
-        tracks[current_track]->recordStop();
+        tracks[current_track]->recordStop(time);
         current_track--;
     }
 }
     
-void RecordHandler::loadNextTrack() {
+void RecordHandler::loadNextTrack(uint64_t time) {
     if (current_track >= 0) {
-        tracks[current_track]->recordStop();
+        tracks[current_track]->recordStop(time);
     }
     if (current_track + 1 < tracks.size()) {
         current_track++;
@@ -96,7 +161,24 @@ void RecordHandler::loadNextTrack() {
     }
 }
 
-void RecordHandler::maybeRecordEvent(fluid_midi_event_t *event) {
+/**
+ * Converts a controller value to a tempo rate between 0.5 and 2, 64 is the recorded tempo.
+ */
+static double tempo_rate(int value) {
+    return std::exp2((value - 64) / 64.0);
+}
+
+void RecordHandler::setMasterRate(MidiEvent event) {
+    master_rate.store(tempo_rate(event.value()), std::memory_order_relaxed);
+}
+
+void RecordHandler::setTrackRate(MidiEvent event) {
+    if (current_track >= 0) {
+        tracks[current_track]->setRate(tempo_rate(event.value()));
+    }
+}
+
+void RecordHandler::maybeRecordEvent(MidiEvent event) {
     if (current_track >= 0) {
         tracks[current_track]->maybeRecordMidiEvent(event);
     }
@@ -19,35 +19,59 @@
 
 #pragma once
 
+#include <atomic>
 #include <memory>
+#include <string>
 #include <fluidsynth.h>
 
+#include "control_thread.h"
 #include "handler.h"
+#include "record_journal.h"
+#include "take_pager.h"
 #include "track.h"
 
+/**
+ * Handles the record and play buttons and records the events into the current track.
+ *
+ * Creating a track registers a sequencer client and allocates memory, which
+ * is too slow for the dispatch thread. Hence, the control thread always keeps
+ * a spare track ready, which becomes the next new track.
+ */
 class RecordHandler : public Handler {
 
     public:
-        RecordHandler(fluid_sequencer_t *sequencer, int seq_synth_id) : 
-            sequencer(sequencer),
-            seq_synth_id(seq_synth_id),
-            current_track(-1) {}
-        void handleEvent(fluid_midi_event_t *event);
+        RecordHandler(fluid_sequencer_t *sequencer, int seq_synth_id, int seq_preset_id, const std::string &journal_path,
+                      ControlThread &control, AutomationConfig automation_config);
+        ~RecordHandler();
+        MidiEvent handleEvent(MidiEvent event) override;
+        const char* getName() const override { return "RecordHandler"; }
+        void prepareSpareTrack();
 
     private:
         void addNewTrack();
-        void recordStart();
-        void recordStop();
+        void recordStart(uint64_t time);
+        void recordStop(uint64_t time);
         void playStart();
         void playStop();
-        void loadPreviousTrack();
-        void loadNextTrack();
-        void maybeRecordEvent(fluid_midi_event_t *event);
+        void loadPreviousTrack(uint64_t time);
+        void loadNextTrack(uint64_t time);
+        void maybeRecordEvent(MidiEvent event);
+        void setMasterRate(MidiEvent event);
+        void setTrackRate(MidiEvent event);
 
     private:
         fluid_sequencer_t *sequencer;
         int seq_synth_id;
+        int seq_preset_id;
         int current_track;
+        std::unique_ptr<RecordJournal> journal;
+        // Declared before the tracks, so it outlives the pages of their takes.
+        std::unique_ptr<TakePager> pager;
         std::vector<std::unique_ptr<Track>> tracks;
+        ControlThread &control;
+        std::atomic<Track*> spare_track;
+        // Tempo of all tracks relative to their recorded tempo.
+        std::atomic<double> master_rate;
+        AutomationConfig automation_config;
 
 };
\ No newline at end of file
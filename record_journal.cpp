@@ -0,0 +1,180 @@
+/**
+ * Fluidsynth for ImpactLX49+
+ * 
+ * Copyright (C) 2021 Thomas Keck
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstddef>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <stdexcept>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "format_workaround.h"
+
+#include "record_journal.h"
+
+#define JOURNAL_MAGIC "LX49JRN2"
+#define JOURNAL_MAGIC_SIZE 8
+
+static_assert(sizeof(JournalRecord) == 16, "Journal records are stored as is on disk");
+
+/**
+ * FNV-1a hash over everything but the checksum itself.
+ */
+uint32_t journal_checksum(const JournalRecord &record) {
+    const uint8_t *bytes = reinterpret_cast<const uint8_t*>(&record);
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < offsetof(JournalRecord, checksum); ++i) {
+        hash = (hash ^ bytes[i]) * 16777619u;
+    }
+    return hash;
+}
+
+long readJournal(const std::string &path, std::vector<RecoveredTrack> &tracks) {
+    std::ifstream file(path, std::ios::binary);
+    if (not file) {
+        return 0;
+    }
+    char magic[JOURNAL_MAGIC_SIZE];
+    if (not file.read(magic, JOURNAL_MAGIC_SIZE)) {
+        // The process crashed before the header was written.
+        return 0;
+    }
+    if (std::memcmp(magic, JOURNAL_MAGIC, JOURNAL_MAGIC_SIZE) != 0) {
+        return -1;
+    }
+
+    long valid_bytes = JOURNAL_MAGIC_SIZE;
+    JournalRecord record;
+    while (file.read(reinterpret_cast<char*>(&record), sizeof(record))) {
+        if (record.checksum != journal_checksum(record)) {
+            break;
+        }
+        if (record.track >= tracks.size()) {
+            tracks.resize(record.track + 1);
+        }
+        switch (record.kind) {
+            case JournalRecordKind::JOURNAL_RECORD_START:
+                tracks[record.track].takes.emplace_back();
+                break;
+            case JournalRecordKind::JOURNAL_RECORD_STOP:
+                // The loop lasts as long as the longest take.
+                tracks[record.track].duration = std::max(tracks[record.track].duration, static_cast<int>(record.time));
+                break;
+            case JournalRecordKind::JOURNAL_MIDI_EVENT:
+                if (tracks[record.track].takes.empty()) {
+                    tracks[record.track].takes.emplace_back();
+                }
+                tracks[record.track].takes.back().push_back(record);
+                // A track which was recording when the process crashed
+                // lasts at least until its last event.
+                if (static_cast<int>(record.time) > tracks[record.track].duration) {
+                    tracks[record.track].duration = record.time;
+                }
+                break;
+        }
+        valid_bytes += sizeof(record);
+    }
+    return valid_bytes;
+}
+
+
+RecordJournal::RecordJournal(const std::string &path) :
+    ring(JOURNAL_RING_SIZE),
+    is_running(true),
+    dropped_records(0) {
+        long valid_bytes = readJournal(path, recovered_tracks);
+        if (valid_bytes < 0) {
+            throw std::runtime_error(std::format("{} is not a record journal", path));
+        }
+        fd = open(path.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+        if (fd < 0) {
+            throw std::runtime_error(std::format("Failed to open record journal {}", path));
+        }
+        // Cuts off a partially written record, so new records are appended
+        // right after the last valid one.
+        if (ftruncate(fd, valid_bytes) != 0) {
+            throw std::runtime_error(std::format("Failed to truncate record journal {}", path));
+        }
+        if (valid_bytes == 0 && write(fd, JOURNAL_MAGIC, JOURNAL_MAGIC_SIZE) != JOURNAL_MAGIC_SIZE) {
+            throw std::runtime_error(std::format("Failed to write record journal {}", path));
+        }
+        write_buffer.reserve(ring.capacity());
+        writer = std::thread(&RecordJournal::writeInBackground, this);
+}
+
+RecordJournal::~RecordJournal() {
+    is_running = false;
+    writer.join();
+    close(fd);
+}
+
+void RecordJournal::append(JournalRecord record) {
+    record.checksum = journal_checksum(record);
+    if (not ring.push(record)) {
+        dropped_records.fetch_add(1, std::memory_order_relaxed);
+    }
+}
+
+const std::vector<RecoveredTrack>& RecordJournal::getRecoveredTracks() const {
+    return recovered_tracks;
+}
+
+void RecordJournal::writeInBackground() {
+    auto last_sync = std::chrono::steady_clock::now();
+    while (is_running) {
+        flush();
+        auto now = std::chrono::steady_clock::now();
+        if (now - last_sync > std::chrono::milliseconds(JOURNAL_FSYNC_INTERVAL)) {
+            fdatasync(fd);
+            last_sync = now;
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(JOURNAL_WRITE_INTERVAL));
+    }
+    flush();
+    fdatasync(fd);
+}
+
+void RecordJournal::flush() {
+    JournalRecord record;
+    while (write_buffer.size() < ring.capacity() && ring.pop(record)) {
+        write_buffer.push_back(record);
+    }
+    const char *data = reinterpret_cast<const char*>(write_buffer.data());
+    size_t remaining = write_buffer.size() * sizeof(JournalRecord);
+    while (remaining > 0) {
+        ssize_t written = write(fd, data, remaining);
+        if (written < 0) {
+            std::cerr << "Failed to write record journal: " << std::strerror(errno) << std::endl;
+            break;
+        }
+        data += written;
+        remaining -= written;
+    }
+    write_buffer.clear();
+
+    long dropped = dropped_records.exchange(0);
+    if (dropped > 0) {
+        std::cerr << "Record journal overrun, dropped " << dropped << " records" << std::endl;
+    }
+}
@@ -0,0 +1,111 @@
+/**
+ * Fluidsynth for ImpactLX49+
+ * 
+ * Copyright (C) 2021 Thomas Keck
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "ring_buffer.h"
+
+#define JOURNAL_RING_SIZE 65536
+#define JOURNAL_WRITE_INTERVAL 10
+#define JOURNAL_FSYNC_INTERVAL 1000
+// Unit of the times of the recorded events, see JournalRecord.
+#define TRACK_SAMPLE_RATE 48000
+
+/**
+ * Enum defining the kind of a journal record.
+ */
+enum JournalRecordKind {
+    JOURNAL_RECORD_START = 1,
+    JOURNAL_RECORD_STOP = 2,
+    JOURNAL_MIDI_EVENT = 3,
+};
+
+/**
+ * Fixed size binary record as it is stored in the journal file.
+ *
+ * The time is relative to the start of the recording in samples at
+ * TRACK_SAMPLE_RATE, for a stop record it is the duration of the recording.
+ */
+struct JournalRecord {
+    uint32_t time;
+    uint16_t track;
+    uint16_t param1;
+    uint8_t kind;
+    uint8_t type;
+    uint8_t channel;
+    uint8_t param2;
+    uint32_t checksum;
+};
+
+/**
+ * Track rebuilt from the journal.
+ * 
+ * Every recording of the track is a take, the times of the events
+ * are relative to the start of their take.
+ */
+struct RecoveredTrack {
+    int duration = 0;
+    std::vector<std::vector<JournalRecord>> takes;
+};
+
+/**
+ * Streams recorded midi events to an append-only file.
+ *
+ * The midi thread only pushes records into a lock-free ring buffer.
+ * A background thread writes them to the journal in large chunks and
+ * calls fsync periodically, so a crash loses at most the last second.
+ * The memory used is bounded by the size of the ring buffer, no matter how
+ * long the session is.
+ */
+class RecordJournal {
+
+    public:
+        RecordJournal(const std::string &path);
+        ~RecordJournal();
+        void append(JournalRecord record);
+        const std::vector<RecoveredTrack>& getRecoveredTracks() const;
+
+    private:
+        void writeInBackground();
+        void flush();
+
+    private:
+        int fd;
+        RingBuffer<JournalRecord> ring;
+        std::vector<JournalRecord> write_buffer;
+        std::vector<RecoveredTrack> recovered_tracks;
+        std::atomic<bool> is_running;
+        std::atomic<long> dropped_records;
+        std::thread writer;
+};
+
+/**
+ * Reads all valid records from a journal.
+ *
+ * Reading stops at the first incomplete or corrupted record,
+ * which is what is left behind if the process crashed during a write.
+ * Returns the number of bytes which are valid.
+ */
+long readJournal(const std::string &path, std::vector<RecoveredTrack> &tracks);
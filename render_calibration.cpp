@@ -0,0 +1,249 @@
+/**
+ * Fluidsynth for ImpactLX49+
+ * 
+ * Copyright (C) 2021 Thomas Keck
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <thread>
+
+#include <pthread.h>
+#include <sched.h>
+
+#include "render_calibration.h"
+
+#define CALIBRATION_SAMPLE_FRAMES 4096
+#define CALIBRATION_SAMPLE_RATE 44100
+#define CALIBRATION_ROOT_KEY 60
+
+/**
+ * The calibration renders a generated, looping sample instead of a real
+ * soundfont, so it takes milliseconds instead of seconds to set up.
+ * The cost of a voice does not depend on the sample data.
+ */
+static const char* calibration_sfont_name(fluid_sfont_t*) {
+    return "calibration";
+}
+
+static const char* calibration_preset_name(fluid_preset_t*) {
+    return "calibration";
+}
+
+static int calibration_preset_zero(fluid_preset_t*) {
+    return 0;
+}
+
+static fluid_preset_t* calibration_get_preset(fluid_sfont_t *sfont, int, int) {
+    auto **objects = reinterpret_cast<void**>(fluid_sfont_get_data(sfont));
+    return reinterpret_cast<fluid_preset_t*>(objects[0]);
+}
+
+static void calibration_iteration_start(fluid_sfont_t*) {
+}
+
+static fluid_preset_t* calibration_iteration_next(fluid_sfont_t*) {
+    return nullptr;
+}
+
+static int calibration_noteon(fluid_preset_t *preset, fluid_synth_t *synth, int channel, int key, int velocity) {
+    auto **objects = reinterpret_cast<void**>(fluid_sfont_get_data(fluid_preset_get_sfont(preset)));
+    fluid_sample_t *sample = reinterpret_cast<fluid_sample_t*>(objects[1]);
+    fluid_voice_t *voice = fluid_synth_alloc_voice(synth, sample, channel, key, velocity);
+    if (voice == nullptr) {
+        return FLUID_FAILED;
+    }
+    fluid_voice_gen_set(voice, GEN_SAMPLEMODE, FLUID_LOOP_DURING_RELEASE);
+    fluid_synth_start_voice(synth, voice);
+    return FLUID_OK;
+}
+
+static void calibration_preset_free(fluid_preset_t *preset) {
+    delete_fluid_preset(preset);
+}
+
+static int calibration_sfont_free(fluid_sfont_t *sfont) {
+    auto **objects = reinterpret_cast<void**>(fluid_sfont_get_data(sfont));
+    calibration_preset_free(reinterpret_cast<fluid_preset_t*>(objects[0]));
+    delete_fluid_sample(reinterpret_cast<fluid_sample_t*>(objects[1]));
+    delete[] objects;
+    delete_fluid_sfont(sfont);
+    return 0;
+}
+
+static fluid_sfont_t* new_calibration_sfont() {
+    // A sawtooth with some noise, so the interpolation has something to do.
+    std::vector<short> data(CALIBRATION_SAMPLE_FRAMES);
+    unsigned int noise = 1;
+    for (size_t i = 0; i < data.size(); ++i) {
+        noise = noise * 1103515245u + 12345u;
+        data[i] = static_cast<short>((i % 128) * 200 - 12800 + static_cast<int>((noise >> 16) % 2048) - 1024);
+    }
+    fluid_sample_t *sample = new_fluid_sample();
+    fluid_sample_set_sound_data(sample, data.data(), nullptr, data.size(), CALIBRATION_SAMPLE_RATE, 1);
+    fluid_sample_set_loop(sample, 0, data.size() - 1);
+    fluid_sample_set_pitch(sample, CALIBRATION_ROOT_KEY, 0);
+
+    fluid_sfont_t *sfont = new_fluid_sfont(calibration_sfont_name, calibration_get_preset,
+                                           calibration_iteration_start, calibration_iteration_next,
+                                           calibration_sfont_free);
+    fluid_preset_t *preset = new_fluid_preset(sfont, calibration_preset_name, calibration_preset_zero,
+                                              calibration_preset_zero, calibration_noteon, calibration_preset_free);
+    fluid_sfont_set_data(sfont, new void*[2]{preset, sample});
+    return sfont;
+}
+
+std::vector<int> get_isolated_cpus() {
+    // The list has the format 2-5,8,10-11
+    std::vector<int> cpus;
+    std::ifstream file("/sys/devices/system/cpu/isolated");
+    std::string range;
+    while (std::getline(file, range, ',')) {
+        int first, last;
+        char dash;
+        std::istringstream stream(range);
+        if (not (stream >> first)) {
+            continue;
+        }
+        last = (stream >> dash >> last) ? last : first;
+        for (int cpu = first; cpu <= last; ++cpu) {
+            cpus.push_back(cpu);
+        }
+    }
+    return cpus;
+}
+
+fluid_synth_t* new_pinned_fluid_synth(fluid_settings_t *settings) {
+    std::vector<int> isolated_cpus = get_isolated_cpus();
+    cpu_set_t previous_cpus;
+    if (isolated_cpus.empty() ||
+        pthread_getaffinity_np(pthread_self(), sizeof(previous_cpus), &previous_cpus) != 0) {
+        return new_fluid_synth(settings);
+    }
+    cpu_set_t cpus;
+    CPU_ZERO(&cpus);
+    for (int cpu : isolated_cpus) {
+        CPU_SET(cpu, &cpus);
+    }
+    bool is_pinned = pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus) == 0;
+    if (not is_pinned) {
+        std::cerr << "Failed to pin the render threads to the isolated cpus" << std::endl;
+    }
+    fluid_synth_t *synth = new_fluid_synth(settings);
+    if (is_pinned) {
+        pthread_setaffinity_np(pthread_self(), sizeof(previous_cpus), &previous_cpus);
+    }
+    return synth;
+}
+
+double measure_realtime_factor(fluid_settings_t *settings, int cores, int voices, double seconds) {
+    double sample_rate;
+    int period_size;
+    fluid_settings_getnum(settings, "synth.sample-rate", &sample_rate);
+    fluid_settings_getint(settings, "audio.period-size", &period_size);
+
+    fluid_settings_t *calibration_settings = new_fluid_settings();
+    fluid_settings_setnum(calibration_settings, "synth.sample-rate", sample_rate);
+    fluid_settings_setint(calibration_settings, "synth.cpu-cores", cores);
+    fluid_settings_setint(calibration_settings, "synth.polyphony", voices);
+    fluid_synth_t *synth = new_pinned_fluid_synth(calibration_settings);
+    int sfont_id = fluid_synth_add_sfont(synth, new_calibration_sfont());
+
+    // Every voice gets its own key, otherwise fluidsynth releases the previous
+    // voice on the same key.
+    int number_of_channels = fluid_synth_count_midi_channels(synth);
+    for (int channel = 0; channel < number_of_channels; ++channel) {
+        fluid_synth_program_select(synth, channel, sfont_id, 0, 0);
+    }
+    for (int voice = 0; voice < voices; ++voice) {
+        fluid_synth_noteon(synth, voice % number_of_channels, (voice / number_of_channels) % 128, 100);
+    }
+
+    std::vector<float> left(period_size), right(period_size);
+    float *out[2] = {left.data(), right.data()};
+    long samples = static_cast<long>(seconds * sample_rate);
+    auto start = std::chrono::steady_clock::now();
+    for (long rendered = 0; rendered < samples; rendered += period_size) {
+        std::fill(left.begin(), left.end(), 0.0f);
+        std::fill(right.begin(), right.end(), 0.0f);
+        fluid_synth_process(synth, period_size, 0, nullptr, 2, out);
+    }
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+
+    delete_fluid_synth(synth);
+    delete_fluid_settings(calibration_settings);
+    return seconds / elapsed.count();
+}
+
+/**
+ * Returns the number of cores the render threads may run on.
+ * The audio thread renders its share itself, hence it counts as one core.
+ */
+static int get_available_cores() {
+    std::vector<int> isolated_cpus = get_isolated_cpus();
+    if (not isolated_cpus.empty()) {
+        return isolated_cpus.size() + 1;
+    }
+    return std::max(1u, std::thread::hardware_concurrency());
+}
+
+int calibrate_cpu_cores(fluid_settings_t *settings) {
+    int available_cores = get_available_cores();
+    int best_cores = 1;
+    double best_factor = measure_realtime_factor(settings, 1, CALIBRATION_VOICES, CALIBRATION_SECONDS);
+    for (int cores = 2; cores <= available_cores; cores *= 2) {
+        double factor = measure_realtime_factor(settings, cores, CALIBRATION_VOICES, CALIBRATION_SECONDS);
+        if (factor < best_factor * CALIBRATION_MIN_SPEEDUP) {
+            break;
+        }
+        best_cores = cores;
+        best_factor = factor;
+    }
+    std::cout << "Rendering with " << best_cores << " cores, "
+              << std::fixed << std::setprecision(1) << best_factor << std::defaultfloat
+              << "x realtime for " << CALIBRATION_VOICES << " voices" << std::endl;
+    return best_cores;
+}
+
+void print_core_scaling(fluid_settings_t *settings) {
+    int available_cores = get_available_cores();
+    std::vector<int> core_counts;
+    for (int cores = 1; cores < available_cores; cores *= 2) {
+        core_counts.push_back(cores);
+    }
+    core_counts.push_back(available_cores);
+
+    std::cout << "Realtime factor" << std::endl << std::setw(8) << "voices";
+    for (int cores : core_counts) {
+        std::cout << std::setw(8) << cores;
+    }
+    std::cout << "  cores" << std::endl;
+    for (int voices : {64, 256, 1024}) {
+        std::cout << std::setw(8) << voices;
+        for (int cores : core_counts) {
+            // Renders longer than the calibration, so the numbers are stable.
+            double factor = measure_realtime_factor(settings, cores, voices, 4 * CALIBRATION_SECONDS);
+            std::cout << std::setw(8) << std::fixed << std::setprecision(1) << factor;
+        }
+        std::cout << std::endl;
+    }
+}
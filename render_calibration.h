@@ -0,0 +1,64 @@
+/**
+ * Fluidsynth for ImpactLX49+
+ * 
+ * Copyright (C) 2021 Thomas Keck
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <vector>
+
+#include <fluidsynth.h>
+
+#define CALIBRATION_VOICES 256
+#define CALIBRATION_SECONDS 0.25
+// More cores are only used if they render at least this much faster,
+// since every additional render thread has to be synchronized each block.
+#define CALIBRATION_MIN_SPEEDUP 1.1
+
+/**
+ * Returns the cpus listed in /sys/devices/system/cpu/isolated,
+ * which are kept free of other tasks by the kernel (isolcpus=...).
+ */
+std::vector<int> get_isolated_cpus();
+
+/**
+ * Creates a synth whose render threads are pinned to the isolated cpus.
+ *
+ * Fluidsynth starts its render threads in new_fluid_synth and they inherit
+ * the affinity of the calling thread, hence the calling thread is moved to the
+ * isolated cpus for the duration of the call. Without isolated cpus this is
+ * just new_fluid_synth.
+ */
+fluid_synth_t* new_pinned_fluid_synth(fluid_settings_t *settings);
+
+/**
+ * Renders the given number of looping voices with the given number of cores
+ * for the given duration of audio, in blocks of the audio period size.
+ * Returns the realtime factor, i.e. seconds of audio rendered per second.
+ */
+double measure_realtime_factor(fluid_settings_t *settings, int cores, int voices, double seconds);
+
+/**
+ * Chooses synth.cpu-cores with a short calibration render of a dense patch.
+ * Core counts are doubled as long as this renders noticeably faster.
+ */
+int calibrate_cpu_cores(fluid_settings_t *settings);
+
+/**
+ * Prints the realtime factor against the core count for 64, 256 and 1024 voices.
+ */
+void print_core_scaling(fluid_settings_t *settings);
@@ -0,0 +1,119 @@
+/**
+ * Fluidsynth for ImpactLX49+
+ * 
+ * Copyright (C) 2021 Thomas Keck
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <vector>
+
+/**
+ * Lock-free ring buffer with a single producer and a single consumer.
+ *
+ * The memory is allocated once in the constructor, hence pushing and popping
+ * never allocate, never block and never call into the kernel.
+ * This makes it suitable to hand data from a real-time thread
+ * (midi or audio callback) to a background thread.
+ */
+template<typename T>
+class RingBuffer {
+
+    public:
+        RingBuffer(size_t capacity) : head(0), tail(0) {
+            size_t size = 1;
+            while (size < capacity) {
+                size *= 2;
+            }
+            items.resize(size);
+            mask = size - 1;
+        }
+
+        /**
+         * Appends an item, returns false if the ring buffer is full.
+         * Must only be called by the producer.
+         */
+        bool push(const T &item) {
+            size_t current_head = head.load(std::memory_order_relaxed);
+            if (current_head - tail.load(std::memory_order_acquire) > mask) {
+                return false;
+            }
+            items[current_head & mask] = item;
+            head.store(current_head + 1, std::memory_order_release);
+            return true;
+        }
+
+        /**
+         * Appends all of the items or none of them if they do not fit.
+         * Must only be called by the producer.
+         */
+        bool push(const T *new_items, size_t count) {
+            size_t current_head = head.load(std::memory_order_relaxed);
+            if (current_head + count - tail.load(std::memory_order_acquire) > mask + 1) {
+                return false;
+            }
+            for (size_t i = 0; i < count; ++i) {
+                items[(current_head + i) & mask] = new_items[i];
+            }
+            head.store(current_head + count, std::memory_order_release);
+            return true;
+        }
+
+        /**
+         * Removes the oldest item, returns false if the ring buffer is empty.
+         * Must only be called by the consumer.
+         */
+        bool pop(T &item) {
+            size_t current_tail = tail.load(std::memory_order_relaxed);
+            if (current_tail == head.load(std::memory_order_acquire)) {
+                return false;
+            }
+            item = items[current_tail & mask];
+            tail.store(current_tail + 1, std::memory_order_release);
+            return true;
+        }
+
+        /**
+         * Removes up to count of the oldest items, returns the number of removed items.
+         * Must only be called by the consumer.
+         */
+        size_t pop(T *removed_items, size_t count) {
+            size_t current_tail = tail.load(std::memory_order_relaxed);
+            count = std::min(count, head.load(std::memory_order_acquire) - current_tail);
+            for (size_t i = 0; i < count; ++i) {
+                removed_items[i] = items[(current_tail + i) & mask];
+            }
+            tail.store(current_tail + count, std::memory_order_release);
+            return count;
+        }
+
+        size_t size() const {
+            return head.load(std::memory_order_acquire) - tail.load(std::memory_order_acquire);
+        }
+
+        size_t capacity() const {
+            return mask + 1;
+        }
+
+    private:
+        std::vector<T> items;
+        size_t mask;
+        alignas(64) std::atomic<size_t> head;
+        alignas(64) std::atomic<size_t> tail;
+};
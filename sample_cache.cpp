@@ -0,0 +1,406 @@
+/**
+ * Fluidsynth for ImpactLX49+
+ * 
+ * Copyright (C) 2021 Thomas Keck
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+
+#include <sys/stat.h>
+#include <unistd.h>
+#include <vorbis/vorbisfile.h>
+
+#include "format_workaround.h"
+
+#include "io.h"
+#include "sample_cache.h"
+
+#define SF_SHDR_SIZE 46
+#define SF_SAMPLE_COMPRESSED 0x10
+#define SF_SAMPLE_ROM 0x8000
+// Zero samples which must follow every sample of an SF2 soundfont.
+#define SF_SAMPLE_PADDING 46
+#define VORBIS_READ_SIZE 4096
+
+/**
+ * Struct used internally for a memory-mapped file, or any other memory
+ * that is read like a file.
+ */
+struct _MappedFile {
+    const char *data;
+    size_t size;
+    size_t position;
+};
+
+/**
+ * Struct used internally for a chunk of a RIFF file.
+ */
+struct _Chunk {
+    std::string id;
+    const char *data;
+    uint32_t size;
+};
+
+static _MappedFile* open_mapped_file(const std::string &path) {
+    size_t size;
+    const char *data = map_file(path, size);
+    return data == nullptr ? nullptr : new _MappedFile{data, size, 0};
+}
+
+static void close_mapped_file(_MappedFile *file) {
+    unmap_file(file->data, file->size);
+    delete file;
+}
+
+template<typename T>
+static T read_little_endian(const char *data) {
+    T value;
+    std::memcpy(&value, data, sizeof(value));
+    return value;
+}
+
+template<typename T>
+static void write_little_endian(char *data, T value) {
+    std::memcpy(data, &value, sizeof(value));
+}
+
+/**
+ * Splits the data of a RIFF chunk into its sub chunks, a truncated chunk is cut off.
+ */
+static std::vector<_Chunk> read_chunks(const char *data, size_t size) {
+    std::vector<_Chunk> chunks;
+    size_t offset = 0;
+    while (offset + 8 <= size) {
+        uint32_t chunk_size = read_little_endian<uint32_t>(data + offset + 4);
+        if (chunk_size > size - offset - 8) {
+            break;
+        }
+        chunks.push_back({std::string(data + offset, 4), data + offset + 8, chunk_size});
+        offset += 8 + chunk_size + (chunk_size & 1);
+    }
+    return chunks;
+}
+
+/**
+ * Returns the sub chunks of the LIST chunk of the soundfont with the given type, e.g. pdta.
+ */
+static std::vector<_Chunk> read_list(const std::vector<_Chunk> &chunks, const char *type) {
+    for (auto &chunk : chunks) {
+        if (chunk.id == "LIST" && chunk.size >= 4 && std::memcmp(chunk.data, type, 4) == 0) {
+            return read_chunks(chunk.data + 4, chunk.size - 4);
+        }
+    }
+    return {};
+}
+
+static const _Chunk* find_chunk(const std::vector<_Chunk> &chunks, const char *id) {
+    for (auto &chunk : chunks) {
+        if (chunk.id == id) {
+            return &chunk;
+        }
+    }
+    return nullptr;
+}
+
+static std::vector<_Chunk> read_soundfont(const char *data, size_t size) {
+    if (size < 12 || std::memcmp(data, "RIFF", 4) != 0 || std::memcmp(data + 8, "sfbk", 4) != 0) {
+        return {};
+    }
+    return read_chunks(data + 12, size - 12);
+}
+
+/**
+ * SF3 soundfonts are identified by the major version 3 of the ifil chunk.
+ */
+static bool is_compressed_soundfont(const std::vector<_Chunk> &chunks) {
+    const _Chunk *ifil = find_chunk(read_list(chunks, "INFO"), "ifil");
+    return ifil != nullptr && ifil->size >= 4 && read_little_endian<uint16_t>(ifil->data) == 3;
+}
+
+static void append_chunk(std::vector<char> &output, const char *id, const char *data, uint32_t size) {
+    output.insert(output.end(), id, id + 4);
+    output.resize(output.size() + 4);
+    write_little_endian<uint32_t>(output.data() + output.size() - 4, size);
+    output.insert(output.end(), data, data + size);
+    if (size & 1) {
+        output.push_back(0);
+    }
+}
+
+static void append_list(std::vector<char> &output, const char *type, const std::vector<char> &chunks) {
+    std::vector<char> list(type, type + 4);
+    list.insert(list.end(), chunks.begin(), chunks.end());
+    append_chunk(output, "LIST", list.data(), list.size());
+}
+
+static size_t vorbis_read(void *buffer, size_t size, size_t count, void *data) {
+    _MappedFile *source = static_cast<_MappedFile*>(data);
+    size_t bytes = std::min(size * count, source->size - source->position);
+    std::memcpy(buffer, source->data + source->position, bytes);
+    source->position += bytes;
+    return size > 0 ? bytes / size : 0;
+}
+
+static int vorbis_seek(void *data, ogg_int64_t offset, int origin) {
+    _MappedFile *source = static_cast<_MappedFile*>(data);
+    ogg_int64_t base = (origin == SEEK_SET) ? 0 : (origin == SEEK_CUR) ? source->position : source->size;
+    if (base + offset < 0 || base + offset > static_cast<ogg_int64_t>(source->size)) {
+        return -1;
+    }
+    source->position = base + offset;
+    return 0;
+}
+
+static long vorbis_tell(void *data) {
+    return static_cast<_MappedFile*>(data)->position;
+}
+
+/**
+ * Decodes a mono Vorbis stream and appends its 16 bit samples.
+ */
+static bool decode_vorbis(const char *data, size_t size, std::vector<char> &samples) {
+    _MappedFile source = {data, size, 0};
+    ov_callbacks callbacks = {vorbis_read, vorbis_seek, nullptr, vorbis_tell};
+    OggVorbis_File vorbis_file;
+    if (ov_open_callbacks(&source, &vorbis_file, nullptr, 0, callbacks) != 0) {
+        return false;
+    }
+    bool is_decoded = ov_info(&vorbis_file, -1)->channels == 1;
+    char buffer[VORBIS_READ_SIZE];
+    int bitstream;
+    long bytes;
+    while (is_decoded && (bytes = ov_read(&vorbis_file, buffer, sizeof(buffer), 0, 2, 1, &bitstream)) != 0) {
+        if (bytes < 0) {
+            is_decoded = false;
+            break;
+        }
+        samples.insert(samples.end(), buffer, buffer + bytes);
+    }
+    ov_clear(&vorbis_file);
+    return is_decoded;
+}
+
+bool decode_soundfont(const char *data, size_t size, std::vector<char> &decoded) {
+    std::vector<_Chunk> chunks = read_soundfont(data, size);
+    if (not is_compressed_soundfont(chunks)) {
+        return false;
+    }
+    std::vector<_Chunk> info = read_list(chunks, "INFO");
+    std::vector<_Chunk> sdta = read_list(chunks, "sdta");
+    std::vector<_Chunk> pdta = read_list(chunks, "pdta");
+    const _Chunk *smpl = find_chunk(sdta, "smpl");
+    const _Chunk *shdr = find_chunk(pdta, "shdr");
+    if (smpl == nullptr || shdr == nullptr || shdr->size % SF_SHDR_SIZE != 0) {
+        return false;
+    }
+
+    // The compressed samples are addressed in bytes, their loops relative to their start.
+    std::vector<char> samples;
+    std::vector<char> headers(shdr->data, shdr->data + shdr->size);
+    size_t number_of_samples = headers.size() / SF_SHDR_SIZE;
+    // The last header is the terminal record.
+    for (size_t sample = 0; sample + 1 < number_of_samples; ++sample) {
+        char *header = headers.data() + sample * SF_SHDR_SIZE;
+        uint32_t start = read_little_endian<uint32_t>(header + 20);
+        uint32_t end = read_little_endian<uint32_t>(header + 24);
+        uint32_t loop_start = read_little_endian<uint32_t>(header + 28);
+        uint32_t loop_end = read_little_endian<uint32_t>(header + 32);
+        uint16_t type = read_little_endian<uint16_t>(header + 44);
+        uint32_t new_start = samples.size() / 2;
+        if (type & SF_SAMPLE_ROM) {
+            continue;
+        }
+        if (type & SF_SAMPLE_COMPRESSED) {
+            if (start > end || end > smpl->size || not decode_vorbis(smpl->data + start, end - start, samples)) {
+                return false;
+            }
+            type &= ~SF_SAMPLE_COMPRESSED;
+        } else {
+            if (start > end || end > smpl->size / 2) {
+                return false;
+            }
+            samples.insert(samples.end(), smpl->data + 2 * start, smpl->data + 2 * end);
+            loop_start -= start;
+            loop_end -= start;
+        }
+        uint32_t new_end = samples.size() / 2;
+        samples.resize(samples.size() + 2 * SF_SAMPLE_PADDING, 0);
+        write_little_endian<uint32_t>(header + 20, new_start);
+        write_little_endian<uint32_t>(header + 24, new_end);
+        write_little_endian<uint32_t>(header + 28, new_start + loop_start);
+        write_little_endian<uint32_t>(header + 32, new_start + loop_end);
+        write_little_endian<uint16_t>(header + 44, type);
+    }
+
+    std::vector<char> info_chunks, sdta_chunks, pdta_chunks;
+    for (auto &chunk : info) {
+        if (chunk.id == "ifil") {
+            // Version 2.01
+            char version[4] = {2, 0, 1, 0};
+            append_chunk(info_chunks, "ifil", version, sizeof(version));
+        } else {
+            append_chunk(info_chunks, chunk.id.c_str(), chunk.data, chunk.size);
+        }
+    }
+    append_chunk(sdta_chunks, "smpl", samples.data(), samples.size());
+    for (auto &chunk : pdta) {
+        const char *chunk_data = (chunk.id == "shdr") ? headers.data() : chunk.data;
+        append_chunk(pdta_chunks, chunk.id.c_str(), chunk_data, chunk.size);
+    }
+    std::vector<char> lists;
+    append_list(lists, "INFO", info_chunks);
+    append_list(lists, "sdta", sdta_chunks);
+    append_list(lists, "pdta", pdta_chunks);
+    decoded.clear();
+    std::string sfbk = "sfbk";
+    decoded.insert(decoded.end(), sfbk.begin(), sfbk.end());
+    decoded.insert(decoded.end(), lists.begin(), lists.end());
+    std::vector<char> riff;
+    append_chunk(riff, "RIFF", decoded.data(), decoded.size());
+    decoded.swap(riff);
+    return true;
+}
+
+/**
+ * FNV-1a hash of the content of a soundfont, or of its key.
+ */
+static uint64_t content_hash(const char *data, size_t size) {
+    uint64_t hash = 14695981039346656037ull;
+    for (size_t i = 0; i < size; ++i) {
+        hash = (hash ^ static_cast<uint8_t>(data[i])) * 1099511628211ull;
+    }
+    return hash;
+}
+
+static std::string cache_directory() {
+    const char *cache = std::getenv("XDG_CACHE_HOME");
+    const char *home = std::getenv("HOME");
+    std::string directory = (cache != nullptr && *cache != '\0') ? cache : std::string(home != nullptr ? home : "/tmp") + "/.cache";
+    return directory + "/" + SAMPLE_CACHE_DIRECTORY;
+}
+
+/**
+ * Hash of the path, size and modification time of a soundfont, like the preset index
+ * decides whether a soundfont changed. A changed soundfont is hashed again.
+ */
+static uint64_t file_key(const std::string &path, const struct stat &status) {
+    std::string key = std::format("{}\n{}\n{}.{:09}", std::filesystem::absolute(path).string(), status.st_size,
+                                  status.st_mtim.tv_sec, status.st_mtim.tv_nsec);
+    return content_hash(key.data(), key.size());
+}
+
+/**
+ * Links the key of a soundfont to its decoded soundfont in the cache.
+ */
+static void write_key(const std::string &key_path, const std::string &path) {
+    std::string temporary_path = std::format("{}.{}.tmp", key_path, getpid());
+    std::error_code error;
+    // Relative, so the cache directory can be moved.
+    std::filesystem::create_symlink(std::filesystem::path(path).filename(), temporary_path, error);
+    if (error || std::rename(temporary_path.c_str(), key_path.c_str()) != 0) {
+        std::remove(temporary_path.c_str());
+    }
+}
+
+/**
+ * Decodes the soundfont and stores it in the cache, returns false on failure.
+ */
+static bool write_cache(const _MappedFile &file, const std::string &path) {
+    std::vector<char> decoded;
+    if (not decode_soundfont(file.data, file.size, decoded)) {
+        return false;
+    }
+    std::error_code error;
+    std::filesystem::create_directories(std::filesystem::path(path).parent_path(), error);
+    // Another process may decode the same soundfont at the same time.
+    std::string temporary_path = std::format("{}.{}.tmp", path, getpid());
+    std::ofstream output(temporary_path, std::ios::binary | std::ios::trunc);
+    output.write(decoded.data(), decoded.size());
+    output.close();
+    if (output.fail() || std::rename(temporary_path.c_str(), path.c_str()) != 0) {
+        std::remove(temporary_path.c_str());
+        return false;
+    }
+    return true;
+}
+
+static void* sample_cache_open(const char *filename) {
+    // An unchanged soundfont is found through its key, without reading and hashing it.
+    struct stat status;
+    std::string key_path;
+    if (stat(filename, &status) == 0) {
+        key_path = std::format("{}/{:016x}.key", cache_directory(), file_key(filename, status));
+        if (_MappedFile *cached = open_mapped_file(key_path)) {
+            return cached;
+        }
+    }
+    _MappedFile *file = open_mapped_file(filename);
+    if (file == nullptr || not is_compressed_soundfont(read_soundfont(file->data, file->size))) {
+        return file;
+    }
+    std::string path = std::format("{}/{:016x}.sf2", cache_directory(), content_hash(file->data, file->size));
+    _MappedFile *cached = open_mapped_file(path);
+    if (cached == nullptr && write_cache(*file, path)) {
+        std::cout << "Decoded " << filename << " into " << path << std::endl;
+        cached = open_mapped_file(path);
+    }
+    if (cached == nullptr) {
+        // Fluidsynth decodes the samples itself.
+        std::cerr << "Failed to cache decoded soundfont " << filename << std::endl;
+        return file;
+    }
+    if (not key_path.empty()) {
+        write_key(key_path, path);
+    }
+    close_mapped_file(file);
+    return cached;
+}
+
+static int sample_cache_read(void *buffer, fluid_long_long_t count, void *handle) {
+    _MappedFile *file = static_cast<_MappedFile*>(handle);
+    if (count < 0 || static_cast<size_t>(count) > file->size - file->position) {
+        return FLUID_FAILED;
+    }
+    std::memcpy(buffer, file->data + file->position, count);
+    file->position += count;
+    return FLUID_OK;
+}
+
+static int sample_cache_seek(void *handle, fluid_long_long_t offset, int origin) {
+    return vorbis_seek(handle, offset, origin) == 0 ? FLUID_OK : FLUID_FAILED;
+}
+
+static fluid_long_long_t sample_cache_tell(void *handle) {
+    return static_cast<_MappedFile*>(handle)->position;
+}
+
+static int sample_cache_close(void *handle) {
+    close_mapped_file(static_cast<_MappedFile*>(handle));
+    return FLUID_OK;
+}
+
+fluid_sfloader_t* new_sample_cache_sfloader(fluid_settings_t *settings) {
+    fluid_sfloader_t *loader = new_fluid_defsfloader(settings);
+    fluid_sfloader_set_callbacks(loader, sample_cache_open, sample_cache_read, sample_cache_seek,
+                                 sample_cache_tell, sample_cache_close);
+    return loader;
+}
@@ -0,0 +1,51 @@
+/**
+ * Fluidsynth for ImpactLX49+
+ * 
+ * Copyright (C) 2021 Thomas Keck
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <string>
+#include <vector>
+
+#include <fluidsynth.h>
+
+#define SAMPLE_CACHE_DIRECTORY "impact_lx48+"
+
+/**
+ * Creates a soundfont loader, which loads compressed SF3 soundfonts from a
+ * cache of decoded soundfonts.
+ *
+ * Fluidsynth decodes all Vorbis samples of an SF3 soundfont whenever it is
+ * loaded, which dominates the startup time. Instead, the first load decodes
+ * the samples once into an SF2 soundfont with 16 bit samples, which is stored
+ * in the cache directory ($XDG_CACHE_HOME or ~/.cache) under a hash of the
+ * content of the SF3 soundfont. Later loads read the cached soundfont through
+ * a memory mapping, which every process shares in the page cache.
+ * A link named after the path, size and modification time of the SF3 soundfont
+ * points to its decoded soundfont, so an unchanged soundfont is neither read
+ * nor hashed again.
+ *
+ * The loader must be added to the synth before the first soundfont is loaded.
+ */
+fluid_sfloader_t* new_sample_cache_sfloader(fluid_settings_t *settings);
+
+/**
+ * Decodes the samples of an SF3 soundfont into an SF2 soundfont.
+ * Returns false if the soundfont is not an SF3 soundfont or cannot be decoded.
+ */
+bool decode_soundfont(const char *data, size_t size, std::vector<char> &decoded);
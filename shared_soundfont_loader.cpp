@@ -0,0 +1,168 @@
+/**
+ * Fluidsynth for ImpactLX49+
+ * 
+ * Copyright (C) 2021 Thomas Keck
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <iostream>
+#include <vector>
+
+#include "sample_cache.h"
+
+#include "shared_soundfont_loader.h"
+
+// All voices started through a view get the same id, which differs from the
+// ids of fluidsynth, so the next note on the same key releases them as usual.
+#define SHARED_VOICE_ID 0xffffffffu
+
+
+/**
+ * Struct used internally for the view of a shared soundfont in one synth.
+ */
+struct _SoundfontView {
+    SharedSoundfontLoader *loader;
+    std::string path;
+    std::vector<fluid_preset_t*> presets;
+    size_t next_preset;
+};
+
+static const char* view_get_name(fluid_sfont_t *sfont) {
+    return static_cast<_SoundfontView*>(fluid_sfont_get_data(sfont))->path.c_str();
+}
+
+static fluid_preset_t* view_get_preset(fluid_sfont_t *sfont, int bank, int program) {
+    for (auto *preset : static_cast<_SoundfontView*>(fluid_sfont_get_data(sfont))->presets) {
+        if (fluid_preset_get_banknum(preset) == bank && fluid_preset_get_num(preset) == program) {
+            return preset;
+        }
+    }
+    return nullptr;
+}
+
+static void view_iteration_start(fluid_sfont_t *sfont) {
+    static_cast<_SoundfontView*>(fluid_sfont_get_data(sfont))->next_preset = 0;
+}
+
+static fluid_preset_t* view_iteration_next(fluid_sfont_t *sfont) {
+    _SoundfontView *view = static_cast<_SoundfontView*>(fluid_sfont_get_data(sfont));
+    if (view->next_preset >= view->presets.size()) {
+        return nullptr;
+    }
+    return view->presets[view->next_preset++];
+}
+
+static int view_free(fluid_sfont_t *sfont) {
+    _SoundfontView *view = static_cast<_SoundfontView*>(fluid_sfont_get_data(sfont));
+    for (auto *preset : view->presets) {
+        delete_fluid_preset(preset);
+    }
+    view->loader->release(view->path);
+    delete view;
+    delete_fluid_sfont(sfont);
+    return 0;
+}
+
+static fluid_preset_t* shared_preset(fluid_preset_t *preset) {
+    return static_cast<fluid_preset_t*>(fluid_preset_get_data(preset));
+}
+
+static const char* view_preset_get_name(fluid_preset_t *preset) {
+    return fluid_preset_get_name(shared_preset(preset));
+}
+
+static int view_preset_get_banknum(fluid_preset_t *preset) {
+    return fluid_preset_get_banknum(shared_preset(preset));
+}
+
+static int view_preset_get_num(fluid_preset_t *preset) {
+    return fluid_preset_get_num(shared_preset(preset));
+}
+
+static int view_preset_noteon(fluid_preset_t *preset, fluid_synth_t *synth, int channel, int key, int velocity) {
+    // Allocates the voices of the shared preset in the synth of the view.
+    return fluid_synth_start(synth, SHARED_VOICE_ID, shared_preset(preset), 0, channel, key, velocity);
+}
+
+static void view_preset_free(fluid_preset_t *preset) {
+    delete_fluid_preset(preset);
+}
+
+static fluid_sfont_t* load_view(fluid_sfloader_t *sfloader, const char *filename) {
+    SharedSoundfontLoader *loader = static_cast<SharedSoundfontLoader*>(fluid_sfloader_get_data(sfloader));
+    fluid_sfont_t *shared = loader->acquire(filename);
+    if (shared == nullptr) {
+        return nullptr;
+    }
+    _SoundfontView *view = new _SoundfontView{loader, filename, {}, 0};
+    fluid_sfont_t *sfont = new_fluid_sfont(view_get_name, view_get_preset, view_iteration_start,
+                                           view_iteration_next, view_free);
+    fluid_sfont_set_data(sfont, view);
+    fluid_sfont_iteration_start(shared);
+    while (fluid_preset_t *preset = fluid_sfont_iteration_next(shared)) {
+        fluid_preset_t *view_preset = new_fluid_preset(sfont, view_preset_get_name, view_preset_get_banknum,
+                                                       view_preset_get_num, view_preset_noteon, view_preset_free);
+        fluid_preset_set_data(view_preset, preset);
+        view->presets.push_back(view_preset);
+    }
+    return sfont;
+}
+
+
+SharedSoundfontLoader::SharedSoundfontLoader() {
+    settings = new_fluid_settings();
+    // The owner only holds the soundfonts, it never plays a note.
+    fluid_settings_setint(settings, "synth.polyphony", 1);
+    owner = new_fluid_synth(settings);
+    fluid_synth_add_sfloader(owner, new_sample_cache_sfloader(settings));
+}
+
+SharedSoundfontLoader::~SharedSoundfontLoader() {
+    delete_fluid_synth(owner);
+    delete_fluid_settings(settings);
+}
+
+fluid_sfloader_t* SharedSoundfontLoader::newSfloader() {
+    fluid_sfloader_t *sfloader = new_fluid_sfloader(load_view, delete_fluid_sfloader);
+    fluid_sfloader_set_data(sfloader, this);
+    return sfloader;
+}
+
+fluid_sfont_t* SharedSoundfontLoader::acquire(const std::string &path) {
+    std::lock_guard<std::mutex> lock(mutex);
+    auto soundfont = soundfonts.find(path);
+    if (soundfont == soundfonts.end()) {
+        int sfont_id = fluid_synth_sfload(owner, path.c_str(), 0);
+        if (sfont_id == FLUID_FAILED) {
+            return nullptr;
+        }
+        soundfont = soundfonts.emplace(path, SharedSoundfont{sfont_id, 0}).first;
+    }
+    soundfont->second.references++;
+    return fluid_synth_get_sfont_by_id(owner, soundfont->second.sfont_id);
+}
+
+void SharedSoundfontLoader::release(const std::string &path) {
+    std::lock_guard<std::mutex> lock(mutex);
+    auto soundfont = soundfonts.find(path);
+    if (soundfont == soundfonts.end() || --soundfont->second.references > 0) {
+        return;
+    }
+    // Fluidsynth defers freeing the samples while other synths still play them.
+    if (fluid_synth_sfunload(owner, soundfont->second.sfont_id, 0) == FLUID_FAILED) {
+        std::cerr << "Failed to unload shared soundfont " << path << std::endl;
+    }
+    soundfonts.erase(soundfont);
+}
@@ -0,0 +1,75 @@
+/**
+ * Fluidsynth for ImpactLX49+
+ * 
+ * Copyright (C) 2021 Thomas Keck
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <map>
+#include <mutex>
+#include <string>
+
+#include <fluidsynth.h>
+
+/**
+ * Loads every soundfont once and shares its samples between several synths.
+ *
+ * The soundfonts are loaded into a synth of the loader, which never renders.
+ * The loader of each synth (see newSfloader) returns a view of the shared
+ * soundfont with presets of its own, which start the voices of the shared
+ * presets in the synth they are played on. Hence each synth assigns its own
+ * soundfont ids, and only the small views take memory per synth.
+ * A shared soundfont is unloaded once the last synth has unloaded its view,
+ * fluidsynth frees its samples when the last voice using them is released.
+ *
+ * The voices of one shared preset may be started by several synths at once,
+ * which requires synth.dynamic-sample-loading to be disabled (the default).
+ */
+class SharedSoundfontLoader {
+
+    public:
+        SharedSoundfontLoader();
+        ~SharedSoundfontLoader();
+
+        /**
+         * Creates a soundfont loader for a synth, which must be added with
+         * fluid_synth_add_sfloader before the synth loads its first soundfont.
+         * The synth deletes it, but it must not outlive this object.
+         */
+        fluid_sfloader_t* newSfloader();
+
+        /**
+         * Returns the shared soundfont, which is loaded by the first call for the path,
+         * or nullptr if it cannot be loaded. Every call must be matched by a release.
+         */
+        fluid_sfont_t* acquire(const std::string &path);
+        void release(const std::string &path);
+
+    private:
+        /**
+         * Struct used internally for a loaded soundfont and the number of views on it.
+         */
+        struct SharedSoundfont {
+            int sfont_id;
+            int references;
+        };
+
+        fluid_settings_t *settings;
+        fluid_synth_t *owner;
+        std::mutex mutex;
+        std::map<std::string, SharedSoundfont> soundfonts;
+};
@@ -1,4 +1,4 @@
 { pkgs ? import <nixpkgs> {} }:
   pkgs.mkShell {
-    nativeBuildInputs = with pkgs; [ buildPackages.gcc buildPackages.fluidsynth buildPackages.fmt gnumake vscode ];
+    nativeBuildInputs = with pkgs; [ buildPackages.gcc buildPackages.fluidsynth buildPackages.fmt buildPackages.libvorbis gnumake vscode ];
 }
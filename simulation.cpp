@@ -0,0 +1,104 @@
+/**
+ * Fluidsynth for ImpactLX49+
+ * 
+ * Copyright (C) 2021 Thomas Keck
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "simulation.h"
+#include "midi_enums.h"
+
+
+void simulation_capture(unsigned int time, fluid_event_t *event, fluid_sequencer_t *seq, void *data) {
+  Simulation *simulation = reinterpret_cast<Simulation*>(data);
+  simulation->capture(time, event);
+}
+
+
+Simulation::Simulation(const std::string &journal_path) : control(false) {
+    sequencer = new_fluid_sequencer2(0);
+    capture_id = fluid_sequencer_register_client(sequencer, "simulation_capture", simulation_capture, this);
+    record_handler = std::make_unique<RecordHandler>(sequencer, capture_id, capture_id, journal_path, control,
+                                                     AutomationConfig());
+}
+
+Simulation::~Simulation() {
+    // The tracks unregister their clients from the sequencer.
+    record_handler.reset();
+    fluid_sequencer_unregister_client(sequencer, capture_id);
+    delete_fluid_sequencer(sequencer);
+}
+
+void Simulation::send(MidiEvent event) {
+    // The time 0 means unknown, hence the virtual clock starts at 1 ns.
+    event.time = static_cast<uint64_t>(getTick()) * 1000000 + 1;
+    record_handler->handleEvent(event);
+}
+
+void Simulation::advance(unsigned int milliseconds) {
+    unsigned int end = getTick() + milliseconds;
+    for (unsigned int tick = getTick() + 1; tick <= end; ++tick) {
+        fluid_sequencer_process(sequencer, tick);
+    }
+}
+
+unsigned int Simulation::getTick() const {
+    return fluid_sequencer_get_tick(sequencer);
+}
+
+const std::vector<CapturedEvent>& Simulation::getCapturedEvents() const {
+    return captured_events;
+}
+
+void Simulation::capture(unsigned int tick, fluid_event_t *event) {
+    MidiEvent midi_event = {};
+    midi_event.channel = fluid_event_get_channel(event);
+    switch(fluid_event_get_type(event)) {
+        case FLUID_SEQ_NOTEON:
+            midi_event.type = midi_event_type::NOTE_ON;
+            midi_event.param1 = fluid_event_get_key(event);
+            midi_event.param2 = fluid_event_get_velocity(event);
+            break;
+        case FLUID_SEQ_NOTEOFF:
+            midi_event.type = midi_event_type::NOTE_OFF;
+            midi_event.param1 = fluid_event_get_key(event);
+            break;
+        case FLUID_SEQ_KEYPRESSURE:
+            midi_event.type = midi_event_type::KEY_PRESSURE;
+            midi_event.param1 = fluid_event_get_key(event);
+            midi_event.param2 = fluid_event_get_value(event);
+            break;
+        case FLUID_SEQ_CONTROLCHANGE:
+            midi_event.type = midi_event_type::CONTROL_CHANGE;
+            midi_event.param1 = fluid_event_get_control(event);
+            midi_event.param2 = fluid_event_get_value(event);
+            break;
+        case FLUID_SEQ_PROGRAMCHANGE:
+            midi_event.type = midi_event_type::PROGRAM_CHANGE;
+            midi_event.param1 = fluid_event_get_program(event);
+            break;
+        case FLUID_SEQ_CHANNELPRESSURE:
+            midi_event.type = midi_event_type::CHANNEL_PRESSURE;
+            midi_event.param1 = fluid_event_get_value(event);
+            break;
+        case FLUID_SEQ_PITCHBEND:
+            midi_event.type = midi_event_type::PITCH_BEND;
+            midi_event.param1 = fluid_event_get_pitch(event);
+            break;
+        default:
+            return;
+    }
+    captured_events.push_back({tick, midi_event});
+}
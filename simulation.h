@@ -0,0 +1,73 @@
+/**
+ * Fluidsynth for ImpactLX49+
+ * 
+ * Copyright (C) 2021 Thomas Keck
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <fluidsynth.h>
+
+#include "control_thread.h"
+#include "midi_event.h"
+#include "record_handler.h"
+
+/**
+ * Event played by a track, together with the tick at which it was delivered.
+ */
+struct CapturedEvent {
+    unsigned int tick;
+    MidiEvent event;
+};
+
+/**
+ * Runs the record handler and its tracks on a virtual clock.
+ *
+ * The sequencer is not driven by the system timer or the audio, but is
+ * advanced explicitly, one millisecond tick after another, hence hours of
+ * playback take seconds. Instead of the synth, the tracks play to a client
+ * which captures every event with the tick at which it was delivered.
+ * Sent events are stamped with the virtual time as well.
+ * Given a journal path, the recorded tracks are written to a record journal.
+ */
+class Simulation {
+
+    public:
+        Simulation(const std::string &journal_path = "");
+        ~Simulation();
+        void send(MidiEvent event);
+        void advance(unsigned int milliseconds);
+        unsigned int getTick() const;
+        const std::vector<CapturedEvent>& getCapturedEvents() const;
+
+    private:
+        void capture(unsigned int tick, fluid_event_t *event);
+
+    private:
+        fluid_sequencer_t *sequencer;
+        int capture_id;
+        // Never started, so the simulation stays on a single thread
+        // and new tracks are created by the record handler itself.
+        ControlThread control;
+        std::unique_ptr<RecordHandler> record_handler;
+        std::vector<CapturedEvent> captured_events;
+
+        friend void simulation_capture(unsigned int time, fluid_event_t *event, fluid_sequencer_t *seq, void *data);
+};
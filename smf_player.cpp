@@ -0,0 +1,290 @@
+/**
+ * Fluidsynth for ImpactLX49+
+ * 
+ * Copyright (C) 2021 Thomas Keck
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdexcept>
+
+#include <sys/mman.h>
+
+#include "format_workaround.h"
+
+#include "io.h"
+#include "smf_player.h"
+#include "realtime.h"
+
+#define SMF_CHUNK_HEADER_SIZE 8
+#define SMF_HEADER_SIZE 6
+#define SMF_META_EVENT 0xff
+#define SMF_META_END_OF_TRACK 0x2f
+#define SMF_META_TEMPO 0x51
+#define SMF_SYSEX_EVENT 0xf0
+#define SMF_SYSEX_ESCAPE 0xf7
+
+
+/**
+ * Reads a big-endian integer of the given number of bytes.
+ */
+static uint32_t read_big_endian(const uint8_t *bytes, int number_of_bytes) {
+  uint32_t value = 0;
+  for (int i = 0; i < number_of_bytes; ++i) {
+    value = (value << 8) | bytes[i];
+  }
+  return value;
+}
+
+/**
+ * Reads a variable-length quantity, returns false if the data ends before it does.
+ */
+static bool read_variable_length(const uint8_t *&position, const uint8_t *end, uint32_t &value) {
+  value = 0;
+  for (int i = 0; i < 4 && position < end; ++i) {
+    uint8_t byte = *position++;
+    value = (value << 7) | (byte & 0x7f);
+    if (not (byte & 0x80)) {
+      return true;
+    }
+  }
+  return false;
+}
+
+
+void smf_player_callback(unsigned int time, fluid_event_t* event, fluid_sequencer_t* seq, void* data) {
+  realtime_enter_thread("track scheduling");
+  SmfPlayer *player = reinterpret_cast<SmfPlayer*>(data);
+  player->playNextChunk();
+}
+
+
+SmfPlayer::SmfPlayer(fluid_sequencer_t *sequencer, int seq_synth_id, const std::string &path) :
+    sequencer(sequencer),
+    seq_synth_id(seq_synth_id),
+    data(nullptr),
+    size(0),
+    is_playing(false),
+    used_channels(0) {
+        const char *mapped = map_file(path, size);
+        if (mapped == nullptr) {
+            throw std::runtime_error(std::format("Failed to map midi file {}", path));
+        }
+        data = reinterpret_cast<const uint8_t*>(mapped);
+        madvise(const_cast<char*>(mapped), size, MADV_SEQUENTIAL);
+
+        // Only the chunk headers are read here, the events are parsed while playing.
+        if (size < SMF_CHUNK_HEADER_SIZE + SMF_HEADER_SIZE || std::string(reinterpret_cast<const char*>(data), 4) != "MThd") {
+            unmap_file(mapped, size);
+            throw std::runtime_error(std::format("{} is not a standard midi file", path));
+        }
+        uint32_t header_size = read_big_endian(data + 4, 4);
+        uint16_t format = read_big_endian(data + SMF_CHUNK_HEADER_SIZE, 2);
+        division = read_big_endian(data + SMF_CHUNK_HEADER_SIZE + 4, 2);
+        // Format 2 files contain independent sequences, which are not played at once.
+        if (format > 1 || (division & 0x8000) || division == 0) {
+            unmap_file(mapped, size);
+            throw std::runtime_error(std::format(
+                "Midi file {} with format {} and division {} is not supported", path, format, division));
+        }
+        size_t offset = SMF_CHUNK_HEADER_SIZE + header_size;
+        while (offset + SMF_CHUNK_HEADER_SIZE <= size) {
+            uint32_t chunk_size = read_big_endian(data + offset + 4, 4);
+            const uint8_t *chunk = data + offset + SMF_CHUNK_HEADER_SIZE;
+            // A truncated file is played up to where it ends.
+            size_t available = size - offset - SMF_CHUNK_HEADER_SIZE;
+            if (std::string(reinterpret_cast<const char*>(data + offset), 4) == "MTrk") {
+                TrackCursor cursor = {};
+                cursor.start = chunk;
+                cursor.end = chunk + std::min<size_t>(chunk_size, available);
+                tracks.push_back(cursor);
+            }
+            if (chunk_size > available) {
+                break;
+            }
+            offset += SMF_CHUNK_HEADER_SIZE + chunk_size;
+        }
+
+        seq_client_id = fluid_sequencer_register_client(sequencer, "smf_player_callback", smf_player_callback, this);
+        play_event = new_fluid_event();
+        fluid_event_set_source(play_event, seq_client_id);
+        fluid_event_set_dest(play_event, seq_synth_id);
+        callback_event = new_fluid_event();
+        fluid_event_set_source(callback_event, -1);
+        fluid_event_set_dest(callback_event, seq_client_id);
+        fluid_event_timer(callback_event, NULL);
+}
+
+SmfPlayer::~SmfPlayer() {
+    playStop();
+    fluid_sequencer_unregister_client(sequencer, seq_client_id);
+    delete_fluid_event(play_event);
+    delete_fluid_event(callback_event);
+    unmap_file(reinterpret_cast<const char*>(data), size);
+}
+
+void SmfPlayer::playStart() {
+    if (not isPlaying()) {
+    is_playing = true;
+    rewind();
+    play_start_tick = fluid_sequencer_get_tick(sequencer);
+    fluid_sequencer_remove_events(sequencer, -1, seq_client_id, FLUID_SEQ_TIMER);
+    fluid_sequencer_send_at(sequencer, callback_event, 0, false);
+    }
+}
+
+void SmfPlayer::playStop() {
+    if (isPlaying()) {
+    is_playing = false;
+    // Drops the events of the lookahead window, and the notes they would have ended.
+    fluid_sequencer_remove_events(sequencer, seq_client_id, -1, -1);
+    fluid_sequencer_remove_events(sequencer, -1, seq_client_id, FLUID_SEQ_TIMER);
+    for (int channel = 0; channel < 16; ++channel) {
+        if (used_channels & (1 << channel)) {
+            fluid_event_all_notes_off(play_event, channel);
+            fluid_sequencer_send_now(sequencer, play_event);
+        }
+    }
+    }
+}
+
+bool SmfPlayer::isPlaying() const {
+    return is_playing;
+}
+
+void SmfPlayer::rewind() {
+    tempo = SMF_DEFAULT_TEMPO;
+    tempo_tick = 0;
+    tempo_time = 0;
+    used_channels = 0;
+    for (auto &cursor : tracks) {
+        cursor.position = cursor.start;
+        cursor.tick = 0;
+        cursor.running_status = 0;
+        readNextEvent(cursor);
+    }
+}
+
+void SmfPlayer::readNextEvent(TrackCursor &cursor) {
+    cursor.has_event = false;
+    cursor.tempo = 0;
+    const uint8_t *&position = cursor.position;
+    const uint8_t *end = cursor.end;
+    while (position < end) {
+        uint32_t delta;
+        if (not read_variable_length(position, end, delta) || position >= end) {
+            return;
+        }
+        cursor.tick += delta;
+        uint8_t status = *position;
+        if (status & 0x80) {
+            position++;
+        } else if (cursor.running_status != 0) {
+            status = cursor.running_status;
+        } else {
+            return;
+        }
+
+        if (status == SMF_META_EVENT || status == SMF_SYSEX_EVENT || status == SMF_SYSEX_ESCAPE) {
+            cursor.running_status = 0;
+            uint8_t meta_type = 0;
+            if (status == SMF_META_EVENT) {
+                if (position >= end) {
+                    return;
+                }
+                meta_type = *position++;
+            }
+            uint32_t length;
+            if (not read_variable_length(position, end, length) || length > static_cast<size_t>(end - position)) {
+                return;
+            }
+            const uint8_t *payload = position;
+            position += length;
+            if (meta_type == SMF_META_END_OF_TRACK) {
+                return;
+            }
+            if (meta_type == SMF_META_TEMPO && length == 3) {
+                cursor.tempo = read_big_endian(payload, 3);
+                cursor.has_event = cursor.tempo > 0;
+                if (cursor.has_event) {
+                    return;
+                }
+            }
+            continue;
+        }
+
+        cursor.running_status = status;
+        int type = status & 0xf0;
+        int number_of_data_bytes = (type == midi_event_type::PROGRAM_CHANGE || type == midi_event_type::CHANNEL_PRESSURE) ? 1 : 2;
+        if (end - position < number_of_data_bytes) {
+            return;
+        }
+        cursor.event = {static_cast<uint8_t>(type), static_cast<uint8_t>(status & 0x0f), position[0], 0};
+        if (number_of_data_bytes == 2) {
+            cursor.event.param2 = position[1];
+        }
+        if (type == midi_event_type::PITCH_BEND) {
+            cursor.event.param1 = position[0] | (position[1] << 7);
+        }
+        position += number_of_data_bytes;
+        cursor.has_event = true;
+        return;
+    }
+}
+
+uint64_t SmfPlayer::getEventTime(uint64_t tick) const {
+    return tempo_time + (tick - tempo_tick) * tempo / division;
+}
+
+void SmfPlayer::scheduleNextCallback() {
+    fluid_sequencer_send_at(sequencer, callback_event, SMF_CALLBACK_TIME, false);
+}
+
+void SmfPlayer::playNextChunk() {
+    if (not isPlaying()) {
+        return;
+    }
+    unsigned int schedule_until = fluid_sequencer_get_tick(sequencer) + SMF_LOOKAHEAD_TIME;
+    while (true) {
+        // The tracks are merged by always taking the earliest next event,
+        // events at the same tick are taken in the order of the tracks.
+        TrackCursor *next = nullptr;
+        for (auto &cursor : tracks) {
+            if (cursor.has_event && (next == nullptr || cursor.tick < next->tick)) {
+                next = &cursor;
+            }
+        }
+        if (next == nullptr) {
+            // The notes of the last events still have to be played, hence no playStop here.
+            is_playing = false;
+            return;
+        }
+        uint64_t time = getEventTime(next->tick);
+        unsigned int play_tick = play_start_tick + (time + 500) / 1000;
+        if (play_tick >= schedule_until) {
+            break;
+        }
+        if (next->tempo != 0) {
+            tempo_time = time;
+            tempo_tick = next->tick;
+            tempo = next->tempo;
+        } else {
+            encode_sequencer_event(next->event, play_event);
+            fluid_sequencer_send_at(sequencer, play_event, play_tick, 1);
+            used_channels |= 1 << next->event.channel;
+        }
+        readNextEvent(*next);
+    }
+    scheduleNextCallback();
+}
@@ -0,0 +1,100 @@
+/**
+ * Fluidsynth for ImpactLX49+
+ * 
+ * Copyright (C) 2021 Thomas Keck
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include <fluidsynth.h>
+
+#include "midi_event.h"
+
+// In milliseconds, the events are scheduled this far ahead of the sequencer.
+#define SMF_CALLBACK_TIME 50
+#define SMF_LOOKAHEAD_TIME 200
+// In microseconds per quarter note, used until the first tempo event.
+#define SMF_DEFAULT_TEMPO 500000
+
+/**
+ * Plays a Standard MIDI File through the sequencer, e.g. as a backing track.
+ *
+ * The file is memory-mapped and parsed while it is played. Every track of the
+ * file has a cursor pointing to its next event, and the events of all tracks
+ * are merged in the order of their time. A sequencer callback schedules the
+ * events of the next SMF_LOOKAHEAD_TIME milliseconds, so only those are held
+ * in memory. Hence, playback starts at once and a file of several hours
+ * does not use more memory than a short one.
+ */
+class SmfPlayer {
+
+    public:
+        SmfPlayer(fluid_sequencer_t *sequencer, int seq_synth_id, const std::string &path);
+        ~SmfPlayer();
+        void playStart();
+        void playStop();
+        bool isPlaying() const;
+
+        void playNextChunk();
+
+    private:
+        /**
+         * Struct used internally to parse a track of the file.
+         * The tempo is set instead of the event for tempo changes.
+         */
+        struct TrackCursor {
+            const uint8_t *start;
+            const uint8_t *position;
+            const uint8_t *end;
+            uint64_t tick;
+            uint8_t running_status;
+            bool has_event;
+            MidiEvent event;
+            uint32_t tempo;
+        };
+
+        void rewind();
+        void readNextEvent(TrackCursor &cursor);
+        uint64_t getEventTime(uint64_t tick) const;
+        void scheduleNextCallback();
+
+    private:
+        fluid_sequencer_t *sequencer;
+        int seq_synth_id;
+        int seq_client_id;
+        const uint8_t *data;
+        size_t size;
+        // Ticks per quarter note.
+        uint16_t division;
+        std::vector<TrackCursor> tracks;
+        // The time of a tick is computed relative to the last tempo change,
+        // in microseconds since the start of the file.
+        uint32_t tempo;
+        uint64_t tempo_tick;
+        uint64_t tempo_time;
+        unsigned int play_start_tick;
+        bool is_playing;
+        // Bit per midi channel, whose notes are turned off when the playback stops.
+        uint16_t used_channels;
+        // Reused for every scheduled event, the sequencer copies it.
+        fluid_event_t *play_event;
+        fluid_event_t *callback_event;
+};
@@ -0,0 +1,198 @@
+/**
+ * Fluidsynth for ImpactLX49+
+ * 
+ * Copyright (C) 2021 Thomas Keck
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <algorithm>
+#include <iostream>
+#include <stdexcept>
+
+#include "snapshot_handler.h"
+#include "midi_enums.h"
+
+/**
+ * Controllers stored per channel: modulation wheel, volume, pan, expression
+ * and those of the default modulators, see modulator_handler.cpp
+ */
+static const std::array<uint8_t, SNAPSHOT_CONTROLS> snapshot_controls = {
+    1, midi_cc::ATTENUATION, 10, 11,
+    midi_cc::MODENVATTACK, midi_cc::MODENVDECAY, midi_cc::MODENVSUSTAIN, midi_cc::MODENVRELEASE,
+    midi_cc::VOLENVATTACK, midi_cc::VOLENVDECAY, midi_cc::VOLENVSUSTAIN, midi_cc::VOLENVRELEASE,
+    midi_cc::IIR_FILTER_CUTOFF, midi_cc::IRR_FILTER_Q,
+};
+
+
+SnapshotHandler::SnapshotHandler(fluid_synth_t *synth, EffectHandler &effect_handler,
+                                 ModulatorHandler &modulator_handler, ControlThread &control) :
+    synth(synth),
+    effect_handler(effect_handler),
+    modulator_handler(modulator_handler),
+    control(control),
+    slots(SNAPSHOT_SLOTS),
+    selected_slot(0),
+    recalled_filter_type(FLUID_IIR_LOWPASS) {
+        // A recall changes at most every program and controller, the effects and the filter,
+        // hence computing the changes never allocates.
+        changes.reserve(SNAPSHOT_CHANNELS * (1 + SNAPSHOT_CONTROLS) + 3);
+}
+
+void SnapshotHandler::addSplitHandler(SplitHandler &split_handler) {
+    if (split_handlers.size() >= SNAPSHOT_SPLIT_HANDLERS) {
+        throw std::runtime_error("Snapshots support at most 4 split handlers.");
+    }
+    split_handlers.push_back(&split_handler);
+}
+
+MidiEvent SnapshotHandler::handleEvent(MidiEvent event) {
+    if (event.type != midi_event_type::CONTROL_CHANGE) {
+        return event;
+    }
+    switch(event.control()) {
+        case midi_cc::SNAPSHOT_SLOT:
+            selected_slot = event.value() * SNAPSHOT_SLOTS / 128;
+            break;
+        case midi_cc::SNAPSHOT_STORE:
+            if (event.value() > MIDI_BUTTON_THRESHOLD) {
+                store(selected_slot);
+            }
+            break;
+        case midi_cc::SNAPSHOT_RECALL:
+            if (event.value() > MIDI_BUTTON_THRESHOLD) {
+                recall(selected_slot);
+            }
+            break;
+    }
+    return event;
+}
+
+void SnapshotHandler::store(int slot) {
+    if (slot < 0 || slot >= SNAPSHOT_SLOTS) {
+        control.reportError("There is no such snapshot slot", slot);
+        return;
+    }
+    slots[slot] = capture();
+}
+
+void SnapshotHandler::recall(int slot) {
+    if (slot < 0 || slot >= SNAPSHOT_SLOTS || not slots[slot].is_stored) {
+        control.reportError("Snapshot slot is empty", slot);
+        return;
+    }
+    const Snapshot &target = slots[slot];
+    computeChanges(capture(), target);
+    effect_handler.setMode(target.effect_mode);
+    modulator_handler.setFilterType(target.filter_type);
+    for (size_t handler = 0; handler < split_handlers.size(); ++handler) {
+        split_handlers[handler]->setState(target.splits[handler]);
+    }
+    applyChanges();
+}
+
+void SnapshotHandler::applyChanges() {
+    // Failures are ignored, e.g. if the soundfont of a program has been
+    // swapped in the meantime, the other changes are applied nevertheless.
+    for (auto &change : changes) {
+        switch(change.kind) {
+            case SynthChangeKind::CHANGE_PROGRAM:
+                fluid_synth_program_select(synth, change.channel, change.sfont_id, change.bank, change.program);
+                break;
+            case SynthChangeKind::CHANGE_CONTROL:
+                fluid_synth_cc(synth, change.channel, change.control, change.value);
+                break;
+            case SynthChangeKind::CHANGE_REVERB:
+                fluid_synth_set_reverb(synth, recalled_effects.reverb_roomsize, recalled_effects.reverb_damp,
+                                       recalled_effects.reverb_width, recalled_effects.reverb_level);
+                break;
+            case SynthChangeKind::CHANGE_CHORUS:
+                fluid_synth_set_chorus(synth, recalled_effects.chorus_nr, recalled_effects.chorus_level,
+                                       recalled_effects.chorus_speed, recalled_effects.chorus_depth,
+                                       recalled_effects.chorus_type);
+                break;
+            case SynthChangeKind::CHANGE_FILTER:
+                fluid_synth_set_custom_filter(synth, recalled_filter_type, FLUID_IIR_Q_ZERO_OFF);
+                break;
+        }
+    }
+}
+
+Snapshot SnapshotHandler::capture() const {
+    Snapshot snapshot = {};
+    snapshot.is_stored = true;
+    int number_of_channels = std::min(fluid_synth_count_midi_channels(synth), SNAPSHOT_CHANNELS);
+    for (int channel = 0; channel < number_of_channels; ++channel) {
+        ChannelState &channel_state = snapshot.channels[channel];
+        if (fluid_synth_get_program(synth, channel, &channel_state.sfont_id,
+                                    &channel_state.bank, &channel_state.program) == FLUID_FAILED) {
+            channel_state.sfont_id = FLUID_FAILED;
+        }
+        for (size_t control = 0; control < SNAPSHOT_CONTROLS; ++control) {
+            int value = 0;
+            fluid_synth_get_cc(synth, channel, snapshot_controls[control], &value);
+            channel_state.controls[control] = value;
+        }
+    }
+    snapshot.effects.reverb_roomsize = fluid_synth_get_reverb_roomsize(synth);
+    snapshot.effects.reverb_damp = fluid_synth_get_reverb_damp(synth);
+    snapshot.effects.reverb_width = fluid_synth_get_reverb_width(synth);
+    snapshot.effects.reverb_level = fluid_synth_get_reverb_level(synth);
+    snapshot.effects.chorus_nr = fluid_synth_get_chorus_nr(synth);
+    snapshot.effects.chorus_level = fluid_synth_get_chorus_level(synth);
+    snapshot.effects.chorus_speed = fluid_synth_get_chorus_speed(synth);
+    snapshot.effects.chorus_depth = fluid_synth_get_chorus_depth(synth);
+    snapshot.effects.chorus_type = fluid_synth_get_chorus_type(synth);
+    snapshot.effect_mode = effect_handler.getMode();
+    snapshot.filter_type = modulator_handler.getFilterType();
+    for (size_t handler = 0; handler < split_handlers.size(); ++handler) {
+        snapshot.splits[handler] = split_handlers[handler]->getState();
+    }
+    return snapshot;
+}
+
+void SnapshotHandler::computeChanges(const Snapshot &current, const Snapshot &target) {
+    changes.clear();
+    for (uint8_t channel = 0; channel < SNAPSHOT_CHANNELS; ++channel) {
+        const ChannelState &from = current.channels[channel];
+        const ChannelState &to = target.channels[channel];
+        if (to.sfont_id != FLUID_FAILED &&
+            (from.sfont_id != to.sfont_id || from.bank != to.bank || from.program != to.program)) {
+            changes.push_back({SynthChangeKind::CHANGE_PROGRAM, channel, 0, 0,
+                                       to.sfont_id, to.bank, to.program});
+        }
+        for (size_t control = 0; control < SNAPSHOT_CONTROLS; ++control) {
+            if (from.controls[control] != to.controls[control]) {
+                changes.push_back({SynthChangeKind::CHANGE_CONTROL, channel,
+                                           snapshot_controls[control], to.controls[control]});
+            }
+        }
+    }
+    const EffectState &from = current.effects;
+    const EffectState &to = target.effects;
+    if (from.reverb_roomsize != to.reverb_roomsize || from.reverb_damp != to.reverb_damp ||
+        from.reverb_width != to.reverb_width || from.reverb_level != to.reverb_level) {
+        changes.push_back({SynthChangeKind::CHANGE_REVERB});
+    }
+    if (from.chorus_nr != to.chorus_nr || from.chorus_level != to.chorus_level ||
+        from.chorus_speed != to.chorus_speed || from.chorus_depth != to.chorus_depth ||
+        from.chorus_type != to.chorus_type) {
+        changes.push_back({SynthChangeKind::CHANGE_CHORUS});
+    }
+    if (current.filter_type != target.filter_type) {
+        changes.push_back({SynthChangeKind::CHANGE_FILTER});
+    }
+    recalled_effects = to;
+    recalled_filter_type = target.filter_type;
+}
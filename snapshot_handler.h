@@ -0,0 +1,143 @@
+/**
+ * Fluidsynth for ImpactLX49+
+ * 
+ * Copyright (C) 2021 Thomas Keck
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <array>
+#include <cstdint>
+#include <vector>
+
+#include <fluidsynth.h>
+
+#include "control_thread.h"
+#include "handler.h"
+#include "effect_handler.h"
+#include "modulator_handler.h"
+#include "split_handler.h"
+
+#define SNAPSHOT_SLOTS 16
+#define SNAPSHOT_CHANNELS 16
+// Number of controllers stored per channel, see snapshot_controls.
+#define SNAPSHOT_CONTROLS 14
+#define SNAPSHOT_SPLIT_HANDLERS 4
+
+/**
+ * Enum defining the kind of a synth change of a snapshot recall.
+ */
+enum SynthChangeKind {
+    CHANGE_PROGRAM = 1,
+    CHANGE_CONTROL = 2,
+    CHANGE_REVERB = 3,
+    CHANGE_CHORUS = 4,
+    CHANGE_FILTER = 5,
+};
+
+/**
+ * Preset and controllers of a midi channel.
+ */
+struct ChannelState {
+    int sfont_id;
+    int bank;
+    int program;
+    std::array<uint8_t, SNAPSHOT_CONTROLS> controls;
+};
+
+/**
+ * Reverb and chorus parameters of the synth.
+ */
+struct EffectState {
+    double reverb_roomsize;
+    double reverb_damp;
+    double reverb_width;
+    double reverb_level;
+    int chorus_nr;
+    double chorus_level;
+    double chorus_speed;
+    double chorus_depth;
+    int chorus_type;
+};
+
+/**
+ * Entire state of the keyboard, as it is stored in a snapshot slot.
+ */
+struct Snapshot {
+    bool is_stored;
+    std::array<ChannelState, SNAPSHOT_CHANNELS> channels;
+    EffectState effects;
+    EffectControlMode effect_mode;
+    int filter_type;
+    std::array<SplitState, SNAPSHOT_SPLIT_HANDLERS> splits;
+};
+
+/**
+ * Single synth call of a snapshot recall.
+ * The parameters of the effects and the filter are those of the recalled snapshot.
+ */
+struct SynthChange {
+    uint8_t kind;
+    uint8_t channel;
+    uint8_t control;
+    uint8_t value;
+    int sfont_id;
+    int bank;
+    int program;
+};
+
+/**
+ * Stores the state of the keyboard in numbered slots and recalls it.
+ *
+ * A snapshot contains the state of the handlers and of the synth, i.e. the
+ * preset and controllers of every channel and the effect parameters.
+ * The state of the handlers is only used by the dispatch thread, hence it is
+ * restored immediately. For the synth the dispatch thread computes the
+ * changes between its current state and the snapshot and applies all of them
+ * right away, before it handles the next event. Hence, a recall takes effect
+ * at once instead of the controllers being moved one after another while
+ * notes are playing. Every synth call takes the lock of the synth, which is
+ * why they are not made by the audio thread, which must never wait for it.
+ */
+class SnapshotHandler : public Handler {
+
+    public:
+        SnapshotHandler(fluid_synth_t *synth, EffectHandler &effect_handler, ModulatorHandler &modulator_handler,
+                        ControlThread &control);
+        void addSplitHandler(SplitHandler &split_handler);
+        MidiEvent handleEvent(MidiEvent event) override;
+        const char* getName() const override { return "SnapshotHandler"; }
+        void store(int slot);
+        void recall(int slot);
+
+    private:
+        Snapshot capture() const;
+        void computeChanges(const Snapshot &current, const Snapshot &target);
+        void applyChanges();
+
+    private:
+        fluid_synth_t *synth;
+        EffectHandler &effect_handler;
+        ModulatorHandler &modulator_handler;
+        ControlThread &control;
+        std::vector<SplitHandler*> split_handlers;
+        std::vector<Snapshot> slots;
+        int selected_slot;
+        // The changes of the last recall, reserved once so a recall never allocates.
+        std::vector<SynthChange> changes;
+        EffectState recalled_effects;
+        int recalled_filter_type;
+};
@@ -0,0 +1,79 @@
+/**
+ * Fluidsynth for ImpactLX49+
+ * 
+ * Copyright (C) 2021 Thomas Keck
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <iostream>
+
+#include "sample_cache.h"
+
+#include "soundfont_loader.h"
+
+// Set by the thread in SoundfontLoader::load while the synth loads it.
+thread_local fluid_sfont_t *handed_over_sfont = nullptr;
+
+
+static fluid_sfont_t* hand_over(fluid_sfloader_t *sfloader, const char *filename) {
+    // Other loads fall through to the next loader of the synth.
+    return handed_over_sfont;
+}
+
+
+SoundfontLoader::SoundfontLoader(fluid_synth_t *synth, SharedSoundfontLoader *shared_loader) :
+    synth(synth) {
+        settings = new_fluid_settings();
+        // The private synth only holds a soundfont until it is handed over.
+        fluid_settings_setint(settings, "synth.polyphony", 1);
+        private_synth = new_fluid_synth(settings);
+        if (shared_loader != nullptr) {
+            fluid_synth_add_sfloader(private_synth, shared_loader->newSfloader());
+        } else {
+            fluid_synth_add_sfloader(private_synth, new_sample_cache_sfloader(settings));
+        }
+        // Added last, so the synth asks it first.
+        fluid_synth_add_sfloader(synth, new_fluid_sfloader(hand_over, delete_fluid_sfloader));
+}
+
+SoundfontLoader::~SoundfontLoader() {
+    delete_fluid_synth(private_synth);
+    delete_fluid_settings(settings);
+}
+
+int SoundfontLoader::load(const std::string &path) {
+    // The private synth only ever lists the soundfont being handed over,
+    // so it cannot confuse it with another one by its id.
+    std::lock_guard<std::mutex> lock(load_mutex);
+    int private_id = fluid_synth_sfload(private_synth, path.c_str(), 0);
+    if (private_id == FLUID_FAILED) {
+        return FLUID_FAILED;
+    }
+    handed_over_sfont = fluid_synth_get_sfont_by_id(private_synth, private_id);
+    int sfont_id = fluid_synth_sfload(synth, path.c_str(), 0);
+    handed_over_sfont = nullptr;
+    // The synth gave the soundfont its own id, which the private synth now lists it by.
+    // Only drops the reference of the private synth, the synth keeps the soundfont.
+    int unload_id = sfont_id == FLUID_FAILED ? private_id : sfont_id;
+    if (fluid_synth_sfunload(private_synth, unload_id, 0) == FLUID_FAILED) {
+        std::cerr << "Failed to release soundfont " << path << " from the loader" << std::endl;
+    }
+    return sfont_id;
+}
+
+int SoundfontLoader::getNumberOfHeldSoundfonts() {
+    std::lock_guard<std::mutex> lock(load_mutex);
+    return fluid_synth_sfcount(private_synth);
+}
@@ -0,0 +1,68 @@
+/**
+ * Fluidsynth for ImpactLX49+
+ * 
+ * Copyright (C) 2021 Thomas Keck
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <mutex>
+#include <string>
+
+#include <fluidsynth.h>
+
+#include "shared_soundfont_loader.h"
+
+/**
+ * Loads soundfonts into a synth that keeps on playing.
+ *
+ * fluid_synth_sfload holds the lock of the synth for the whole load,
+ * decoding included, which blocks the live notes and the audio thread.
+ * Hence the soundfont is loaded by a private synth, which never plays, and
+ * is then handed over through a loader of the synth that only returns the
+ * loaded soundfont, so the synth is only locked to add it to its list.
+ */
+class SoundfontLoader {
+
+    public:
+        /**
+         * Adds the hand-over loader to the synth, hence it must be created
+         * before the synth loads its first soundfont. The soundfonts are
+         * loaded like the other ones of the synth, from the shared loader
+         * if it is given, otherwise through the sample cache.
+         */
+        SoundfontLoader(fluid_synth_t *synth, SharedSoundfontLoader *shared_loader);
+        ~SoundfontLoader();
+
+        /**
+         * Returns the id of the soundfont in the synth, or FLUID_FAILED.
+         * Takes as long as the load, hence it must be called by a background thread.
+         */
+        int load(const std::string &path);
+
+        /**
+         * Returns the number of soundfonts the private synth still holds a
+         * reference to, which must be 0. Otherwise the synth would never free
+         * them when it unloads them, and both synths would delete them.
+         */
+        int getNumberOfHeldSoundfonts();
+
+    private:
+        fluid_synth_t *synth;
+        fluid_settings_t *settings;
+        fluid_synth_t *private_synth;
+        std::mutex load_mutex;
+};
@@ -0,0 +1,150 @@
+/**
+ * Fluidsynth for ImpactLX49+
+ * 
+ * Copyright (C) 2021 Thomas Keck
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <iostream>
+
+#include "soundfont_swapper.h"
+
+#define DRUM_CHANNEL 9
+#define DRUM_BANK 128
+
+
+SoundfontSwapper::SoundfontSwapper(fluid_synth_t *synth, SoundfontLoader &sfont_loader, int sfont_id) :
+    synth(synth),
+    sfont_loader(sfont_loader),
+    state(SwapState::IDLE),
+    sfont_id(sfont_id),
+    pending_sfont_id(FLUID_FAILED),
+    longest_block_time(0) {
+}
+
+SoundfontSwapper::~SoundfontSwapper() {
+    if (loader.joinable()) {
+        // Nobody renders audio anymore, hence a pending swap will never be applied.
+        int current = state.load();
+        while ((current == SwapState::LOADING || current == SwapState::READY) &&
+               not state.compare_exchange_weak(current, SwapState::CANCELLED)) {}
+        state.notify_all();
+        loader.join();
+    }
+}
+
+bool SoundfontSwapper::requestSwap(const std::string &path) {
+    int expected = SwapState::IDLE;
+    if (not state.compare_exchange_strong(expected, SwapState::LOADING)) {
+        std::cerr << "A soundfont swap is already in progress" << std::endl;
+        return false;
+    }
+    // The previous background thread has finished, since the state is idle again.
+    if (loader.joinable()) {
+        loader.join();
+    }
+    longest_block_time = 0;
+    loader = std::thread(&SoundfontSwapper::swapInBackground, this, path);
+    return true;
+}
+
+void SoundfontSwapper::applyPendingSwap() {
+    if (state.load(std::memory_order_acquire) != SwapState::READY) {
+        return;
+    }
+    int expected = SwapState::READY;
+    if (not state.compare_exchange_strong(expected, SwapState::SWAPPED)) {
+        return;
+    }
+    selectPresets(pending_sfont_id);
+    sfont_id = pending_sfont_id;
+    state.notify_all();
+}
+
+void SoundfontSwapper::reportBlockRenderTime(long nanoseconds) {
+    if (state.load(std::memory_order_relaxed) == SwapState::IDLE) {
+        return;
+    }
+    long longest = longest_block_time.load(std::memory_order_relaxed);
+    while (nanoseconds > longest &&
+           not longest_block_time.compare_exchange_weak(longest, nanoseconds)) {}
+}
+
+bool SoundfontSwapper::isSwapping() const {
+    return state.load() != SwapState::IDLE;
+}
+
+/**
+ * In nanoseconds, of the audio blocks rendered since the last swap was requested.
+ */
+long SoundfontSwapper::getLongestBlockTime() const {
+    return longest_block_time.load();
+}
+
+int SoundfontSwapper::getSfontId() const {
+    return sfont_id;
+}
+
+void SoundfontSwapper::swapInBackground(std::string path) {
+    // The presets are not reset, so the channels keep on playing the old
+    // soundfont until the swap is applied at a block boundary.
+    int new_sfont_id = sfont_loader.load(path);
+    if (new_sfont_id == FLUID_FAILED) {
+        std::cerr << "Failed to load soundfont " << path << std::endl;
+        state = SwapState::IDLE;
+        return;
+    }
+    pending_sfont_id = new_sfont_id;
+    int old_sfont_id = sfont_id;
+    int expected = SwapState::LOADING;
+    if (not state.compare_exchange_strong(expected, SwapState::READY, std::memory_order_release)) {
+        fluid_synth_sfunload(synth, new_sfont_id, 0);
+        return;
+    }
+
+    state.wait(SwapState::READY);
+    if (state == SwapState::CANCELLED) {
+        return;
+    }
+    // Fluidsynth keeps the samples alive until the last voice using them
+    // has been released, hence this does not cut off sounding notes.
+    if (fluid_synth_sfunload(synth, old_sfont_id, 0) == FLUID_FAILED) {
+        std::cerr << "Failed to unload soundfont " << old_sfont_id << std::endl;
+    }
+    std::cout << "Swapped to soundfont " << path
+              << ", longest audio block during swap took "
+              << longest_block_time / 1000 << " us" << std::endl;
+    state = SwapState::IDLE;
+}
+
+void SoundfontSwapper::selectPresets(int new_sfont_id) {
+    int old_sfont_id = sfont_id;
+    int number_of_channels = fluid_synth_count_midi_channels(synth);
+    for (int channel = 0; channel < number_of_channels; ++channel) {
+        int channel_sfont_id, bank, program;
+        if (fluid_synth_get_program(synth, channel, &channel_sfont_id, &bank, &program) == FLUID_FAILED) {
+            continue;
+        }
+        if (channel_sfont_id != old_sfont_id) {
+            continue;
+        }
+        // Keeps the bank and program if the new soundfont provides them,
+        // otherwise falls back to the first preset of the bank.
+        if (fluid_synth_program_select(synth, channel, new_sfont_id, bank, program) == FLUID_FAILED) {
+            int fallback_bank = (channel == DRUM_CHANNEL) ? DRUM_BANK : 0;
+            fluid_synth_program_select(synth, channel, new_sfont_id, fallback_bank, 0);
+        }
+    }
+}
@@ -0,0 +1,79 @@
+/**
+ * Fluidsynth for ImpactLX49+
+ * 
+ * Copyright (C) 2021 Thomas Keck
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <atomic>
+#include <string>
+#include <thread>
+
+#include <fluidsynth.h>
+
+#include "soundfont_loader.h"
+
+/**
+ * Enum defining the states of a soundfont swap.
+ */
+enum SwapState {
+    IDLE = 0,
+    LOADING = 1,
+    READY = 2,
+    SWAPPED = 3,
+    CANCELLED = 4,
+};
+
+/**
+ * Replaces the soundfont while the synth keeps on playing.
+ *
+ * Loading a soundfont takes seconds, hence it is done on a background thread
+ * without locking the synth (see SoundfontLoader), which keeps on playing.
+ * Once the new soundfont is loaded the audio thread switches the preset
+ * of every channel at the beginning of the next audio block, afterwards
+ * the background thread unloads the old soundfont.
+ * Fluidsynth only frees the old samples once the last voice using them
+ * has been released, hence notes that are still sounding are not cut off.
+ */
+class SoundfontSwapper {
+
+    public:
+        SoundfontSwapper(fluid_synth_t *synth, SoundfontLoader &loader, int sfont_id);
+        ~SoundfontSwapper();
+        bool requestSwap(const std::string &path);
+        /**
+         * Called by the audio thread at the beginning of every block.
+         */
+        void applyPendingSwap();
+        void reportBlockRenderTime(long nanoseconds);
+        bool isSwapping() const;
+        long getLongestBlockTime() const;
+        int getSfontId() const;
+
+    private:
+        void swapInBackground(std::string path);
+        void selectPresets(int sfont_id);
+
+    private:
+        fluid_synth_t *synth;
+        SoundfontLoader &sfont_loader;
+        std::thread loader;
+        std::atomic<int> state;
+        std::atomic<int> sfont_id;
+        int pending_sfont_id;
+        std::atomic<long> longest_block_time;
+};
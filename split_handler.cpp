@@ -39,9 +39,9 @@ SplitHandler::SplitHandler(int number_of_splits) : number_of_splits(number_of_sp
     }
 }
 
-void SplitHandler::handleControlEvent(fluid_midi_event_t *event) {
+void SplitHandler::handleControlEvent(MidiEvent event) {
     int split = 0;
-    switch(fluid_midi_event_get_control(event)) {
+    switch(event.control()) {
         case midi_cc::SPLIT1_BUTTON:
             split = 0;
             break;
@@ -58,29 +58,48 @@ void SplitHandler::handleControlEvent(fluid_midi_event_t *event) {
             return;
     }
 
-    is_frozen[split] = fluid_midi_event_get_value(event) > MIDI_BUTTON_THRESHOLD;
-    channels[split] = fluid_midi_event_get_channel(event);
+    is_frozen[split] = event.value() > MIDI_BUTTON_THRESHOLD;
+    channels[split] = event.channel;
 }
 
-void SplitHandler::handleNoteEvent(fluid_midi_event_t *event) {
-    int key = fluid_midi_event_get_key(event);
+MidiEvent SplitHandler::handleNoteEvent(MidiEvent event) {
+    int key = event.key();
     for (unsigned int split = 0; split < number_of_splits; ++split) {
         if (is_frozen[split] && 
             key >= split_bounds[split].first &&
             key < split_bounds[split].second) {
-            fluid_midi_event_set_channel(event, channels[split]);
+            event.channel = channels[split];
         }
     }
+    return event;
 }
 
-void SplitHandler::handleEvent(fluid_midi_event_t *event) {
+SplitState SplitHandler::getState() const {
+    SplitState state = {};
+    for (unsigned int split = 0; split < number_of_splits; ++split) {
+        state.frozen_splits |= is_frozen[split] << split;
+        state.channels[split] = channels[split];
+    }
+    return state;
+}
 
-    switch(fluid_midi_event_get_type(event)) {
+void SplitHandler::setState(const SplitState &state) {
+    for (unsigned int split = 0; split < number_of_splits; ++split) {
+        is_frozen[split] = state.frozen_splits & (1 << split);
+        channels[split] = state.channels[split];
+    }
+}
+
+MidiEvent SplitHandler::handleEvent(MidiEvent event) {
+
+    switch(event.type) {
         case midi_event_type::CONTROL_CHANGE:
-            return handleControlEvent(event);
+            handleControlEvent(event);
+            break;
         case midi_event_type::NOTE_OFF:
         case midi_event_type::NOTE_ON:
             return handleNoteEvent(event);
     }
+    return event;
 }
 
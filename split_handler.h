@@ -19,6 +19,8 @@
 
 #pragma once
 
+#include <array>
+#include <cstdint>
 #include <vector>
 #include <utility>
 
@@ -26,15 +28,27 @@
 
 #include "handler.h"
 
+/**
+ * State of the four splits, as it is stored in a snapshot.
+ */
+struct SplitState {
+    // One bit per split.
+    uint8_t frozen_splits;
+    std::array<uint8_t, 4> channels;
+};
+
 class SplitHandler : public Handler {
 
     public:
         SplitHandler(int number_of_splits);
-        void handleEvent(fluid_midi_event_t *event) override;
+        MidiEvent handleEvent(MidiEvent event) override;
+        const char* getName() const override { return "SplitHandler"; }
+        SplitState getState() const;
+        void setState(const SplitState &state);
 
     private:
-        void handleControlEvent(fluid_midi_event_t *event);
-        void handleNoteEvent(fluid_midi_event_t *event);
+        void handleControlEvent(MidiEvent event);
+        MidiEvent handleNoteEvent(MidiEvent event);
     private:
         int number_of_splits;
         std::vector<bool> is_frozen;
@@ -0,0 +1,301 @@
+/**
+ * Fluidsynth for ImpactLX49+
+ * 
+ * Copyright (C) 2021 Thomas Keck
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <cerrno>
+#include <cstring>
+#include <iostream>
+#include <stdexcept>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "format_workaround.h"
+
+#include "take_pager.h"
+
+
+PagedTake::PagedTake(TakePager *pager) :
+    pager(pager),
+    record_buffer(0),
+    number_of_pages(0),
+    requested_page(-1) {
+        for (auto &buffer : buffers) {
+            buffer.events.reserve(TAKE_PAGE_BYTES);
+            buffer.page.store(TAKE_PAGE_EMPTY, std::memory_order_relaxed);
+        }
+}
+
+PagedTake::~PagedTake() {
+    // The pager must not touch a buffer after it is freed.
+    waitForPager();
+}
+
+void PagedTake::start() {
+    record_buffer = 0;
+    buffers[0].events.clear();
+    buffers[0].page.store(0, std::memory_order_relaxed);
+    number_of_pages = 1;
+}
+
+bool PagedTake::append(int time, MidiEvent event) {
+    Buffer *buffer = &buffers[record_buffer];
+    if (buffer->events.size() + TAKE_MAX_EVENT_BYTES > TAKE_PAGE_BYTES) {
+        int next_buffer = 1 - record_buffer;
+        // The page before the full one has not been written yet.
+        if (buffers[next_buffer].page.load(std::memory_order_acquire) == TAKE_PAGE_BUSY ||
+            not requestWrite(record_buffer)) {
+            pager->reportDroppedEvent();
+            return false;
+        }
+        record_buffer = next_buffer;
+        buffer = &buffers[record_buffer];
+        buffer->events.clear();
+        buffer->page.store(number_of_pages++, std::memory_order_relaxed);
+    }
+    return buffer->events.append(time, event);
+}
+
+void PagedTake::finish() {
+    if (number_of_pages <= 2) {
+        return;
+    }
+    // Both buffers are needed to page through the take, hence the last page
+    // is written as well, and the first one is loaded for the next loop.
+    if (not requestWrite(record_buffer)) {
+        pager->reportDroppedEvent();
+    }
+    int other_buffer = 1 - record_buffer;
+    if (buffers[other_buffer].page.load(std::memory_order_acquire) != TAKE_PAGE_BUSY) {
+        requestLoad(other_buffer, 0);
+    }
+}
+
+bool PagedTake::read(TakeCursor &cursor, int &time, MidiEvent &event) const {
+    while (cursor.page < number_of_pages) {
+        const Buffer *buffer = find(cursor.page);
+        // The cursor waits for the page to be loaded.
+        if (buffer == nullptr) {
+            return false;
+        }
+        if (buffer->events.read(cursor.events, time, event)) {
+            return true;
+        }
+        cursor.page++;
+        cursor.events = EventCursor();
+    }
+    return false;
+}
+
+/**
+ * Loads the page after the one of the cursor into the other buffer, the
+ * next loop starts with the first page. The cursor must be the one of the
+ * events that have been scheduled, not one that has read ahead.
+ */
+void PagedTake::prefetch(const TakeCursor &cursor) {
+    if (number_of_pages <= 2) {
+        return;
+    }
+    const Buffer *current = find(cursor.page);
+    if (current == nullptr) {
+        bool is_loading = requested_page == cursor.page &&
+            (buffers[0].page.load(std::memory_order_acquire) == TAKE_PAGE_BUSY ||
+             buffers[1].page.load(std::memory_order_acquire) == TAKE_PAGE_BUSY);
+        if (is_loading) {
+            return;
+        }
+        for (int buffer = 0; buffer < 2; ++buffer) {
+            if (buffers[buffer].page.load(std::memory_order_acquire) != TAKE_PAGE_BUSY) {
+                // The page should have been loaded while the page before was played.
+                if (requestLoad(buffer, cursor.page)) {
+                    pager->reportLatePage();
+                }
+                return;
+            }
+        }
+        return;
+    }
+    int next_page = (cursor.page + 1) % number_of_pages;
+    int other_buffer = (current == &buffers[0]) ? 1 : 0;
+    int state = buffers[other_buffer].page.load(std::memory_order_acquire);
+    if (state != next_page && state != TAKE_PAGE_BUSY) {
+        requestLoad(other_buffer, next_page);
+    }
+}
+
+void PagedTake::waitForPager() const {
+    for (auto &buffer : buffers) {
+        while (buffer.page.load(std::memory_order_acquire) == TAKE_PAGE_BUSY) {
+            buffer.page.wait(TAKE_PAGE_BUSY, std::memory_order_acquire);
+        }
+    }
+}
+
+const PagedTake::Buffer* PagedTake::find(int page) const {
+    for (auto &buffer : buffers) {
+        if (buffer.page.load(std::memory_order_acquire) == page) {
+            return &buffer;
+        }
+    }
+    return nullptr;
+}
+
+bool PagedTake::requestWrite(int buffer) {
+    int page = buffers[buffer].page.load(std::memory_order_relaxed);
+    buffers[buffer].page.store(TAKE_PAGE_BUSY, std::memory_order_release);
+    if (not pager->request(this, buffer, page, true)) {
+        buffers[buffer].page.store(page, std::memory_order_relaxed);
+        return false;
+    }
+    return true;
+}
+
+bool PagedTake::requestLoad(int buffer, int page) {
+    int state = buffers[buffer].page.load(std::memory_order_relaxed);
+    buffers[buffer].page.store(TAKE_PAGE_BUSY, std::memory_order_release);
+    if (not pager->request(this, buffer, page, false)) {
+        buffers[buffer].page.store(state, std::memory_order_relaxed);
+        return false;
+    }
+    requested_page = page;
+    return true;
+}
+
+
+TakePager::TakePager(const std::string &directory) :
+    file_size(0),
+    read_buffer(TAKE_PAGE_BYTES),
+    requests(TAKE_PAGER_QUEUE_SIZE),
+    pending_requests(0),
+    is_running(true),
+    dropped_events(0),
+    late_pages(0),
+    rejected_takes(0) {
+        fd = open(directory.c_str(), O_TMPFILE | O_RDWR | O_CLOEXEC, 0600);
+        if (fd < 0) {
+            throw std::runtime_error(std::format("Failed to create take page file in {}: {}",
+                                                 directory, std::strerror(errno)));
+        }
+        pager = std::thread(&TakePager::pageInBackground, this);
+}
+
+TakePager::~TakePager() {
+    is_running = false;
+    pending_requests.fetch_add(1, std::memory_order_release);
+    pending_requests.notify_one();
+    pager.join();
+    close(fd);
+}
+
+bool TakePager::request(PagedTake *take, int buffer, int page, bool is_write) {
+    if (not requests.push({take, buffer, page, is_write})) {
+        return false;
+    }
+    // Wakes the pager, which happens at most once per page.
+    pending_requests.fetch_add(1, std::memory_order_release);
+    pending_requests.notify_one();
+    return true;
+}
+
+void TakePager::reportDroppedEvent() {
+    // Only the first problem wakes the pager to report it.
+    if (dropped_events.fetch_add(1, std::memory_order_relaxed) == 0) {
+        pending_requests.fetch_add(1, std::memory_order_release);
+        pending_requests.notify_one();
+    }
+}
+
+void TakePager::reportLatePage() {
+    if (late_pages.fetch_add(1, std::memory_order_relaxed) == 0) {
+        pending_requests.fetch_add(1, std::memory_order_release);
+        pending_requests.notify_one();
+    }
+}
+
+void TakePager::reportRejectedTake() {
+    if (rejected_takes.fetch_add(1, std::memory_order_relaxed) == 0) {
+        pending_requests.fetch_add(1, std::memory_order_release);
+        pending_requests.notify_one();
+    }
+}
+
+void TakePager::pageInBackground() {
+    while (true) {
+        uint32_t seen_requests = pending_requests.load(std::memory_order_acquire);
+        PageRequest request;
+        while (requests.pop(request)) {
+            if (request.is_write) {
+                write(request.take, request.buffer, request.page);
+            } else {
+                load(request.take, request.buffer, request.page);
+            }
+        }
+        reportProblems();
+        if (not is_running) {
+            break;
+        }
+        pending_requests.wait(seen_requests, std::memory_order_acquire);
+    }
+}
+
+void TakePager::write(PagedTake *take, int buffer, int page) {
+    PagedTake::Buffer &page_buffer = take->buffers[buffer];
+    size_t size = page_buffer.events.size();
+    if (pwrite(fd, page_buffer.events.data(), size, file_size) != static_cast<ssize_t>(size)) {
+        std::cerr << "Failed to write take page: " << std::strerror(errno) << std::endl;
+        size = 0;
+    }
+    if (take->spilled_pages.size() <= static_cast<size_t>(page)) {
+        take->spilled_pages.resize(page + 1);
+    }
+    take->spilled_pages[page] = {file_size, size};
+    file_size += size;
+    page_buffer.page.store(page, std::memory_order_release);
+    page_buffer.page.notify_all();
+}
+
+void TakePager::load(PagedTake *take, int buffer, int page) {
+    PagedTake::Buffer &page_buffer = take->buffers[buffer];
+    ssize_t size = 0;
+    if (static_cast<size_t>(page) < take->spilled_pages.size()) {
+        const auto &spilled = take->spilled_pages[page];
+        size = pread(fd, read_buffer.data(), spilled.size, spilled.offset);
+        if (size < 0) {
+            std::cerr << "Failed to read take page: " << std::strerror(errno) << std::endl;
+            size = 0;
+        }
+    }
+    page_buffer.events.assign(read_buffer.data(), size);
+    page_buffer.page.store(page, std::memory_order_release);
+    page_buffer.page.notify_all();
+}
+
+void TakePager::reportProblems() {
+    long dropped = dropped_events.exchange(0);
+    if (dropped > 0) {
+        std::cerr << "Take pages not written in time, dropped " << dropped << " recorded events" << std::endl;
+    }
+    long late = late_pages.exchange(0);
+    if (late > 0) {
+        std::cerr << late << " take pages were not loaded in time, their events were played late" << std::endl;
+    }
+    long rejected = rejected_takes.exchange(0);
+    if (rejected > 0) {
+        std::cerr << "Ignored " << rejected << " recordings of tracks with the maximum number of takes" << std::endl;
+    }
+}
@@ -0,0 +1,149 @@
+/**
+ * Fluidsynth for ImpactLX49+
+ * 
+ * Copyright (C) 2021 Thomas Keck
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <sys/types.h>
+
+#include "event_stream.h"
+#include "midi_event.h"
+#include "mpsc_queue.h"
+
+#define TAKE_PAGE_BYTES 8192
+// A delta time of up to 5 bytes, the status byte and two data bytes.
+#define TAKE_MAX_EVENT_BYTES 8
+#define TAKE_PAGER_QUEUE_SIZE 1024
+// States of a page buffer besides the index of the page it holds.
+#define TAKE_PAGE_EMPTY -1
+#define TAKE_PAGE_BUSY -2
+
+class TakePager;
+
+/**
+ * Position of a reader in a paged take.
+ */
+struct TakeCursor {
+    int page = 0;
+    EventCursor events;
+};
+
+/**
+ * Take whose events are split into pages of TAKE_PAGE_BYTES, of which only
+ * two are kept in memory, so a take of any length uses the same memory.
+ *
+ * Every page is an event stream of its own, whose times are relative to the
+ * start of the take. Most loops fit into these two pages and never touch the
+ * page file. A longer take is written to it page by page while it is recorded,
+ * and the page after the one being played is loaded while it plays.
+ *
+ * The take is recorded by the dispatch thread and only read by the sequencer
+ * thread once it is finished. A buffer is owned by the pager thread while it
+ * is busy, the other threads only hand it over through its atomic state.
+ */
+class PagedTake {
+
+    public:
+        PagedTake(TakePager *pager);
+        ~PagedTake();
+        void start();
+        bool append(int time, MidiEvent event);
+        void finish();
+        bool read(TakeCursor &cursor, int &time, MidiEvent &event) const;
+        void prefetch(const TakeCursor &cursor);
+        void waitForPager() const;
+
+    private:
+        friend class TakePager;
+
+        struct Buffer {
+            EventStream events;
+            std::atomic<int> page;
+        };
+
+        /**
+         * Location of a page in the page file.
+         */
+        struct SpilledPage {
+            off_t offset;
+            size_t size;
+        };
+
+        const Buffer* find(int page) const;
+        bool requestWrite(int buffer);
+        bool requestLoad(int buffer, int page);
+
+    private:
+        TakePager *pager;
+        std::array<Buffer, 2> buffers;
+        int record_buffer;
+        int number_of_pages;
+        // Only used by the thread which reads the take.
+        int requested_page;
+        // Only used by the pager thread.
+        std::vector<SpilledPage> spilled_pages;
+};
+
+/**
+ * Writes the pages of long takes to a page file and loads them back.
+ *
+ * The dispatch and sequencer threads only push requests into a lock-free
+ * queue, a background thread does the file I/O. The page file is an
+ * unnamed temporary file, which is gone as soon as it is closed.
+ */
+class TakePager {
+
+    public:
+        TakePager(const std::string &directory);
+        ~TakePager();
+        bool request(PagedTake *take, int buffer, int page, bool is_write);
+        void reportDroppedEvent();
+        void reportLatePage();
+        void reportRejectedTake();
+
+    private:
+        struct PageRequest {
+            PagedTake *take;
+            int buffer;
+            int page;
+            bool is_write;
+        };
+
+        void pageInBackground();
+        void write(PagedTake *take, int buffer, int page);
+        void load(PagedTake *take, int buffer, int page);
+        void reportProblems();
+
+    private:
+        int fd;
+        off_t file_size;
+        std::vector<uint8_t> read_buffer;
+        MpscQueue<PageRequest> requests;
+        std::atomic<uint32_t> pending_requests;
+        std::atomic<bool> is_running;
+        std::atomic<long> dropped_events;
+        std::atomic<long> late_pages;
+        std::atomic<long> rejected_takes;
+        std::thread pager;
+};
@@ -0,0 +1,178 @@
+/**
+ * Fluidsynth for ImpactLX49+
+ * 
+ * Copyright (C) 2021 Thomas Keck
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <algorithm>
+#include <cmath>
+#include <fstream>
+#include <iomanip>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "trace.h"
+#include "ring_buffer.h"
+
+/**
+ * Struct used internally to store a single span.
+ */
+struct _TraceSpan {
+    const char *name;
+    uint64_t start;
+    uint64_t end;
+    uint32_t event_id;
+};
+
+/**
+ * Struct used internally to store the spans of one thread.
+ */
+struct _TraceThread {
+    _TraceThread(long thread_id) : thread_id(thread_id), spans(TRACE_RING_SIZE), dropped_spans(0) {}
+    long thread_id;
+    RingBuffer<_TraceSpan> spans;
+    std::atomic<long> dropped_spans;
+};
+
+std::atomic<bool> trace_enabled(false);
+std::atomic<uint32_t> trace_event_counter(0);
+std::atomic<long> trace_unregistered_spans(0);
+
+// The registry is only locked when a thread is registered
+// and when the trace is written.
+std::mutex trace_registry_mutex;
+std::vector<std::unique_ptr<_TraceThread>> trace_registry;
+thread_local _TraceThread *trace_thread = nullptr;
+
+uint32_t trace_next_event_id() {
+    return trace_event_counter.fetch_add(1, std::memory_order_relaxed);
+}
+
+void trace_register_thread() {
+    if (trace_thread != nullptr) {
+        return;
+    }
+    std::lock_guard<std::mutex> lock(trace_registry_mutex);
+    trace_registry.push_back(std::make_unique<_TraceThread>(syscall(SYS_gettid)));
+    trace_thread = trace_registry.back().get();
+}
+
+void trace_span(const char *name, uint64_t start, uint64_t end, uint32_t event_id) {
+    if (trace_thread == nullptr) {
+        trace_unregistered_spans.fetch_add(1, std::memory_order_relaxed);
+        return;
+    }
+    if (not trace_thread->spans.push({name, start, end, event_id})) {
+        trace_thread->dropped_spans.fetch_add(1, std::memory_order_relaxed);
+    }
+}
+
+void trace_start() {
+    trace_enabled = true;
+}
+
+bool trace_stop(const std::string &path) {
+    trace_enabled = false;
+
+    std::ofstream file(path);
+    if (not file) {
+        return false;
+    }
+    std::lock_guard<std::mutex> lock(trace_registry_mutex);
+    file << std::fixed << std::setprecision(3) << "{\"traceEvents\":[";
+    bool is_first = true;
+    for (auto &thread : trace_registry) {
+        _TraceSpan span;
+        while (thread->spans.pop(span)) {
+            file << (is_first ? "\n" : ",\n")
+                 << "{\"name\":\"" << span.name << "\",\"ph\":\"X\",\"pid\":1"
+                 << ",\"tid\":" << thread->thread_id
+                 << ",\"ts\":" << span.start / 1000.0
+                 << ",\"dur\":" << (span.end - span.start) / 1000.0
+                 << ",\"args\":{\"event\":" << span.event_id << "}}";
+            is_first = false;
+        }
+        long dropped = thread->dropped_spans.exchange(0);
+        if (dropped > 0) {
+            file << (is_first ? "\n" : ",\n")
+                 << "{\"name\":\"dropped spans\",\"ph\":\"i\",\"s\":\"t\",\"pid\":1"
+                 << ",\"tid\":" << thread->thread_id << ",\"ts\":0"
+                 << ",\"args\":{\"count\":" << dropped << "}}";
+            is_first = false;
+        }
+    }
+    long unregistered = trace_unregistered_spans.exchange(0);
+    if (unregistered > 0) {
+        file << (is_first ? "\n" : ",\n")
+             << "{\"name\":\"spans of unregistered threads\",\"ph\":\"i\",\"s\":\"g\",\"pid\":1,\"ts\":0"
+             << ",\"args\":{\"count\":" << unregistered << "}}";
+    }
+    file << "\n]}\n";
+    return true;
+}
+
+std::map<std::string, TraceStageSummary> trace_summarize(long &dropped_spans) {
+    trace_enabled = false;
+
+    std::map<std::string, std::vector<double>> durations;
+    {
+        std::lock_guard<std::mutex> lock(trace_registry_mutex);
+        for (auto &thread : trace_registry) {
+            _TraceSpan span;
+            while (thread->spans.pop(span)) {
+                durations[span.name].push_back((span.end - span.start) / 1000.0);
+            }
+            dropped_spans += thread->dropped_spans.exchange(0);
+        }
+    }
+    dropped_spans += trace_unregistered_spans.exchange(0);
+    std::map<std::string, TraceStageSummary> summary;
+    for (auto &[name, stage_durations] : durations) {
+        std::sort(stage_durations.begin(), stage_durations.end());
+        double mean = 0;
+        for (double duration : stage_durations) {
+            mean += duration;
+        }
+        mean /= stage_durations.size();
+        double variance = 0;
+        for (double duration : stage_durations) {
+            variance += (duration - mean) * (duration - mean);
+        }
+        variance /= stage_durations.size();
+        summary[name] = {static_cast<long>(stage_durations.size()), stage_durations[stage_durations.size() / 2],
+                         stage_durations[stage_durations.size() * 99 / 100], stage_durations.back(),
+                         std::sqrt(variance)};
+    }
+    return summary;
+}
+
+void trace_print_summary(std::ostream &stream) {
+    long dropped = 0;
+    std::map<std::string, TraceStageSummary> summary = trace_summarize(dropped);
+    stream << std::fixed << std::setprecision(1);
+    for (auto &[name, stage] : summary) {
+        stream << name << ": " << stage.spans << " spans, median " << stage.median << " us, p99 "
+               << stage.p99 << " us, max " << stage.max << " us, jitter " << stage.jitter << " us" << std::endl;
+    }
+    if (dropped > 0) {
+        stream << "dropped spans: " << dropped << std::endl;
+    }
+}
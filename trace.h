@@ -0,0 +1,94 @@
+/**
+ * Fluidsynth for ImpactLX49+
+ * 
+ * Copyright (C) 2021 Thomas Keck
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <iosfwd>
+#include <map>
+#include <string>
+
+#include <time.h>
+
+#define TRACE_RING_SIZE 65536
+
+/**
+ * Optional tracing of the stages a midi event passes through.
+ * 
+ * Every stage records a span with its start and end time into a ring buffer
+ * owned by the calling thread, hence recording never takes a lock.
+ * The ring buffer is allocated when the thread is registered, which
+ * realtime_enter_thread does for every real-time thread.
+ * The spans are written as Chrome trace-event JSON, which can be opened
+ * with chrome://tracing or https://ui.perfetto.dev.
+ * 
+ * If tracing is disabled the only cost is a relaxed atomic load per stage.
+ */
+
+extern std::atomic<bool> trace_enabled;
+
+inline bool trace_is_enabled() {
+    return trace_enabled.load(std::memory_order_relaxed);
+}
+
+/**
+ * Returns the monotonic time in nanoseconds.
+ */
+inline uint64_t trace_now() {
+    timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return static_cast<uint64_t>(time.tv_sec) * 1000000000u + time.tv_nsec;
+}
+
+uint32_t trace_next_event_id();
+
+/**
+ * Allocates the ring buffer of the calling thread. Only the first call of a
+ * thread does anything. The spans of a thread that was never registered are
+ * dropped, so recording a span never locks or allocates.
+ */
+void trace_register_thread();
+
+void trace_span(const char *name, uint64_t start, uint64_t end, uint32_t event_id);
+void trace_start();
+bool trace_stop(const std::string &path);
+
+/**
+ * Number of spans of a stage and the median, 99th percentile, maximum and
+ * standard deviation (the jitter) of their durations in microseconds.
+ */
+struct TraceStageSummary {
+    long spans;
+    double median;
+    double p99;
+    double max;
+    double jitter;
+};
+
+/**
+ * Stops tracing and summarizes the recorded spans per stage. Adds the number
+ * of spans that were dropped to dropped_spans.
+ */
+std::map<std::string, TraceStageSummary> trace_summarize(long &dropped_spans);
+
+/**
+ * Stops tracing and prints the summary of every stage.
+ */
+void trace_print_summary(std::ostream &stream);
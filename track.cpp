@@ -18,57 +18,189 @@
  */
 
 
+#include <algorithm>
+
 #include "track.h"
 #include "midi_enums.h"
+#include "realtime.h"
+#include "trace.h"
+
+
+/**
+ * Converts the time between two CLOCK_MONOTONIC timestamps in nanoseconds to samples.
+ */
+static int samples_since(uint64_t start, uint64_t time) {
+  if (time <= start) {
+    return 0;
+  }
+  return (time - start) * TRACK_SAMPLE_RATE / 1000000000;
+}
 
 
 void track_callback(unsigned int time, fluid_event_t* event, fluid_sequencer_t* seq, void* data) {
+  realtime_enter_thread("track scheduling");
   Track *track = reinterpret_cast<Track*>(data);
-  track->playNextChunk();
+  track->handleCallback(reinterpret_cast<uintptr_t>(fluid_event_get_data(event)));
 }
 
 
-Track::Track(fluid_sequencer_t* sequencer, int seq_synth_id) : 
+Track::Track(fluid_sequencer_t* sequencer, int seq_synth_id, int seq_preset_id, RecordJournal* journal, TakePager *pager,
+             int track_index, const std::atomic<double> &master_rate, AutomationConfig automation_config) :
     sequencer(sequencer),
     seq_synth_id(seq_synth_id),
+    seq_preset_id(seq_preset_id),
+    journal(journal),
+    pager(pager),
+    track_index(track_index),
     is_recording(false),
-    is_playing(false) {
+    is_playing(false),
+    is_scheduling(false),
+    schedule_generation(0),
+    record_start_time(0),
+    record_duration(0),
+    loop_length(0),
+    last_record_time(0),
+    record_position(0),
+    last_record_sample(0),
+    play_start_time(0),
+    play_current_time(0),
+    master_rate(master_rate),
+    rate(1.0),
+    loop_scale(1.0),
+    playing_loop_scale(1.0),
+    loop_duration(0),
+    number_of_takes(0),
+    played_takes(0),
+    automation_config(automation_config) {
+        for (int take = 0; take < TRACK_MAX_TAKES; ++take) {
+            takes.push_back(std::make_unique<PagedTake>(pager));
+            automations.emplace_back(automation_config.tolerance);
+        }
+        automation_cursors.resize(TRACK_MAX_TAKES);
         seq_client_id = fluid_sequencer_register_client(sequencer, "track_callback", track_callback, this);
+        play_event = new_fluid_event();
+        // The source allows removing the scheduled events of this track.
+        fluid_event_set_source(play_event, seq_client_id);
+        fluid_event_set_dest(play_event, seq_synth_id);
+        preset_event = new_fluid_event();
+        fluid_event_set_source(preset_event, seq_client_id);
+        fluid_event_set_dest(preset_event, seq_preset_id);
+        callback_event = new_fluid_event();
+        fluid_event_set_source(callback_event, -1);
+        fluid_event_set_dest(callback_event, seq_client_id);
+        fluid_event_timer(callback_event, NULL);
+        command_event = new_fluid_event();
+        fluid_event_set_source(command_event, -1);
+        fluid_event_set_dest(command_event, seq_client_id);
+        resetLastValues();
 }
     
 Track::~Track() {
     fluid_sequencer_unregister_client(sequencer, seq_client_id);
-    for (auto &pair : record) {
-        delete_fluid_event(pair.second);
-    }
+    delete_fluid_event(play_event);
+    delete_fluid_event(preset_event);
+    delete_fluid_event(callback_event);
+    delete_fluid_event(command_event);
 }
 
-void Track::recordStart() {
+void Track::recordStart(uint64_t time) {
     if (not isRecording()) {
+    if (number_of_takes == TRACK_MAX_TAKES) {
+        pager->reportRejectedTake();
+        return;
+    }
     is_recording = true;
-    record_start_time = fluid_sequencer_get_tick(sequencer);
-    record_stop_time = record_start_time;
+    record_start_time = time;
+    record_duration = 0;
+    last_record_time = 0;
+    record_position = 0;
+    last_record_sample = 0;
+    takes[number_of_takes++]->start();
+    resetLastValues();
+    recorded_notes.clear();
+    appendToJournal(JournalRecordKind::JOURNAL_RECORD_START, 0, {});
     }
 }
 
-void Track::recordStop() {
+void Track::recordStop(uint64_t time) {
     if (isRecording()) {
     is_recording = false;
-    record_stop_time = fluid_sequencer_get_tick(sequencer);
+    record_duration = std::max(advanceRecordTime(time), last_record_time);
+    // Notes still held would otherwise sound until the next loop plays the same key.
+    recorded_notes.forEach([&](int channel, int key) {
+        MidiEvent note_off = {midi_event_type::NOTE_OFF, static_cast<uint8_t>(channel), static_cast<uint16_t>(key), 0};
+        if (takes[number_of_takes - 1]->append(record_duration, note_off)) {
+            appendToJournal(JournalRecordKind::JOURNAL_MIDI_EVENT, record_duration, note_off);
+        }
+    });
+    recorded_notes.clear();
+    takes[number_of_takes - 1]->finish();
+    automations[number_of_takes - 1].finish();
+    loop_length.store(std::max(loop_length.load(std::memory_order_relaxed), record_duration), std::memory_order_relaxed);
+    played_takes.store(number_of_takes, std::memory_order_release);
+    appendToJournal(JournalRecordKind::JOURNAL_RECORD_STOP, getRecordDuration(), {});
     }
 }
 
 void Track::playStart() {
-    if (not isPlaying()) {
-    is_playing = true;
-    play_start_time = fluid_sequencer_get_tick(sequencer);
-    scheduleNextCallback();
+    if (not is_playing.exchange(true)) {
+        sendCommand(TRACK_PLAY_START);
     }
 }
     
 void Track::playStop() {
-    if(isPlaying()) {
-    is_playing = false;
+    if (is_playing.exchange(false)) {
+        sendCommand(TRACK_PLAY_STOP);
+    }
+}
+
+void Track::sendCommand(int command) {
+    uintptr_t tick = fluid_sequencer_get_tick(sequencer);
+    fluid_event_timer(command_event, reinterpret_cast<void*>((tick << TRACK_COMMAND_BITS) | command));
+    fluid_sequencer_send_at(sequencer, command_event, 0, false);
+}
+
+void Track::handleCallback(uintptr_t data) {
+    int64_t time = static_cast<int64_t>(data >> TRACK_COMMAND_BITS) * SAMPLES_PER_TICK;
+    switch (data & ((1 << TRACK_COMMAND_BITS) - 1)) {
+    case TRACK_PLAY_START:
+        startScheduling(time);
+        break;
+    case TRACK_PLAY_STOP:
+        stopScheduling(time);
+        break;
+    default:
+        if ((data >> TRACK_COMMAND_BITS) == schedule_generation) {
+            playNextChunk();
+        }
+        break;
+    }
+}
+
+void Track::startScheduling(int64_t time) {
+    if (not is_scheduling) {
+    is_scheduling = true;
+    // A callback still pending from before the last stop would play every event twice.
+    ++schedule_generation;
+    fluid_event_timer(callback_event, reinterpret_cast<void*>(
+        (schedule_generation << TRACK_COMMAND_BITS) | TRACK_NEXT_CHUNK));
+    // The loop starts when the play button was pressed, not when the command arrived.
+    play_start_time = time;
+    play_current_time = play_start_time;
+    restartLoop();
+    // The first events are scheduled right away instead of after a callback time.
+    playNextChunk();
+    }
+}
+
+void Track::stopScheduling(int64_t time) {
+    if (is_scheduling) {
+    is_scheduling = false;
+    ++schedule_generation;
+    // Scheduled note offs are kept, so only the notes still held need one.
+    fluid_sequencer_remove_events(sequencer, seq_client_id, -1, FLUID_SEQ_NOTEON);
+    releasePlayingNotes(time);
+    playing_loop_scale.store(1.0, std::memory_order_relaxed);
     }
 }
 
@@ -80,97 +212,289 @@ bool Track::isRecording() const {
     return is_recording;
 }
 
+int Track::advanceRecordTime(uint64_t time) {
+    // Events of different devices may be stamped slightly out of order.
+    int sample = std::max(samples_since(record_start_time, time), last_record_sample);
+    // Converted piece by piece, so a rate change during the recording only affects the later events.
+    record_position += (sample - last_record_sample) / playing_loop_scale.load(std::memory_order_relaxed);
+    last_record_sample = sample;
+    return static_cast<int>(record_position);
+}
+
 int Track::getRecordDuration() const {
-    return record_stop_time - record_start_time;  
+    return record_duration;
 }
 
-int Track::getPlayDuration() const {
-    int current_time = fluid_sequencer_get_tick(sequencer);
-    return current_time - play_start_time;
+int64_t Track::getCurrentTime() const {
+    return static_cast<int64_t>(fluid_sequencer_get_tick(sequencer)) * SAMPLES_PER_TICK;
 }
 
-int Track::getScheduledPlayDuration() const {
+int64_t Track::getPlayDuration() const {
+    return getCurrentTime() - play_start_time;
+}
+
+int64_t Track::getScheduledPlayDuration() const {
     return play_current_time - play_start_time;
 
 }
 
-int Track::getRemainingPlayDuration() const {
-    return getRecordDuration() - getPlayDuration();
+int64_t Track::getRemainingPlayDuration() const {
+    return loop_duration - getPlayDuration();
 }
 
 void Track::scheduleNextCallback() {
-    fluid_event_t *evt = new_fluid_event();
-    fluid_event_set_source(evt, -1);
-    fluid_event_set_dest(evt, seq_client_id);
-    fluid_event_timer(evt, NULL);
-    fluid_sequencer_send_at(sequencer, evt, CALLBACK_TIME, false);
-    delete_fluid_event(evt);
+    fluid_sequencer_send_at(sequencer, callback_event, CALLBACK_TIME, false);
 }
 
-#include <iostream>
-
 void Track::playNextChunk() {
-    int current_time = fluid_sequencer_get_tick(sequencer);
-    if (isPlaying()) {
-        int remaining_play_duration = getRemainingPlayDuration();
-        if (remaining_play_duration < 0) {
-            std::cout << "restart " << remaining_play_duration << std::endl;
-            // We pretend to have started at the right time in between the callbacks.
-            play_start_time = current_time + remaining_play_duration;
-            play_current_time = current_time;
-        }
-        
-        int played_until = play_current_time;
-        for (auto &pair : record) {
-            // Considers scheduling recorded event if it will be due to play in twice the callback time.
-            if (pair.first < getPlayDuration() + 2 * CALLBACK_TIME) {
-            int play_time = play_start_time + pair.first;
-            // Play event if we haven't already played it.
-            if (play_time > play_current_time) {
-                fluid_sequencer_send_at(sequencer, pair.second, play_time, 1);
-            }
-            // Remembers until which time mark we already played.
-            if (play_time > played_until) {
-                played_until = play_time;
+    if (not is_scheduling) {
+        return;
+    }
+    int64_t current_time = getCurrentTime();
+    // Considers scheduling recorded events if they will be due to play in twice the callback time.
+    int64_t schedule_until = current_time + 2 * CALLBACK_TIME * SAMPLES_PER_TICK;
+    int64_t skip_until = play_current_time;
+    if (loop_duration > 0 && getRemainingPlayDuration() < 0) {
+        // The callbacks fell behind by more than a loop, the events in between are skipped.
+        play_start_time += getPlayDuration() / loop_duration * loop_duration;
+        releasePlayingNotes(current_time);
+        restartLoop();
+        skip_until = current_time;
+    }
+    scheduleEvents(schedule_until, skip_until);
+    scheduleAutomation(schedule_until, skip_until);
+    // The next loop is scheduled before this one ends, so its first events are not late.
+    while (loop_duration > 0 && play_start_time + loop_duration < schedule_until) {
+        play_start_time += loop_duration;
+        releasePlayingNotes(play_start_time);
+        restartLoop();
+        scheduleEvents(schedule_until, skip_until);
+        scheduleAutomation(schedule_until, skip_until);
+    }
+    play_current_time = schedule_until;
+
+    // Schedules next callback so the track keeps on playing.
+    scheduleNextCallback();
+}
+
+void Track::scheduleEvents(int64_t schedule_until, int64_t skip_until) {
+    int number_of_played_takes = played_takes.load(std::memory_order_acquire);
+    for (int take = 0; take < number_of_played_takes; ++take) {
+        int time;
+        MidiEvent event;
+        TakeCursor next = cursors[take];
+        // A traced event is dispatched from reading it out of its take until it is sent.
+        uint64_t dispatch_start = trace_is_enabled() ? trace_now() : 0;
+        while (takes[take]->read(next, time, event) && play_start_time + scaleTime(time) < schedule_until) {
+            cursors[take] = next;
+            int64_t play_time = play_start_time + scaleTime(time);
+            if (play_time < skip_until) {
+                continue;
             }
+            uint32_t event_id = dispatch_start != 0 ? trace_next_event_id() : 0;
+            fluid_event_t *sequencer_event = event.selectsPreset() ? preset_event : play_event;
+            encode_sequencer_event(event, sequencer_event);
+            sendPlayEvent(sequencer_event, play_time, event_id, dispatch_start);
+            playing_notes.update(event);
+            dispatch_start = trace_is_enabled() ? trace_now() : 0;
+        }
+        takes[take]->prefetch(cursors[take]);
+    }
+}
+
+void Track::scheduleAutomation(int64_t schedule_until, int64_t skip_until) {
+    // Like the events, the automation of the take being recorded is only read once it is finished.
+    int number_of_played_takes = played_takes.load(std::memory_order_acquire);
+    for (int take = 0; take < number_of_played_takes; ++take) {
+        const Automation &automation = automations[take];
+        for (size_t lane = 0; lane < automation.getNumberOfLanes(); ++lane) {
+            int time, value;
+            AutomationCursor next = automation_cursors[take][lane];
+            uint64_t dispatch_start = trace_is_enabled() ? trace_now() : 0;
+            while (automation.getLane(lane).read(next, automation_config.interval, time, value) &&
+                   play_start_time + scaleTime(time) < schedule_until) {
+                automation_cursors[take][lane] = next;
+                int64_t play_time = play_start_time + scaleTime(time);
+                if (play_time < skip_until) {
+                    continue;
+                }
+                uint32_t event_id = dispatch_start != 0 ? trace_next_event_id() : 0;
+                fluid_event_control_change(play_event, automation.getLane(lane).getChannel(),
+                                           automation.getLane(lane).getControl(), value);
+                sendPlayEvent(play_event, play_time, event_id, dispatch_start);
+                dispatch_start = trace_is_enabled() ? trace_now() : 0;
             }
         }
-        play_current_time = played_until;
+    }
+}
 
-        // Schedules next callback so the track keeps on playing.
-        scheduleNextCallback();
+/**
+ * Sends the event to the sequencer. A traced event, whose dispatch started
+ * when it was read, gets a "sequencer dispatch" span with its event id.
+ */
+void Track::sendPlayEvent(fluid_event_t *event, int64_t play_time, uint32_t event_id, uint64_t dispatch_start) {
+    unsigned int play_tick = (play_time + SAMPLES_PER_TICK / 2) / SAMPLES_PER_TICK;
+    fluid_sequencer_send_at(sequencer, event, play_tick, 1);
+    if (dispatch_start != 0) {
+        trace_span("sequencer dispatch", dispatch_start, trace_now(), event_id);
     }
 }
 
-void Track::maybeRecordMidiEvent(fluid_midi_event_t* event) {
+void Track::restartLoop() {
+    cursors.fill(TakeCursor());
+    for (auto &lane_cursors : automation_cursors) {
+        lane_cursors.fill(AutomationCursor());
+    }
+    // A loop is played with the same rate from start to end.
+    loop_scale = 1.0 / (rate.load(std::memory_order_relaxed) * master_rate.load(std::memory_order_relaxed));
+    playing_loop_scale.store(loop_scale, std::memory_order_relaxed);
+    loop_duration = scaleTime(loop_length.load(std::memory_order_relaxed));
+}
+
+void Track::releasePlayingNotes(int64_t time) {
+    unsigned int tick = (time + SAMPLES_PER_TICK / 2) / SAMPLES_PER_TICK;
+    playing_notes.forEach([&](int channel, int key) {
+        fluid_event_noteoff(play_event, channel, key);
+        fluid_sequencer_send_at(sequencer, play_event, tick, 1);
+    });
+    playing_notes.clear();
+}
+
+int64_t Track::scaleTime(int time) const {
+    return static_cast<int64_t>(time * loop_scale);
+}
+
+void Track::setRate(double rate) {
+    this->rate.store(rate, std::memory_order_relaxed);
+}
+
+void Track::maybeRecordMidiEvent(MidiEvent event) {
     if (isRecording()) {
-        int time = fluid_sequencer_get_tick(sequencer) - record_start_time;
-        record.push_back(std::make_pair(time, convertMidiEventToEvent(event)));
+        if (isDuplicateValue(event)) {
+            return;
+        }
+        int time = std::max(advanceRecordTime(event.time), last_record_time);
+        last_record_time = time;
+        // The journal keeps every value, so a recovered take is fitted again.
+        if (event.type == midi_event_type::CONTROL_CHANGE && is_automation_controller(event.control())) {
+            automations[number_of_takes - 1].append(time, event);
+            appendToJournal(JournalRecordKind::JOURNAL_MIDI_EVENT, time, event);
+            return;
+        }
+        if (takes[number_of_takes - 1]->append(time, event)) {
+            appendToJournal(JournalRecordKind::JOURNAL_MIDI_EVENT, time, event);
+            recorded_notes.update(event);
+        }
     }
 }
 
-fluid_event_t* Track::convertMidiEventToEvent(fluid_midi_event_t* midi_event) {
-    fluid_event_t *event = new_fluid_event();
-    fluid_event_set_dest(event, seq_synth_id);
-    
-    // See https://github.com/FluidSynth/fluidsynth/blob/
-    // 883ea24960f7af117747eb99c257022b1e3de750/src/midi/fluid_seqbind.c#L371
-    int type = fluid_midi_event_get_type(midi_event);
-    int channel = fluid_midi_event_get_channel(midi_event);
-    int key = fluid_midi_event_get_key(midi_event);
-    int control = fluid_midi_event_get_control(midi_event);
-    int value = fluid_midi_event_get_value(midi_event);
-    int velocity = fluid_midi_event_get_velocity(midi_event);
-    switch(type) {
-    case midi_event_type::NOTE_OFF:
-        fluid_event_noteoff(event, channel, key);
+/**
+ * Bank select, data entry and (N)RPN controllers only take effect together
+ * with the controllers sent around them, e.g. the same parameter number is
+ * selected again before every data entry, hence a repeated value is kept.
+ */
+static bool is_parameter_controller(int control) {
+    switch (control) {
+        case MIDI_BANK_SELECT:
+        case MIDI_BANK_SELECT_LSB:
+        case MIDI_DATA_ENTRY:
+        case MIDI_DATA_ENTRY_LSB:
+        case MIDI_NRPN_LSB:
+        case MIDI_NRPN_MSB:
+        case MIDI_RPN_LSB:
+        case MIDI_RPN_MSB:
+            return true;
+        default:
+            return false;
+    }
+}
+
+bool Track::isDuplicateValue(MidiEvent event) {
+    int16_t *last_value;
+    int value;
+    switch(event.type) {
+    case midi_event_type::CONTROL_CHANGE:
+        if (is_parameter_controller(event.control())) {
+            return false;
+        }
+        last_value = &last_control_values[event.channel][event.control() & 0x7f];
+        value = event.value();
         break;
-    case midi_event_type::NOTE_ON:
-        fluid_event_noteon(event, channel, key, velocity);
+    case midi_event_type::KEY_PRESSURE:
+        last_value = &last_key_pressure_values[event.channel][event.key() & 0x7f];
+        value = event.value();
         break;
-    case midi_event_type::CONTROL_CHANGE:
-        fluid_event_control_change(event, channel, control, value);
+    case midi_event_type::CHANNEL_PRESSURE:
+        last_value = &last_channel_pressure_values[event.channel];
+        value = event.param1;
         break;
-    }	
-    return event;
-}
\ No newline at end of file
+    case midi_event_type::PITCH_BEND:
+        last_value = &last_pitch_bend_values[event.channel];
+        value = event.pitch();
+        break;
+    default:
+        return false;
+    }
+    if (*last_value == value) {
+        return true;
+    }
+    *last_value = value;
+    return false;
+}
+
+void Track::resetLastValues() {
+    for (auto &values : last_control_values) {
+        values.fill(-1);
+    }
+    for (auto &values : last_key_pressure_values) {
+        values.fill(-1);
+    }
+    last_channel_pressure_values.fill(-1);
+    last_pitch_bend_values.fill(-1);
+}
+
+void Track::restoreRecording(const RecoveredTrack &recovered) {
+    record_start_time = 0;
+    record_duration = recovered.duration;
+    loop_length.store(recovered.duration, std::memory_order_relaxed);
+    for (auto &take : recovered.takes) {
+        if (number_of_takes == TRACK_MAX_TAKES) {
+            pager->reportRejectedTake();
+            break;
+        }
+        PagedTake &paged_take = *takes[number_of_takes++];
+        paged_take.start();
+        for (auto &journal_record : take) {
+            MidiEvent event = {journal_record.type, journal_record.channel, journal_record.param1, journal_record.param2};
+            if (event.type == midi_event_type::CONTROL_CHANGE && is_automation_controller(event.control())) {
+                automations[number_of_takes - 1].append(journal_record.time, event);
+            } else {
+                // Unlike the dispatch thread, restoring can wait until a full page is written.
+                paged_take.waitForPager();
+                paged_take.append(journal_record.time, event);
+            }
+        }
+        paged_take.finish();
+        automations[number_of_takes - 1].finish();
+    }
+    played_takes.store(number_of_takes, std::memory_order_release);
+}
+
+void Track::setTrackIndex(int track_index) {
+    this->track_index = track_index;
+}
+
+void Track::appendToJournal(JournalRecordKind kind, int time, MidiEvent event) {
+    if (journal == nullptr) {
+        return;
+    }
+    JournalRecord journal_record = {};
+    journal_record.time = time;
+    journal_record.track = track_index;
+    journal_record.kind = kind;
+    journal_record.type = event.type;
+    journal_record.channel = event.channel;
+    journal_record.param1 = event.param1;
+    journal_record.param2 = event.param2;
+    journal->append(journal_record);
+}
@@ -19,46 +19,167 @@
 
 #pragma once
 
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <memory>
 #include <vector>
-#include <utility>
 #include <fluidsynth.h>
 
+#include "active_notes.h"
+#include "automation.h"
+#include "midi_event.h"
+#include "record_journal.h"
+#include "take_pager.h"
+
 #define CALLBACK_TIME 50
+// Commands carried by the data of the timer events of a track, the
+// remaining bits hold the generation of a chunk callback, or the tick
+// at which the playback was started or stopped.
+#define TRACK_NEXT_CHUNK 0
+#define TRACK_PLAY_START 1
+#define TRACK_PLAY_STOP 2
+#define TRACK_COMMAND_BITS 2
+// The takes are allocated with the track, so recording never allocates.
+#define TRACK_MAX_TAKES 16
+// The recorded times are in samples, the sequencer counts milliseconds.
+#define SAMPLES_PER_TICK (TRACK_SAMPLE_RATE / 1000)
 
+/**
+ * Records midi events into takes and plays them in a loop through the sequencer.
+ *
+ * The tempo of the playback is a rate relative to the recorded tempo, the
+ * product of the rate of the track and the master rate shared by all tracks.
+ * It is applied when a recorded time is scheduled, so the recorded events are
+ * never rewritten, and a new rate takes effect at the next loop boundary.
+ *
+ * The notes held at the end of a recording are released at its end, and the
+ * notes of the playback which are still sounding are released when the
+ * playback stops and at the end of every loop.
+ *
+ * Starting and stopping the playback only sends a command to the sequencer,
+ * everything the playback schedules is owned by the sequencer thread.
+ *
+ * A take is only played once its recording is finished, from then on it
+ * belongs to the sequencer thread. Its events are paged, so a take of any
+ * length only keeps two pages in memory (see PagedTake).
+ *
+ * The knobs of the effects and the filter are recorded as automation lanes
+ * of the take instead of events, whose values are regenerated when the
+ * events of the next chunk are scheduled.
+ */
 class Track {
 
     public:
-        Track(fluid_sequencer_t* sequencer, int seq_synth_id);
+        Track(fluid_sequencer_t* sequencer, int seq_synth_id, int seq_preset_id, RecordJournal* journal, TakePager *pager,
+              int track_index, const std::atomic<double> &master_rate, AutomationConfig automation_config);
         ~Track();
-        void recordStart();
-        void recordStop();
+        void recordStart(uint64_t time);
+        void recordStop(uint64_t time);
         void playStart();
         void playStop();
         bool isPlaying() const;
         bool isRecording() const;
 
-        void playNextChunk();
-        void maybeRecordMidiEvent(fluid_midi_event_t* event);
+        void handleCallback(uintptr_t data);
+        void maybeRecordMidiEvent(MidiEvent event);
+        void restoreRecording(const RecoveredTrack &recovered);
+        void setTrackIndex(int track_index);
+        void setRate(double rate);
 
     private:
+        int advanceRecordTime(uint64_t time);
         int getRecordDuration() const;
-        int getPlayDuration() const;
-        int getScheduledPlayDuration() const;
-        int getRemainingPlayDuration() const;
+        int64_t getCurrentTime() const;
+        int64_t getPlayDuration() const;
+        int64_t getScheduledPlayDuration() const;
+        int64_t getRemainingPlayDuration() const;
 
+        void sendCommand(int command);
+        void startScheduling(int64_t time);
+        void stopScheduling(int64_t time);
+        void playNextChunk();
 		void scheduleNextCallback();
+        void scheduleEvents(int64_t schedule_until, int64_t skip_until);
+        void scheduleAutomation(int64_t schedule_until, int64_t skip_until);
+        void sendPlayEvent(fluid_event_t *event, int64_t play_time, uint32_t event_id, uint64_t dispatch_start);
+        void restartLoop();
+        void releasePlayingNotes(int64_t time);
+        int64_t scaleTime(int time) const;
 
-        fluid_event_t* convertMidiEventToEvent(fluid_midi_event_t* midi_event);
+        bool isDuplicateValue(MidiEvent event);
+        void resetLastValues();
+        void appendToJournal(JournalRecordKind kind, int time, MidiEvent event);
 
   private:
     fluid_sequencer_t *sequencer;
     int seq_synth_id;
+    // Receives the program changes and bank selects, the preset router if
+    // there is one (see PresetRouter), otherwise the synth.
+    int seq_preset_id;
     int seq_client_id;
+    RecordJournal *journal;
+    TakePager *pager;
+    int track_index;
     bool is_recording;
-    bool is_playing;
-	int record_start_time;
-    int record_stop_time;
-	int play_start_time;
-    int play_current_time;
-    std::vector<std::pair<int, fluid_event_t*>> record;
+    // Written by the dispatch thread, the sequencer thread follows it
+    // through the commands in is_scheduling.
+    std::atomic<bool> is_playing;
+    bool is_scheduling;
+    // Incremented by the sequencer thread whenever the playback starts or
+    // stops, so chunk callbacks of an earlier playback are ignored.
+    uintptr_t schedule_generation;
+    // CLOCK_MONOTONIC time in nanoseconds at which the recording started.
+    uint64_t record_start_time;
+    // In samples, like the times of the recorded events.
+    int record_duration;
+    // Duration of the longest finished take, written by the dispatch thread when a
+    // take is finished. The take being recorded does not change the loop it is played over.
+    std::atomic<int> loop_length;
+    int last_record_time;
+    // The recorded time in samples of the take and in samples since the start of the recording.
+    double record_position;
+    int last_record_sample;
+    // In samples since the start of the sequencer, so the start of the
+    // next loop does not accumulate rounding errors.
+    int64_t play_start_time;
+    int64_t play_current_time;
+    // Rates are written by the dispatch thread and latched by the
+    // sequencer thread at the start of every loop.
+    const std::atomic<double> &master_rate;
+    std::atomic<double> rate;
+    // Samples played per recorded sample in the current loop.
+    double loop_scale;
+    // The loop scale published by the sequencer thread, 1 while the track does not play.
+    // An overdub is recorded in the tempo of the takes, since the scale is applied again
+    // when it is played.
+    std::atomic<double> playing_loop_scale;
+    int64_t loop_duration;
+    // Every recording is a separate take, so overdubs don't need to be sorted in.
+    std::vector<std::unique_ptr<PagedTake>> takes;
+    int number_of_takes;
+    // The takes which are finished, published to the sequencer thread.
+    std::atomic<int> played_takes;
+    std::array<TakeCursor, TRACK_MAX_TAKES> cursors;
+    AutomationConfig automation_config;
+    // The automation of each take, next to its events. Allocated with the track,
+    // so the sequencer thread never reads a vector the dispatch thread grows.
+    std::vector<Automation> automations;
+    std::vector<std::array<AutomationCursor, AUTOMATION_MAX_LANES>> automation_cursors;
+    // Notes of the current take, whose note off has not been recorded yet.
+    ActiveNotes recorded_notes;
+    // Notes whose note on has been scheduled, but not their note off.
+    ActiveNotes playing_notes;
+    // Reused for every scheduled event, the sequencer copies it.
+    fluid_event_t *play_event;
+    fluid_event_t *preset_event;
+    fluid_event_t *callback_event;
+    // Used by the dispatch thread, which must not touch the events above.
+    fluid_event_t *command_event;
+    // Last recorded value of the continuous controllers per channel,
+    // used to drop repeated values.
+    std::array<std::array<int16_t, 128>, 16> last_control_values;
+    std::array<std::array<int16_t, 128>, 16> last_key_pressure_values;
+    std::array<int16_t, 16> last_channel_pressure_values;
+    std::array<int16_t, 16> last_pitch_bend_values;
 };